@@ -0,0 +1,239 @@
+#pragma once
+
+#include "Utils.h"
+
+#include "SDL.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+// APU register logs: every write to the sound registers and wave RAM with its cycle timestamp, plus resets and the ends of emulation
+// slices, which is all Sound needs to synthesize the same audio again (see Sound::SetRegisterLog and Sound::ReplayRegisterLogSlice).
+// A log is a few bytes per write, and compresses well, against 176 kB per second of 44.1 kHz PCM.
+//
+// The format is streamed, VGM-style: a header of "GBAL" and a version byte, then one command byte per event.  The low 6 bits are the
+// event: 0x00-0x2F is a write to register 0xFF10 plus that, and is followed by the value; 0x30 ends a slice; 0x31 resets the APU.
+// With bit 6 set, the command byte is followed by the number of cycles since the previous event, as a little-endian base-128 varint
+// (before the value, for writes).  Without it, the event happened at the same cycle as the previous one.
+class ApuLogFormat
+{
+public:
+	enum class EventType
+	{
+		Write,
+		EndOfSlice,
+		Reset,
+	};
+
+	struct Event
+	{
+		EventType type;
+		Uint32 cycles; // since the previous event
+		Uint16 address; // writes only
+		Uint8 value;
+	};
+
+protected:
+	static const Uint8 kVersion = 1;
+	static const int kHeaderSize = 5;
+
+	static const Uint16 kRegisterBase = 0xFF10;
+	static const Uint16 kRegisterRangeSize = 0xFF40 - kRegisterBase;
+	static const Uint8 kEndOfSliceCommand = 0x30;
+	static const Uint8 kResetCommand = 0x31;
+	static const Uint8 kCommandMask = 0x3F;
+	static const Uint8 kCyclesFollowFlag = 0x40;
+
+	static const size_t kBufferSize = 64 * 1024;
+};
+
+class ApuLogWriter : public ApuLogFormat
+{
+public:
+	ApuLogWriter(const char* pFileName)
+		: m_pFile(nullptr)
+		, m_numBytesFlushed(0)
+	{
+		fopen_s(&m_pFile, pFileName, "wb");
+		if (!m_pFile)
+		{
+			throw Exception("Couldn't open %s for writing", pFileName);
+		}
+
+		const Uint8 header[kHeaderSize] = { 'G', 'B', 'A', 'L', kVersion };
+		m_buffer.insert(m_buffer.end(), header, header + kHeaderSize);
+	}
+
+	~ApuLogWriter()
+	{
+		Flush();
+		fclose(m_pFile);
+	}
+
+	// Register 0xFF10-0xFF3F
+	void Write(Uint32 cycles, Uint16 address, Uint8 value)
+	{
+		SDL_assert(IsAddressInRange(address, kRegisterBase, kRegisterRangeSize));
+		WriteCommand(static_cast<Uint8>(address - kRegisterBase), cycles);
+		m_buffer.push_back(value);
+		FlushIfFull();
+	}
+
+	void EndSlice(Uint32 cycles)
+	{
+		WriteCommand(kEndOfSliceCommand, cycles);
+		FlushIfFull();
+	}
+
+	void Reset(Uint32 cycles)
+	{
+		WriteCommand(kResetCommand, cycles);
+		FlushIfFull();
+	}
+
+	// Everything logged so far, including what's still buffered
+	Uint64 GetNumBytesLogged() const
+	{
+		return m_numBytesFlushed + m_buffer.size();
+	}
+
+private:
+	void WriteCommand(Uint8 command, Uint32 cycles)
+	{
+		if (cycles == 0)
+		{
+			m_buffer.push_back(command);
+			return;
+		}
+
+		m_buffer.push_back(command | kCyclesFollowFlag);
+		while (cycles >= 0x80)
+		{
+			m_buffer.push_back(static_cast<Uint8>(cycles | 0x80));
+			cycles >>= 7;
+		}
+		m_buffer.push_back(static_cast<Uint8>(cycles));
+	}
+
+	void FlushIfFull()
+	{
+		if (m_buffer.size() >= kBufferSize)
+		{
+			Flush();
+		}
+	}
+
+	void Flush()
+	{
+		fwrite(m_buffer.data(), 1, m_buffer.size(), m_pFile);
+		m_numBytesFlushed += m_buffer.size();
+		m_buffer.clear();
+	}
+
+	FILE* m_pFile;
+	std::vector<Uint8> m_buffer;
+	Uint64 m_numBytesFlushed;
+};
+
+class ApuLogReader : public ApuLogFormat
+{
+public:
+	ApuLogReader(const char* pFileName)
+		: m_pFile(nullptr)
+		, m_bufferPosition(0)
+	{
+		fopen_s(&m_pFile, pFileName, "rb");
+		if (!m_pFile)
+		{
+			throw Exception("Couldn't open %s", pFileName);
+		}
+
+		Uint8 header[kHeaderSize];
+		for (int i = 0; i < kHeaderSize; ++i)
+		{
+			if (!ReadByte(header[i]))
+			{
+				header[i] = 0;
+			}
+		}
+		if ((memcmp(header, "GBAL", 4) != 0) || (header[4] != kVersion))
+		{
+			fclose(m_pFile);
+			throw Exception("%s is not a version %d APU register log", pFileName, kVersion);
+		}
+	}
+
+	~ApuLogReader()
+	{
+		fclose(m_pFile);
+	}
+
+	// Returns false at the end of the log; a log cut off mid-event (by a crash, say) ends at the last complete one
+	bool ReadEvent(Event& event)
+	{
+		Uint8 command = 0;
+		if (!ReadByte(command))
+		{
+			return false;
+		}
+
+		event.cycles = 0;
+		if (command & kCyclesFollowFlag)
+		{
+			Uint8 byte = 0;
+			int shift = 0;
+			do
+			{
+				if (!ReadByte(byte) || (shift > 28))
+				{
+					return false;
+				}
+				event.cycles |= static_cast<Uint32>(byte & 0x7F) << shift;
+				shift += 7;
+			} while (byte & 0x80);
+		}
+
+		command &= kCommandMask;
+		if (command < kRegisterRangeSize)
+		{
+			event.type = EventType::Write;
+			event.address = kRegisterBase + command;
+			return ReadByte(event.value);
+		}
+		else if (command == kEndOfSliceCommand)
+		{
+			event.type = EventType::EndOfSlice;
+			return true;
+		}
+		else if (command == kResetCommand)
+		{
+			event.type = EventType::Reset;
+			return true;
+		}
+
+		throw Exception("Unknown APU register log command: 0x%02lX", command);
+	}
+
+private:
+	bool ReadByte(Uint8& value)
+	{
+		if (m_bufferPosition == m_buffer.size())
+		{
+			m_buffer.resize(kBufferSize);
+			m_buffer.resize(fread(m_buffer.data(), 1, kBufferSize, m_pFile));
+			m_bufferPosition = 0;
+			if (m_buffer.empty())
+			{
+				return false;
+			}
+		}
+
+		value = m_buffer[m_bufferPosition++];
+		return true;
+	}
+
+	FILE* m_pFile;
+	std::vector<Uint8> m_buffer;
+	size_t m_bufferPosition;
+};
@@ -0,0 +1,264 @@
+#pragma once
+
+#include "AudioSink.h"
+#include "AudioRingBuffer.h"
+
+#include <atomic>
+#include <vector>
+
+// Plays through the default SDL audio device.  Frames go through a lock-free ring buffer to the device callback, and the output
+// rate is steered from the buffer's fill level so emulation and the device clock don't drift apart (see EndSlice).
+class AudioDeviceSink : public IAudioSink
+{
+public:
+	static const int kDefaultLatencyFrames = 1024; // below 1024, things start to get dicey with xaudio on my hardware
+	static const int kMinLatencyFrames = 256;
+
+	static void AudioCallback(void* userdata, Uint8* pStream8, int numBytes)
+	{
+		Sint16* pStream16 = reinterpret_cast<Sint16*>(pStream8);
+		reinterpret_cast<AudioDeviceSink*>(userdata)->FillStreamBuffer(pStream16, numBytes);
+	}
+
+	AudioDeviceSink()
+		: m_deviceId(0)
+		, m_sampleRate(0)
+		, m_latencyFrames(kDefaultLatencyFrames)
+		, m_dynamicRateControlEnabled(true)
+		, m_outputRateRatio(1.0)
+	{
+		m_requestedLatencyFrames = kDefaultLatencyFrames;
+		m_audioDeviceActive = false;
+		m_numDroppedSamples = 0;
+		m_numStarvedSamples = 0;
+	}
+
+	~AudioDeviceSink()
+	{
+		CloseAudioDevice();
+	}
+
+	virtual void SetSampleRate(int sampleRate)
+	{
+		int latencyFrames = m_requestedLatencyFrames;
+		if ((sampleRate != m_sampleRate) || (latencyFrames != m_latencyFrames))
+		{
+			m_sampleRate = sampleRate;
+			m_latencyFrames = latencyFrames;
+			ReopenAudioDevice();
+		}
+	}
+
+	// Size of the device buffer, in stereo frames; the ring buffer holds about one more of these, so this sets the output latency.
+	// The device has to be reopened for this, which the producer does at the end of its next slice (see EndSlice), so the ring buffer
+	// isn't reallocated under the synthesis thread.
+	void SetLatency(int numFrames)
+	{
+		m_requestedLatencyFrames = SDL_max(numFrames, kMinLatencyFrames);
+	}
+
+	int GetLatency() const
+	{
+		return m_requestedLatencyFrames;
+	}
+
+	// Samples lost because the ring buffer was full (emulation ahead of the device) or empty (device ahead of emulation)
+	Uint32 GetNumDroppedSamples() const
+	{
+		return m_numDroppedSamples;
+	}
+
+	Uint32 GetNumStarvedSamples() const
+	{
+		return m_numStarvedSamples;
+	}
+
+	// When enabled, the output rate is nudged by a fraction of a percent to keep the ring buffer near its target fill level.
+	// Emulation is paced by the host (vsync or SDL_GetTicks) and the audio device by its own clock; left alone, the difference
+	// accumulates until the buffer starves or overflows.  Takes effect at the end of the next slice.
+	void SetDynamicRateControlEnabled(bool enabled)
+	{
+		m_dynamicRateControlEnabled = enabled;
+	}
+
+	bool IsDynamicRateControlEnabled() const
+	{
+		return m_dynamicRateControlEnabled;
+	}
+
+	virtual void Reset()
+	{
+		ResetRingBuffer();
+		m_audioDeviceActive = false;
+	}
+
+	// Not until the device starts pulling
+	virtual bool IsReady() const
+	{
+		return m_audioDeviceActive;
+	}
+
+	virtual void WriteFrames(const Sint16* pFrames, int numFrames)
+	{
+		Uint32 numSamples = numFrames * kNumChannels;
+		Uint32 numWritten = m_ringBuffer.Write(pFrames, numSamples);
+		m_numDroppedSamples += numSamples - numWritten;
+	}
+
+	virtual double EndSlice(int numSliceFrames)
+	{
+		// On the producer's thread, between writes, so nothing else touches the producer side while the device is reopened
+		int latencyFrames = m_requestedLatencyFrames;
+		if (latencyFrames != m_latencyFrames)
+		{
+			m_latencyFrames = latencyFrames;
+			ReopenAudioDevice();
+		}
+
+		if (!m_audioDeviceActive)
+		{
+			return m_outputRateRatio;
+		}
+
+		// Samples come in bursts of one slice, so right after a burst the buffer should hold a device buffer's worth on top of what
+		// will be drained before the next one.  Both the burst size and the fill level are smoothed, otherwise the device callback
+		// timing would make the pitch wobble.
+		const float smoothing = 0.05f;
+		m_averageSliceFrames += (numSliceFrames - m_averageSliceFrames) * smoothing;
+
+		float fillFrames = static_cast<float>(m_ringBuffer.GetNumSamplesAvailable() / kNumChannels);
+		m_averageFillFrames += (fillFrames - m_averageFillFrames) * smoothing;
+
+		if (!m_dynamicRateControlEnabled)
+		{
+			m_rateIntegral = 0.0;
+			m_outputRateRatio = 1.0;
+			return m_outputRateRatio;
+		}
+
+		// Proportional-integral: the integral term settles on the actual clock difference, the proportional term pulls the fill level
+		// back to the target
+		const double maxRateAdjustment = 0.005; // +/-0.5%, too small to hear as a pitch change
+		const double proportionalGain = 0.002;
+		const double integralGain = 0.00002;
+		float targetFrames = m_latencyFrames + m_averageSliceFrames;
+		double error = (targetFrames - m_averageFillFrames) / targetFrames;
+		error = SDL_max(-1.0, SDL_min(1.0, error));
+		m_rateIntegral = SDL_max(-maxRateAdjustment, SDL_min(maxRateAdjustment, m_rateIntegral + integralGain * error));
+		double adjustment = SDL_max(-maxRateAdjustment, SDL_min(maxRateAdjustment, m_rateIntegral + proportionalGain * error));
+		m_outputRateRatio = 1.0 + adjustment;
+		return m_outputRateRatio;
+	}
+
+private:
+	void OpenAudioDevice()
+	{
+		SDL_assert(m_deviceId == 0);
+
+		if (SDL_GetNumAudioDevices(0) > 0)
+		{
+			// Get default audio device
+			auto deviceName = SDL_GetAudioDeviceName(0, 0);
+
+			SDL_AudioSpec desiredSpec;
+			SDL_zero(desiredSpec);
+			desiredSpec.freq = m_sampleRate;
+			desiredSpec.format = AUDIO_S16SYS;
+			desiredSpec.channels = kNumChannels;
+			desiredSpec.samples = static_cast<Uint16>(m_latencyFrames);
+			desiredSpec.callback = &AudioCallback;
+			desiredSpec.userdata = this;
+
+			SDL_AudioSpec obtainedSpec;
+
+			auto deviceId = SDL_OpenAudioDevice(deviceName, 0, &desiredSpec, &obtainedSpec, 0);
+			if (deviceId != 0)
+			{
+				m_deviceId = deviceId;
+			}
+		}
+	}
+
+	void CloseAudioDevice()
+	{
+		if (m_deviceId != 0)
+		{
+			SDL_CloseAudioDevice(m_deviceId);
+			m_deviceId = 0;
+		}
+		m_audioDeviceActive = false;
+	}
+
+	void ReopenAudioDevice()
+	{
+		CloseAudioDevice();
+		OpenAudioDevice();
+		ResetRingBuffer();
+
+		if (m_deviceId != 0)
+		{
+			SDL_PauseAudioDevice(m_deviceId, 0);
+		}
+	}
+
+	void ResetRingBuffer()
+	{
+		if (m_deviceId != 0)
+		{
+			SDL_LockAudioDevice(m_deviceId);
+		}
+
+		// Room for the latency window twice over, plus a host frame's worth of emulation, which is produced in a single burst
+		int hostFrameFrames = m_sampleRate / 60;
+		m_ringBuffer.Reset((2 * m_latencyFrames + hostFrameFrames) * kNumChannels);
+
+		// Start at the fill level the rate control aims for (see EndSlice), with silence
+		std::vector<Sint16> silence((m_latencyFrames + hostFrameFrames) * kNumChannels, 0);
+		m_ringBuffer.Write(silence.data(), static_cast<Uint32>(silence.size()));
+
+		m_numDroppedSamples = 0;
+		m_numStarvedSamples = 0;
+
+		m_averageSliceFrames = static_cast<float>(hostFrameFrames);
+		m_averageFillFrames = static_cast<float>(m_latencyFrames + hostFrameFrames);
+		m_rateIntegral = 0.0;
+		m_outputRateRatio = 1.0;
+
+		if (m_deviceId != 0)
+		{
+			SDL_UnlockAudioDevice(m_deviceId);
+		}
+	}
+
+	// Called on the audio thread; only touches the consumer side of the ring buffer
+	void FillStreamBuffer(Sint16* pBuffer, int numBytes)
+	{
+		m_audioDeviceActive = true;
+
+		Uint32 numSamples = numBytes / sizeof(Sint16);
+		Uint32 numRead = m_ringBuffer.Read(pBuffer, numSamples);
+		if (numRead < numSamples)
+		{
+			// Sound device starvation
+			memset(pBuffer + numRead, 0, (numSamples - numRead) * sizeof(Sint16));
+			m_numStarvedSamples += numSamples - numRead;
+		}
+	}
+
+	SDL_AudioDeviceID m_deviceId;
+	int m_sampleRate;
+	int m_latencyFrames; // what the device is open with; only the producer changes it
+	std::atomic<int> m_requestedLatencyFrames;
+
+	std::atomic<bool> m_audioDeviceActive;
+
+	AudioRingBuffer m_ringBuffer;
+	std::atomic<Uint32> m_numDroppedSamples;
+	std::atomic<Uint32> m_numStarvedSamples;
+
+	std::atomic<bool> m_dynamicRateControlEnabled;
+	double m_outputRateRatio;
+	double m_rateIntegral;
+	float m_averageSliceFrames;
+	float m_averageFillFrames;
+};
@@ -0,0 +1,192 @@
+#pragma once
+
+#include "SDL.h"
+
+#include <math.h>
+#include <vector>
+
+#if defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2)) || defined(__SSE2__)
+#define AUDIO_RESAMPLER_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// Polyphase FIR resampler for interleaved 16-bit stereo.  The filter is a Blackman-windowed sinc, tabulated for a number of
+// sub-sample phases; each output sample picks the phase nearest to its position between input samples.  The cutoff is placed so the
+// stopband starts at the lower of the two Nyquist frequencies, so nothing aliases; longer filters get a sharper transition, and
+// therefore more treble, for more work per sample.
+class AudioResampler
+{
+public:
+	static const int kNumChannels = 2;
+	static const int kCoefficientBits = 14; // each phase sums to 1 << kCoefficientBits; leaves headroom for the 32-bit accumulators
+
+	AudioResampler()
+		: m_numTaps(0)
+		, m_phaseBits(0)
+		, m_inputRate(0.0)
+		, m_step(0)
+		, m_position(0)
+	{
+	}
+
+	// numTaps is rounded up to a multiple of 8, the SSE2 width.  Drops anything buffered.
+	void Configure(double inputRate, double outputRate, int numTaps, int phaseBits)
+	{
+		m_numTaps = (numTaps + 7) & ~7;
+		m_phaseBits = phaseBits;
+		m_inputRate = inputRate;
+		ComputeKernel(SDL_min(1.0, outputRate / inputRate));
+		SetOutputRate(outputRate);
+		Reset();
+	}
+
+	// Adjusts the conversion ratio without recomputing the filter, for small changes such as dynamic rate control
+	void SetOutputRate(double outputRate)
+	{
+		m_step = static_cast<Uint64>(m_inputRate / outputRate * kFixedOne + 0.5);
+	}
+
+	void Reset()
+	{
+		m_position = 0;
+		for (int channel = 0; channel < kNumChannels; ++channel)
+		{
+			m_history[channel].clear();
+		}
+	}
+
+	void Write(const Sint16* pFrames, int numFrames)
+	{
+		for (int channel = 0; channel < kNumChannels; ++channel)
+		{
+			std::vector<Sint16>& history = m_history[channel];
+			size_t start = history.size();
+			history.resize(start + numFrames);
+			for (int i = 0; i < numFrames; ++i)
+			{
+				history[start + i] = pFrames[i * kNumChannels + channel];
+			}
+		}
+	}
+
+	// Produces up to maxFrames interleaved frames from what's been written so far; returns the number produced
+	int Read(Sint16* pFrames, int maxFrames)
+	{
+		if (m_numTaps == 0)
+		{
+			return 0;
+		}
+
+		const int numPhases = 1 << m_phaseBits;
+		const Uint64 numInputFrames = m_history[0].size();
+
+		int numFrames = 0;
+		while ((numFrames < maxFrames) && ((m_position >> kFixedBits) + m_numTaps <= numInputFrames))
+		{
+			size_t index = static_cast<size_t>(m_position >> kFixedBits);
+			int phase = static_cast<int>(m_position >> (kFixedBits - m_phaseBits)) & (numPhases - 1);
+			const Sint16* pCoefficients = &m_kernel[phase * m_numTaps];
+
+			for (int channel = 0; channel < kNumChannels; ++channel)
+			{
+				Sint32 sample = DotProduct(&m_history[channel][index], pCoefficients, m_numTaps) >> kCoefficientBits;
+				pFrames[numFrames * kNumChannels + channel] = static_cast<Sint16>(SDL_max(-32768, SDL_min(32767, sample)));
+			}
+
+			m_position += m_step;
+			++numFrames;
+		}
+
+		// Drop the input that no future output reaches back to
+		size_t numConsumed = static_cast<size_t>(SDL_min(m_position >> kFixedBits, numInputFrames));
+		if (numConsumed > 0)
+		{
+			for (int channel = 0; channel < kNumChannels; ++channel)
+			{
+				m_history[channel].erase(m_history[channel].begin(), m_history[channel].begin() + numConsumed);
+			}
+			m_position -= static_cast<Uint64>(numConsumed) << kFixedBits;
+		}
+
+		return numFrames;
+	}
+
+private:
+	static const int kFixedBits = 32;
+	static const Uint64 kFixedOne = static_cast<Uint64>(1) << kFixedBits;
+
+	// numTaps is a multiple of 8
+	static Sint32 DotProduct(const Sint16* pSamples, const Sint16* pCoefficients, int numTaps)
+	{
+#ifdef AUDIO_RESAMPLER_SSE2
+		__m128i sums = _mm_setzero_si128();
+		for (int i = 0; i < numTaps; i += 8)
+		{
+			__m128i samples = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSamples + i));
+			__m128i coefficients = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pCoefficients + i));
+			sums = _mm_add_epi32(sums, _mm_madd_epi16(samples, coefficients));
+		}
+		sums = _mm_add_epi32(sums, _mm_shuffle_epi32(sums, _MM_SHUFFLE(1, 0, 3, 2)));
+		sums = _mm_add_epi32(sums, _mm_shuffle_epi32(sums, _MM_SHUFFLE(2, 3, 0, 1)));
+		return _mm_cvtsi128_si32(sums);
+#else
+		Sint32 sum = 0;
+		for (int i = 0; i < numTaps; ++i)
+		{
+			sum += pSamples[i] * pCoefficients[i];
+		}
+		return sum;
+#endif
+	}
+
+	// bandwidth is the fraction of the input's Nyquist frequency that survives: 1 when upsampling, the rate ratio when downsampling
+	void ComputeKernel(double bandwidth)
+	{
+		const double pi = 3.14159265358979323846;
+		const int numPhases = 1 << m_phaseBits;
+
+		// The Blackman window's transition band is about 5.5 / N cycles per sample wide; center it below the Nyquist frequency
+		double transitionWidth = 5.5 / m_numTaps;
+		double cutoff = SDL_max(0.05, 0.5 * bandwidth - transitionWidth / 2); // cycles per input sample
+
+		m_kernel.assign(numPhases * m_numTaps, 0);
+		std::vector<double> taps(m_numTaps);
+		for (int phase = 0; phase < numPhases; ++phase)
+		{
+			double sum = 0.0;
+			for (int i = 0; i < m_numTaps; ++i)
+			{
+				double x = i - (m_numTaps / 2 - 1) - static_cast<double>(phase) / numPhases;
+				double sinc = (x == 0.0) ? 1.0 : sin(2.0 * pi * cutoff * x) / (2.0 * pi * cutoff * x);
+				double n = x + m_numTaps / 2;
+				double window = 0.42 - 0.5 * cos(2.0 * pi * n / m_numTaps) + 0.08 * cos(4.0 * pi * n / m_numTaps);
+				taps[i] = sinc * window;
+				sum += taps[i];
+			}
+
+			// Normalize each phase to unity gain, putting the rounding error on the largest tap
+			Sint16* pCoefficients = &m_kernel[phase * m_numTaps];
+			int total = 0;
+			int largestTap = 0;
+			for (int i = 0; i < m_numTaps; ++i)
+			{
+				pCoefficients[i] = static_cast<Sint16>(floor(taps[i] / sum * (1 << kCoefficientBits) + 0.5));
+				total += pCoefficients[i];
+				if (pCoefficients[i] > pCoefficients[largestTap])
+				{
+					largestTap = i;
+				}
+			}
+			pCoefficients[largestTap] += static_cast<Sint16>((1 << kCoefficientBits) - total);
+		}
+	}
+
+	int m_numTaps;
+	int m_phaseBits;
+	double m_inputRate;
+	std::vector<Sint16> m_kernel; // [phase][tap]
+
+	Uint64 m_step; // input frames per output frame, 32.32 fixed point
+	Uint64 m_position; // of the next output frame's first tap in the history, 32.32 fixed point
+	std::vector<Sint16> m_history[kNumChannels]; // planar, so the dot products are contiguous
+};
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "SDL.h"
+
+#include <atomic>
+#include <vector>
+
+// Single-producer/single-consumer ring of interleaved Sint16 samples.  The emulation thread writes and the audio callback reads;
+// neither side ever blocks.  Each index is only ever written by one side, so acquire/release ordering on them is all that's needed.
+class AudioRingBuffer
+{
+public:
+	AudioRingBuffer()
+		: m_mask(0)
+	{
+		m_readIndex = 0;
+		m_writeIndex = 0;
+	}
+
+	// Not thread-safe: the consumer must not be running (e.g. audio device locked or paused).  Capacity is rounded up to a power of two.
+	void Reset(Uint32 minCapacity)
+	{
+		Uint32 capacity = 1;
+		while (capacity < minCapacity)
+		{
+			capacity <<= 1;
+		}
+
+		m_samples.assign(capacity, 0);
+		m_mask = capacity - 1;
+		m_readIndex = 0;
+		m_writeIndex = 0;
+	}
+
+	Uint32 GetCapacity() const
+	{
+		return m_mask + 1;
+	}
+
+	// Can be called from either side; the result is only a lower bound for the consumer and an upper bound for the producer
+	Uint32 GetNumSamplesAvailable() const
+	{
+		return m_writeIndex.load(std::memory_order_acquire) - m_readIndex.load(std::memory_order_acquire);
+	}
+
+	// Producer side.  Returns the number of samples actually written; the rest didn't fit.
+	Uint32 Write(const Sint16* pSamples, Uint32 numSamples)
+	{
+		Uint32 writeIndex = m_writeIndex.load(std::memory_order_relaxed);
+		Uint32 readIndex = m_readIndex.load(std::memory_order_acquire);
+		Uint32 numFree = GetCapacity() - (writeIndex - readIndex);
+		if (numSamples > numFree)
+		{
+			numSamples = numFree;
+		}
+
+		CopyToRing(pSamples, numSamples, writeIndex);
+
+		m_writeIndex.store(writeIndex + numSamples, std::memory_order_release);
+		return numSamples;
+	}
+
+	// Consumer side.  Returns the number of samples actually read.
+	Uint32 Read(Sint16* pSamples, Uint32 numSamples)
+	{
+		Uint32 readIndex = m_readIndex.load(std::memory_order_relaxed);
+		Uint32 writeIndex = m_writeIndex.load(std::memory_order_acquire);
+		Uint32 numAvailable = writeIndex - readIndex;
+		if (numSamples > numAvailable)
+		{
+			numSamples = numAvailable;
+		}
+
+		CopyFromRing(pSamples, numSamples, readIndex);
+
+		m_readIndex.store(readIndex + numSamples, std::memory_order_release);
+		return numSamples;
+	}
+
+private:
+	// Indices grow freely and wrap with the mask, so a full buffer and an empty one are told apart without a spare slot
+	void CopyToRing(const Sint16* pSamples, Uint32 numSamples, Uint32 index)
+	{
+		Uint32 offset = index & m_mask;
+		Uint32 firstPart = SDL_min(numSamples, GetCapacity() - offset);
+		memcpy(&m_samples[offset], pSamples, firstPart * sizeof(Sint16));
+		memcpy(&m_samples[0], pSamples + firstPart, (numSamples - firstPart) * sizeof(Sint16));
+	}
+
+	void CopyFromRing(Sint16* pSamples, Uint32 numSamples, Uint32 index) const
+	{
+		Uint32 offset = index & m_mask;
+		Uint32 firstPart = SDL_min(numSamples, GetCapacity() - offset);
+		memcpy(pSamples, &m_samples[offset], firstPart * sizeof(Sint16));
+		memcpy(pSamples + firstPart, &m_samples[0], (numSamples - firstPart) * sizeof(Sint16));
+	}
+
+	std::vector<Sint16> m_samples;
+	Uint32 m_mask;
+
+	std::atomic<Uint32> m_readIndex;
+	std::atomic<Uint32> m_writeIndex;
+};
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "SDL.h"
+
+#include <vector>
+
+// Destination for synthesized audio, as interleaved 16-bit stereo frames.  Sound calls WriteFrames, IsReady and EndSlice from
+// whichever thread synthesizes (the emulation thread, or the synthesis thread when that's enabled); SetSampleRate and Reset are only
+// called while synthesis is stopped.
+class IAudioSink
+{
+public:
+	static const int kNumChannels = 2;
+
+	virtual ~IAudioSink()
+	{
+	}
+
+	// Called when the sink is attached, before any frames are written
+	virtual void SetSampleRate(int sampleRate) = 0;
+
+	// Drops anything buffered; called when the emulator is reset
+	virtual void Reset()
+	{
+	}
+
+	// Frames synthesized while the sink isn't ready are discarded, e.g. so an audio device doesn't start out with a backlog
+	virtual bool IsReady() const
+	{
+		return true;
+	}
+
+	virtual void WriteFrames(const Sint16* pFrames, int numFrames) = 0;
+
+	// Called at the end of each emulation slice with the number of frames written during it.  Returns the output rate to use from
+	// then on, relative to the nominal sample rate; sinks that play in real time use this to follow their own clock.
+	virtual double EndSlice(int numSliceFrames)
+	{
+		return 1.0;
+	}
+};
+
+// Collects everything in memory, e.g. to compare a run's audio against a reference.  With the synthesis thread enabled, call
+// Sound::WaitForSynthesisThread before looking at the samples.
+class MemoryAudioSink : public IAudioSink
+{
+public:
+	MemoryAudioSink()
+		: m_sampleRate(0)
+	{
+	}
+
+	virtual void SetSampleRate(int sampleRate)
+	{
+		m_sampleRate = sampleRate;
+	}
+
+	virtual void WriteFrames(const Sint16* pFrames, int numFrames)
+	{
+		m_samples.insert(m_samples.end(), pFrames, pFrames + numFrames * kNumChannels);
+	}
+
+	int GetSampleRate() const
+	{
+		return m_sampleRate;
+	}
+
+	// Interleaved stereo
+	const std::vector<Sint16>& GetSamples() const
+	{
+		return m_samples;
+	}
+
+	int GetNumFrames() const
+	{
+		return static_cast<int>(m_samples.size() / kNumChannels);
+	}
+
+	void Clear()
+	{
+		m_samples.clear();
+	}
+
+private:
+	int m_sampleRate;
+	std::vector<Sint16> m_samples;
+};
@@ -0,0 +1,359 @@
+#include "GameBoy.h"
+#include "InputMovie.h"
+#include "WavFileAudioSink.h"
+#include "WorkStealingPool.h"
+#include "Utils.h"
+
+#include "SDL.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+// gbbatch: runs many emulation jobs headless, in parallel, and writes what each one ended up with to an output directory.
+//
+//     gbbatch jobs.txt output-dir [--threads N] [--wav] [--frames-every N]
+//
+// Each line of the job list is a ROM, an input movie ("-" for none) and a number of frames to run, separated by spaces; paths
+// with spaces go in double quotes, and # starts a comment.  Input movies are described in InputMovie.h.
+//
+// For job N, the output directory gets jobN.pgm (the last frame), jobN.wav with --wav, and jobN-frameF.pgm every F frames with
+// --frames-every F.  results.csv lists each job's final save state hash, last frame hash, audio hash and timing, for comparing
+// one night's run against the next.  Every job gets its own GameBoy; they only share the (read-only) ROM images.
+
+struct BatchJob
+{
+	std::string romFileName;
+	std::string movieFileName;
+	int numFrames;
+};
+
+struct BatchOptions
+{
+	BatchOptions()
+		: numThreads(0)
+		, writeWav(false)
+		, framesEvery(0)
+	{
+	}
+
+	std::string outputDirectory;
+	int numThreads;
+	bool writeWav;
+	int framesEvery;
+};
+
+struct BatchResult
+{
+	BatchResult()
+		: succeeded(false)
+		, stateHash(0)
+		, frameHash(0)
+		, audioHash(0)
+		, numAudioFrames(0)
+		, hostSeconds(0.0)
+	{
+	}
+
+	bool succeeded;
+	std::string error;
+	Uint32 stateHash;
+	Uint32 frameHash;
+	Uint32 audioHash;
+	Uint64 numAudioFrames;
+	double hostSeconds;
+};
+
+static std::vector<BatchJob> LoadJobList(const char* pFileName)
+{
+	std::vector<BatchJob> jobs;
+	std::vector<std::string> lines = ReadLines(pFileName);
+	for (size_t i = 0; i < lines.size(); ++i)
+	{
+		std::vector<std::string> tokens = Tokenize(lines[i]);
+		if (tokens.empty())
+		{
+			continue;
+		}
+		if (tokens.size() != 3)
+		{
+			throw Exception("%s line %d: expected a ROM, a movie and a frame count", pFileName, static_cast<int>(i + 1));
+		}
+
+		BatchJob job;
+		job.romFileName = tokens[0];
+		job.movieFileName = (tokens[1] == "-") ? std::string() : tokens[1];
+		job.numFrames = atoi(tokens[2].c_str());
+		jobs.push_back(job);
+	}
+	return jobs;
+}
+
+// Hashes and counts everything synthesized, and passes it on to a .wav file if there is one
+class HashingAudioSink : public IAudioSink
+{
+public:
+	HashingAudioSink(std::shared_ptr<IAudioSink> pNext)
+		: m_pNext(pNext)
+		, m_hash(HashBytes(nullptr, 0))
+		, m_numFrames(0)
+	{
+	}
+
+	virtual void SetSampleRate(int sampleRate)
+	{
+		if (m_pNext)
+		{
+			m_pNext->SetSampleRate(sampleRate);
+		}
+	}
+
+	virtual void WriteFrames(const Sint16* pFrames, int numFrames)
+	{
+		m_hash = HashBytes(pFrames, numFrames * kNumChannels * sizeof(Sint16), m_hash);
+		m_numFrames += numFrames;
+		if (m_pNext)
+		{
+			m_pNext->WriteFrames(pFrames, numFrames);
+		}
+	}
+
+	Uint32 GetHash() const
+	{
+		return m_hash;
+	}
+
+	Uint64 GetNumFrames() const
+	{
+		return m_numFrames;
+	}
+
+private:
+	std::shared_ptr<IAudioSink> m_pNext;
+	Uint32 m_hash;
+	Uint64 m_numFrames;
+};
+
+static void WriteFramePgm(const std::string& fileName, const GameBoy& gb)
+{
+	FILE* pFile = nullptr;
+	fopen_s(&pFile, fileName.c_str(), "wb");
+	if (!pFile)
+	{
+		throw Exception("Couldn't open %s for writing", fileName.c_str());
+	}
+	fprintf(pFile, "P5\n%d %d\n255\n", Lcd::kScreenWidth, Lcd::kScreenHeight);
+	for (int y = 0; y < Lcd::kScreenHeight; ++y)
+	{
+		fwrite(gb.GetFrameOutput() + y * gb.GetFrameOutputPitch(), 1, Lcd::kScreenWidth, pFile);
+	}
+	fclose(pFile);
+}
+
+static void RunJob(int jobIndex, const BatchJob& job, const std::shared_ptr<Rom>& pRom, const BatchOptions& options, BatchResult& result)
+{
+	// Exactly one frame's worth of cycles per Update; the float is exact
+	const float kSecondsPerFrame = static_cast<float>(Lcd::kCyclesPerFrame) / MemoryBus::kCyclesPerSecond;
+
+	auto startSeconds = GetHostSeconds();
+	try
+	{
+		std::string outputPrefix = Format("%s/job%d", options.outputDirectory.c_str(), jobIndex);
+
+		std::vector<MovieEvent> movie;
+		if (!job.movieFileName.empty())
+		{
+			movie = LoadInputMovie(job.movieFileName.c_str());
+		}
+
+		std::shared_ptr<HashingAudioSink> pAudioSink;
+		{
+			GameBoy gb(pRom);
+			gb.SetFrameOutputFormat(FrameOutputFormat::Gray8);
+
+			std::shared_ptr<IAudioSink> pWavSink;
+			if (options.writeWav)
+			{
+				pWavSink = std::make_shared<WavFileAudioSink>((outputPrefix + ".wav").c_str());
+			}
+			pAudioSink = std::make_shared<HashingAudioSink>(pWavSink);
+			gb.SetAudioSink(pAudioSink);
+
+			size_t nextEvent = 0;
+			for (int frame = 0; frame < job.numFrames; ++frame)
+			{
+				while ((nextEvent < movie.size()) && (movie[nextEvent].frame <= frame))
+				{
+					gb.SetJoypadButtons(movie[nextEvent].buttons);
+					++nextEvent;
+				}
+
+				gb.Update(kSecondsPerFrame);
+
+				if ((options.framesEvery > 0) && ((frame + 1) % options.framesEvery == 0))
+				{
+					WriteFramePgm(Format("%s-frame%d.pgm", outputPrefix.c_str(), frame + 1), gb);
+				}
+			}
+
+			std::vector<Uint8> state;
+			gb.SaveState(state);
+			result.stateHash = HashBytes(state.data(), state.size());
+			result.frameHash = HashBytes(gb.GetFrameOutput(), gb.GetFrameOutputSize());
+			WriteFramePgm(outputPrefix + ".pgm", gb);
+
+			// Closes the .wav file
+			gb.SetAudioSink(nullptr);
+		}
+
+		result.audioHash = pAudioSink->GetHash();
+		result.numAudioFrames = pAudioSink->GetNumFrames();
+		result.succeeded = true;
+	}
+	catch (const Exception& e)
+	{
+		result.error = e.GetMessage();
+	}
+	result.hostSeconds = GetHostSeconds() - startSeconds;
+}
+
+static void MakeDirectory(const std::string& path)
+{
+#ifdef _WIN32
+	_mkdir(path.c_str());
+#else
+	mkdir(path.c_str(), 0777);
+#endif
+}
+
+static void PrintUsage()
+{
+	printf("Usage: gbbatch jobs.txt output-dir [--threads N] [--wav] [--frames-every N]\n");
+}
+
+int main(int argc, char** argv)
+{
+	try
+	{
+		if (argc < 3)
+		{
+			PrintUsage();
+			return 1;
+		}
+
+		BatchOptions options;
+		options.outputDirectory = argv[2];
+		for (int i = 3; i < argc; ++i)
+		{
+			if ((strcmp(argv[i], "--threads") == 0) && (i + 1 < argc))
+			{
+				options.numThreads = atoi(argv[++i]);
+			}
+			else if (strcmp(argv[i], "--wav") == 0)
+			{
+				options.writeWav = true;
+			}
+			else if ((strcmp(argv[i], "--frames-every") == 0) && (i + 1 < argc))
+			{
+				options.framesEvery = atoi(argv[++i]);
+			}
+			else
+			{
+				PrintUsage();
+				return 1;
+			}
+		}
+
+		std::vector<BatchJob> jobs = LoadJobList(argv[1]);
+		MakeDirectory(options.outputDirectory);
+
+		// Each ROM is loaded once, up front, and shared read-only by every job that runs it.  A ROM that fails to load fails its jobs.
+		std::map<std::string, std::shared_ptr<Rom>> roms;
+		std::map<std::string, std::string> romErrors;
+		for (size_t i = 0; i < jobs.size(); ++i)
+		{
+			const std::string& romFileName = jobs[i].romFileName;
+			if ((roms.find(romFileName) == roms.end()) && (romErrors.find(romFileName) == romErrors.end()))
+			{
+				try
+				{
+					roms[romFileName] = std::make_shared<Rom>(romFileName.c_str());
+				}
+				catch (const Exception& e)
+				{
+					romErrors[romFileName] = e.GetMessage();
+				}
+			}
+		}
+
+		std::vector<BatchResult> results(jobs.size());
+
+		auto startSeconds = GetHostSeconds();
+		{
+			WorkStealingPool pool(options.numThreads);
+			printf("Running %d jobs on %d threads\n", static_cast<int>(jobs.size()), pool.GetNumThreads());
+
+			for (size_t i = 0; i < jobs.size(); ++i)
+			{
+				if (romErrors.find(jobs[i].romFileName) != romErrors.end())
+				{
+					results[i].error = romErrors[jobs[i].romFileName];
+					continue;
+				}
+				std::shared_ptr<Rom> pRom = roms[jobs[i].romFileName];
+
+				const BatchJob* pJob = &jobs[i];
+				BatchResult* pResult = &results[i];
+				const BatchOptions* pOptions = &options;
+				int jobIndex = static_cast<int>(i);
+				pool.Submit([=] { RunJob(jobIndex, *pJob, pRom, *pOptions, *pResult); });
+			}
+			pool.Wait();
+		}
+		auto hostSeconds = GetHostSeconds() - startSeconds;
+
+		std::string resultsFileName = options.outputDirectory + "/results.csv";
+		FILE* pFile = nullptr;
+		fopen_s(&pFile, resultsFileName.c_str(), "wb");
+		if (!pFile)
+		{
+			throw Exception("Couldn't open %s for writing", resultsFileName.c_str());
+		}
+		fprintf(pFile, "job,rom,movie,frames,result,state hash,frame hash,audio hash,audio frames,seconds\n");
+
+		int numFailed = 0;
+		for (size_t i = 0; i < jobs.size(); ++i)
+		{
+			const BatchJob& job = jobs[i];
+			const BatchResult& result = results[i];
+			fprintf(pFile, "%d,\"%s\",\"%s\",%d,\"%s\",%08X,%08X,%08X,%llu,%.3f\n", static_cast<int>(i), job.romFileName.c_str(),
+				job.movieFileName.c_str(), job.numFrames, result.succeeded ? "ok" : result.error.c_str(), result.stateHash, result.frameHash,
+				result.audioHash, static_cast<unsigned long long>(result.numAudioFrames), result.hostSeconds);
+
+			if (!result.succeeded)
+			{
+				printf("Job %d (%s) failed: %s\n", static_cast<int>(i), job.romFileName.c_str(), result.error.c_str());
+				++numFailed;
+			}
+		}
+		fclose(pFile);
+
+		printf("%d of %d jobs succeeded in %.2f seconds\n", static_cast<int>(jobs.size()) - numFailed, static_cast<int>(jobs.size()), hostSeconds);
+		return (numFailed == 0) ? 0 : 1;
+	}
+	catch (const Exception& e)
+	{
+		printf("%s\n", e.GetMessage());
+		return 1;
+	}
+}
@@ -0,0 +1,197 @@
+#pragma once
+
+#include "SDL.h"
+
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+#include <vector>
+
+// Band-limited step synthesis, in the spirit of blargg's Blip_Buffer.  Instead of point-sampling a square-ish waveform at the output
+// rate (which aliases badly), the producer reports each change in amplitude along with the clock cycle it happened on.  Each change is
+// spread over a few output samples with a windowed-sinc kernel picked for its sub-sample position, and reading integrates the result.
+// The cost is proportional to the number of amplitude changes, not to the number of clock cycles.
+class BlipBuffer
+{
+public:
+	static const int kKernelWidth = 16;	// taps per step; the output is delayed by half of this
+	static const int kPhaseBits = 5;
+	static const int kNumPhases = 1 << kPhaseBits;
+	static const int kKernelBits = 12;	// fixed-point precision of the kernel; keeps accumulated deltas well inside 32 bits
+
+	BlipBuffer()
+		: m_maxFrameClocks(0)
+		, m_factor(0)
+		, m_offset(0)
+		, m_integrator(0)
+	{
+	}
+
+	// maxFrameClocks is the longest frame that will be passed to EndFrame
+	void SetRates(double clockRate, double sampleRate, Uint32 maxFrameClocks)
+	{
+		// Room for SetSampleRate to raise the rate this much without reallocating; dynamic rate control stays within +/-0.5%
+		const double maxRateIncrease = 0.01;
+
+		m_maxFrameClocks = maxFrameClocks;
+		m_factor = GetFactor(clockRate, sampleRate);
+		m_buffer.assign(GetBufferSize(GetFactor(clockRate, sampleRate * (1.0 + maxRateIncrease))), 0);
+
+		Clear();
+	}
+
+	// Adjusts the ratio without dropping what's already in the buffer.  Grows the buffer if a whole frame at the new rate wouldn't
+	// fit in it.
+	void SetSampleRate(double clockRate, double sampleRate)
+	{
+		m_factor = GetFactor(clockRate, sampleRate);
+
+		size_t bufferSize = GetBufferSize(m_factor);
+		if (bufferSize > m_buffer.size())
+		{
+			m_buffer.resize(bufferSize, 0);
+		}
+	}
+
+	void Clear()
+	{
+		m_offset = 0;
+		m_integrator = 0;
+		std::fill(m_buffer.begin(), m_buffer.end(), 0);
+	}
+
+	// clockTime is relative to the start of the current frame
+	void AddDelta(Uint32 clockTime, Sint32 delta)
+	{
+		if (delta == 0)
+		{
+			return;
+		}
+
+		Uint64 position = m_offset + clockTime * m_factor;
+		Uint32 index = static_cast<Uint32>(position >> kFixedBits);
+		Uint32 phase = static_cast<Uint32>(position >> (kFixedBits - kPhaseBits)) & (kNumPhases - 1);
+		SDL_assert(index + kKernelWidth <= m_buffer.size());
+
+		const Sint16* pKernel = s_kernel.taps[phase];
+		Sint32* pBuffer = &m_buffer[index];
+		for (int i = 0; i < kKernelWidth; ++i)
+		{
+			pBuffer[i] += delta * pKernel[i];
+		}
+	}
+
+	// Makes the samples up to frameClocks available for reading; the next frame starts there
+	void EndFrame(Uint32 frameClocks)
+	{
+		m_offset += frameClocks * m_factor;
+		SDL_assert(GetNumSamplesAvailable() + kKernelWidth <= static_cast<int>(m_buffer.size()));
+	}
+
+	int GetNumSamplesAvailable() const
+	{
+		return static_cast<int>(m_offset >> kFixedBits);
+	}
+
+	// Reads and removes up to maxSamples samples, writing one every 'stride' Sint16s (2 to interleave stereo)
+	int ReadSamples(Sint16* pOutput, int maxSamples, int stride)
+	{
+		int numSamples = SDL_min(maxSamples, GetNumSamplesAvailable());
+
+		Sint32 integrator = m_integrator;
+		for (int i = 0; i < numSamples; ++i)
+		{
+			integrator += m_buffer[i];
+			Sint32 sample = integrator >> kKernelBits;
+			pOutput[i * stride] = static_cast<Sint16>(SDL_max(-32768, SDL_min(32767, sample)));
+		}
+		m_integrator = integrator;
+
+		RemoveSamples(numSamples);
+		return numSamples;
+	}
+
+	// Same as ReadSamples, for when nobody is listening
+	void DiscardSamples()
+	{
+		int numSamples = GetNumSamplesAvailable();
+		for (int i = 0; i < numSamples; ++i)
+		{
+			m_integrator += m_buffer[i];
+		}
+		RemoveSamples(numSamples);
+	}
+
+private:
+	static const int kFixedBits = 32;
+	static const Uint64 kFixedOne = static_cast<Uint64>(1) << kFixedBits;
+
+	static Uint64 GetFactor(double clockRate, double sampleRate)
+	{
+		return static_cast<Uint64>(sampleRate / clockRate * kFixedOne + 0.5);
+	}
+
+	// Enough for the longest frame, plus the tail of a kernel starting on its last sample
+	size_t GetBufferSize(Uint64 factor) const
+	{
+		Uint32 maxFrameSamples = static_cast<Uint32>((static_cast<Uint64>(m_maxFrameClocks) * factor) >> kFixedBits) + 1;
+		return maxFrameSamples + kKernelWidth + 1;
+	}
+
+	void RemoveSamples(int numSamples)
+	{
+		// Keep the tails of the kernels that spill past the read position
+		int numRemaining = GetNumSamplesAvailable() - numSamples + kKernelWidth;
+		memmove(&m_buffer[0], &m_buffer[numSamples], numRemaining * sizeof(Sint32));
+		std::fill(m_buffer.begin() + numRemaining, m_buffer.begin() + numRemaining + numSamples, 0);
+		m_offset -= static_cast<Uint64>(numSamples) << kFixedBits;
+	}
+
+	// Blackman-windowed sinc with its cutoff a bit below Nyquist, one set of taps per sub-sample phase.  Each phase is normalized to
+	// exactly 1 << kKernelBits so that integrating the deltas doesn't drift.  Shared by all instances.
+	struct Kernel
+	{
+		Kernel()
+		{
+			const double pi = 3.14159265358979323846;
+			const double cutoff = 0.45; // cycles per sample
+			for (int phase = 0; phase < kNumPhases; ++phase)
+			{
+				double phaseTaps[kKernelWidth];
+				double sum = 0.0;
+				for (int i = 0; i < kKernelWidth; ++i)
+				{
+					double x = i - (kKernelWidth / 2 - 1) - static_cast<double>(phase) / kNumPhases;
+					double sinc = (x == 0.0) ? 1.0 : sin(2.0 * pi * cutoff * x) / (2.0 * pi * cutoff * x);
+					double n = x + kKernelWidth / 2;
+					double window = 0.42 - 0.5 * cos(2.0 * pi * n / kKernelWidth) + 0.08 * cos(4.0 * pi * n / kKernelWidth);
+					phaseTaps[i] = sinc * window;
+					sum += phaseTaps[i];
+				}
+
+				int total = 0;
+				int largestTap = 0;
+				for (int i = 0; i < kKernelWidth; ++i)
+				{
+					taps[phase][i] = static_cast<Sint16>(floor(phaseTaps[i] / sum * (1 << kKernelBits) + 0.5));
+					total += taps[phase][i];
+					if (taps[phase][i] > taps[phase][largestTap])
+					{
+						largestTap = i;
+					}
+				}
+				taps[phase][largestTap] += static_cast<Sint16>((1 << kKernelBits) - total);
+			}
+		}
+
+		Sint16 taps[kNumPhases][kKernelWidth];
+	};
+
+	static const Kernel s_kernel;
+
+	Uint32 m_maxFrameClocks;
+	Uint64 m_factor; // output samples per clock, 32.32 fixed point
+	Uint64 m_offset; // position of the start of the current frame in the buffer, 32.32 fixed point
+	std::vector<Sint32> m_buffer;
+	Sint32 m_integrator;
+};
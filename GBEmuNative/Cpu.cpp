@@ -1 +1,5 @@
-#include "Cpu.h"
\ No newline at end of file
+#include "Cpu.h"
+
+Cpu::OpcodeMetadata Cpu::s_opcodeMetadata[0x100];
+Cpu::OpcodeMetadata Cpu::s_extendedOpcodeMetadata[0x100];
+std::once_flag Cpu::s_opcodeMetadataComputed;
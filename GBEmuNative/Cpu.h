@@ -3,6 +3,7 @@
 #include "MemoryBus.h"
 
 #include <memory>
+#include <mutex>
 
 #include "SDL.h"
 
@@ -29,22 +30,43 @@ namespace FlagBitMask
 class Cpu : public IMemoryBusDevice
 {
 public:
-	enum class Registers
+	struct Registers
 	{
-		IF = 0xFF0F,	// Interrupt flag
-		KEY1 = 0xFF4D,	// CGB only: prepare speed switch
-		IE = 0xFFFF,	// Interrupt enable
+		enum Type
+		{
+			IF = 0xFF0F,	// Interrupt flag
+			KEY1 = 0xFF4D,	// CGB only: prepare speed switch
+			IE = 0xFFFF,	// Interrupt enable
+		};
 	};
 
 	Cpu(const std::shared_ptr<MemoryBus>& memory)
 		: m_pMemory(memory)
 //		, m_pTraceLog(nullptr)
 	{
-		ComputeTracingData();
+		std::call_once(s_opcodeMetadataComputed, ComputeTracingData);
 
 		Reset();
 	}
 
+	void SerializeState(StateSerializer& state)
+	{
+		state.Value(AF);
+		state.Value(BC);
+		state.Value(DE);
+		state.Value(HL);
+		state.Value(SP);
+		state.Value(PC);
+		state.Value(IME);
+		state.Value(IF);
+		state.Value(KEY1);
+		state.Value(IE);
+		state.Value(m_cpuHalted);
+		state.Value(m_cpuStopped);
+		state.Value(m_branchTakenCycles);
+		state.Value(m_totalOpcodesExecuted);
+	}
+
 	void Reset()
 	{
 		//if (m_pTraceLog)
@@ -58,6 +80,7 @@ public:
 
 		m_cpuHalted = false;
 		m_cpuStopped = false;
+		m_branchTakenCycles = 0;
 
 		IME = true;
 
@@ -65,7 +88,6 @@ public:
 		KEY1 = 0;
 		IE = 0;
 
-		static_assert(offsetof(Cpu, F) == offsetof(Cpu, AF), "Target machine is not little-endian; register unions must be revised");
 		PC = 0x0100;
 		AF = 0x01B0;
 		BC = 0x0013;
@@ -84,12 +106,12 @@ public:
 		Uint8 opcode = Read8(address);
 		if (!IsExtendedOpcode(opcode))
 		{
-			return m_opcodeMetadata[opcode].size;
+			return s_opcodeMetadata[opcode].size;
 		}
 		else
 		{
 			Uint8 opcode = Read8(address + 1);
-			return m_extendedOpcodeMetadata[opcode].size;
+			return s_extendedOpcodeMetadata[opcode].size;
 		}
 	}
 
@@ -98,6 +120,29 @@ public:
 		IF |= interruptFlagMask;
 	}
 
+	// For hosts that run code directly instead of booting a cartridge, e.g. the GBS player
+	void SetA(Uint8 value)
+	{
+		A = value;
+	}
+
+	void SetSP(Uint16 value)
+	{
+		SP = value;
+	}
+
+	void SetPC(Uint16 value)
+	{
+		PC = value;
+	}
+
+	// Pushes PC and jumps, like CALL, so the routine's RET comes back to the current PC
+	void CallSubroutine(Uint16 address)
+	{
+		m_cpuHalted = false;
+		Call(address);
+	}
+
 	void DebugNextOpcode()
 	{
 		DebugOpcode(Peek8());
@@ -180,53 +225,58 @@ private:
 	// Micro-opcode implementations
 	///////////////////////////////////////////////////////////////////////////
 
+	// Standard C++ doesn't allow explicit specializations of member templates at class scope (MSVC does), so the per-N cases are
+	// overloads on Int2Type<N> that the templates forward to
+
 	// B_C_D_E_H_L_iHL_A
-	template <int N> Uint8& B_C_D_E_H_L_iHL_A_GetReg8();
-	template <> Uint8& B_C_D_E_H_L_iHL_A_GetReg8<0>() { return B; }
-	template <> Uint8& B_C_D_E_H_L_iHL_A_GetReg8<1>() { return C; }
-	template <> Uint8& B_C_D_E_H_L_iHL_A_GetReg8<2>() { return D; }
-	template <> Uint8& B_C_D_E_H_L_iHL_A_GetReg8<3>() { return E; }
-	template <> Uint8& B_C_D_E_H_L_iHL_A_GetReg8<4>() { return H; }
-	template <> Uint8& B_C_D_E_H_L_iHL_A_GetReg8<5>() { return L; }
-	template <> Uint8& B_C_D_E_H_L_iHL_A_GetReg8<7>() { return A; }
+	template <int N> Uint8& B_C_D_E_H_L_iHL_A_GetReg8() { return B_C_D_E_H_L_iHL_A_GetReg8(Int2Type<N>()); }
+	Uint8& B_C_D_E_H_L_iHL_A_GetReg8(Int2Type<0>) { return B; }
+	Uint8& B_C_D_E_H_L_iHL_A_GetReg8(Int2Type<1>) { return C; }
+	Uint8& B_C_D_E_H_L_iHL_A_GetReg8(Int2Type<2>) { return D; }
+	Uint8& B_C_D_E_H_L_iHL_A_GetReg8(Int2Type<3>) { return E; }
+	Uint8& B_C_D_E_H_L_iHL_A_GetReg8(Int2Type<4>) { return H; }
+	Uint8& B_C_D_E_H_L_iHL_A_GetReg8(Int2Type<5>) { return L; }
+	Uint8& B_C_D_E_H_L_iHL_A_GetReg8(Int2Type<7>) { return A; }
 	
-	template <int N> Uint16 B_C_D_E_H_L_iHL_A_GetAddress();
-	template <> Uint16 B_C_D_E_H_L_iHL_A_GetAddress<6>() { return HL; }
+	template <int N> Uint16 B_C_D_E_H_L_iHL_A_GetAddress() { return B_C_D_E_H_L_iHL_A_GetAddress(Int2Type<N>()); }
+	Uint16 B_C_D_E_H_L_iHL_A_GetAddress(Int2Type<6>) { return HL; }
 
-	template <int N> Uint8 B_C_D_E_H_L_iHL_A_Read8() { return B_C_D_E_H_L_iHL_A_GetReg8<N>(); }
-	template <> Uint8 B_C_D_E_H_L_iHL_A_Read8<6>() { return Read8(B_C_D_E_H_L_iHL_A_GetAddress<6>()); }
-	template <int N> void B_C_D_E_H_L_iHL_A_Write8(Uint8 value) { B_C_D_E_H_L_iHL_A_GetReg8<N>() = value; }
-	template <> void B_C_D_E_H_L_iHL_A_Write8<6>(Uint8 value) { Write8(B_C_D_E_H_L_iHL_A_GetAddress<6>(), value); }
+	template <int N> Uint8 B_C_D_E_H_L_iHL_A_Read8(Int2Type<N>) { return B_C_D_E_H_L_iHL_A_GetReg8<N>(); }
+	template <int N> Uint8 B_C_D_E_H_L_iHL_A_Read8() { return B_C_D_E_H_L_iHL_A_Read8(Int2Type<N>()); }
+	Uint8 B_C_D_E_H_L_iHL_A_Read8(Int2Type<6>) { return Read8(B_C_D_E_H_L_iHL_A_GetAddress<6>()); }
+	template <int N> void B_C_D_E_H_L_iHL_A_Write8(Int2Type<N>, Uint8 value) { B_C_D_E_H_L_iHL_A_GetReg8<N>() = value; }
+	template <int N> void B_C_D_E_H_L_iHL_A_Write8(Uint8 value) { return B_C_D_E_H_L_iHL_A_Write8(Int2Type<N>(), value); }
+	void B_C_D_E_H_L_iHL_A_Write8(Int2Type<6>, Uint8 value) { Write8(B_C_D_E_H_L_iHL_A_GetAddress<6>(), value); }
 
 	// NZ_Z_NC_C_Eval
-	template <int N> bool NZ_Z_NC_C_Eval();
-	template <> bool NZ_Z_NC_C_Eval<0>() { return !GetFlagValue(FlagBitIndex::Zero); } 
-	template <> bool NZ_Z_NC_C_Eval<1>() { return GetFlagValue(FlagBitIndex::Zero); } 
-	template <> bool NZ_Z_NC_C_Eval<2>() { return !GetFlagValue(FlagBitIndex::Carry); } 
-	template <> bool NZ_Z_NC_C_Eval<3>() { return GetFlagValue(FlagBitIndex::Carry); } 
+	template <int N> bool NZ_Z_NC_C_Eval() { return NZ_Z_NC_C_Eval(Int2Type<N>()); }
+	bool NZ_Z_NC_C_Eval(Int2Type<0>) { return !GetFlagValue(FlagBitIndex::Zero); }
+	bool NZ_Z_NC_C_Eval(Int2Type<1>) { return GetFlagValue(FlagBitIndex::Zero); }
+	bool NZ_Z_NC_C_Eval(Int2Type<2>) { return !GetFlagValue(FlagBitIndex::Carry); }
+	bool NZ_Z_NC_C_Eval(Int2Type<3>) { return GetFlagValue(FlagBitIndex::Carry); }
 	
 	// iBC_iDE
-	template <int N> Uint16 iBC_iDE_GetAddress();
-	template <> Uint16 iBC_iDE_GetAddress<0>() { return BC; }
-	template <> Uint16 iBC_iDE_GetAddress<1>() { return DE; }
+	template <int N> Uint16 iBC_iDE_GetAddress() { return iBC_iDE_GetAddress(Int2Type<N>()); }
+	Uint16 iBC_iDE_GetAddress(Int2Type<0>) { return BC; }
+	Uint16 iBC_iDE_GetAddress(Int2Type<1>) { return DE; }
 	template <int N> Uint8 iBC_iDE_Read8() { return Read8(iBC_iDE_GetAddress<N>()); }
 	template <int N> void iBC_iDE_Write8(Uint8 value) { Write8(iBC_iDE_GetAddress<N>(), value); }
 
 	// BC_DE_HL_SP
-	template <int N> Uint16& BC_DE_HL_SP_GetReg16();
-	template <> Uint16& BC_DE_HL_SP_GetReg16<0>() { return BC; }
-	template <> Uint16& BC_DE_HL_SP_GetReg16<1>() { return DE; }
-	template <> Uint16& BC_DE_HL_SP_GetReg16<2>() { return HL; }
-	template <> Uint16& BC_DE_HL_SP_GetReg16<3>() { return SP; }
+	template <int N> Uint16& BC_DE_HL_SP_GetReg16() { return BC_DE_HL_SP_GetReg16(Int2Type<N>()); }
+	Uint16& BC_DE_HL_SP_GetReg16(Int2Type<0>) { return BC; }
+	Uint16& BC_DE_HL_SP_GetReg16(Int2Type<1>) { return DE; }
+	Uint16& BC_DE_HL_SP_GetReg16(Int2Type<2>) { return HL; }
+	Uint16& BC_DE_HL_SP_GetReg16(Int2Type<3>) { return SP; }
 	template <int N> Uint16 BC_DE_HL_SP_Read16() { return BC_DE_HL_SP_GetReg16<N>(); }
 	template <int N> void BC_DE_HL_SP_Write16(Uint16 value) { BC_DE_HL_SP_GetReg16<N>() = value; }
 
 	// BC_DE_HL_AF
-	template <int N> Uint16& BC_DE_HL_AF_GetReg16();
-	template <> Uint16& BC_DE_HL_AF_GetReg16<0>() { return BC; }
-	template <> Uint16& BC_DE_HL_AF_GetReg16<1>() { return DE; }
-	template <> Uint16& BC_DE_HL_AF_GetReg16<2>() { return HL; }
-	template <> Uint16& BC_DE_HL_AF_GetReg16<3>() { return AF; }
+	template <int N> Uint16& BC_DE_HL_AF_GetReg16() { return BC_DE_HL_AF_GetReg16(Int2Type<N>()); }
+	Uint16& BC_DE_HL_AF_GetReg16(Int2Type<0>) { return BC; }
+	Uint16& BC_DE_HL_AF_GetReg16(Int2Type<1>) { return DE; }
+	Uint16& BC_DE_HL_AF_GetReg16(Int2Type<2>) { return HL; }
+	Uint16& BC_DE_HL_AF_GetReg16(Int2Type<3>) { return AF; }
 	template <int N> Uint16 BC_DE_HL_AF_Read16() { return BC_DE_HL_AF_GetReg16<N>(); }
 	template <int N> void BC_DE_HL_AF_Write16(Uint16 value) { BC_DE_HL_AF_GetReg16<N>() = value; }
 
@@ -518,6 +568,7 @@ private:
 		if (b3_4_NZ_Z_NC_C_Eval<N>())
 		{
 			PC += displacement;
+			m_branchTakenCycles = 4;
 		}
 	}
 
@@ -669,6 +720,7 @@ private:
 		if (b3_4_NZ_Z_NC_C_Eval<N>())
 		{
 			Ret();
+			m_branchTakenCycles = 12;
 		}
 	}
 
@@ -683,6 +735,7 @@ private:
 		if (b3_4_NZ_Z_NC_C_Eval<N>())
 		{
 			PC = address;
+			m_branchTakenCycles = 4;
 		}
 	}
 
@@ -697,6 +750,7 @@ private:
 		if (b3_4_NZ_Z_NC_C_Eval<N>())
 		{
 			Call(address);
+			m_branchTakenCycles = 12;
 		}
 	}
 
@@ -964,6 +1018,7 @@ private:
 		bool unknownOpcode = false;
 
 		Sint32 instructionCycles = -1; // number of clock cycles used by the opcode
+		m_branchTakenCycles = 0; // conditional opcodes take longer when the branch is taken
 
 #define OPCODE(code, cycles, name) case code: instructionCycles = (cycles); name<code>(); break;
 		switch (opcode)
@@ -1033,7 +1088,7 @@ private:
 
 		OPCODE(0x17, 4, RL_1__7)
 
-		OPCODE(0x18, 8, JR_1__8)
+		OPCODE(0x18, 12, JR_1__8)
 
 		OPCODE(0x1F, 4, RR_1__F)
 
@@ -1208,7 +1263,7 @@ private:
 		OPCODE(0xD2, 12, JP_C_D__2__C_D__2)
 		OPCODE(0xDA, 12, JP_C_D__2__C_D__2)
 			
-		OPCODE(0xC3, 12, JP_C__3)
+		OPCODE(0xC3, 16, JP_C__3)
 
 		OPCODE(0xC4, 12, CALL_C_D__4__C_D__C)
 		OPCODE(0xD4, 12, CALL_C_D__4__C_D__C)
@@ -1231,7 +1286,7 @@ private:
 		OPCODE(0xEF, 32, RST_C_F__7__C_F__F)
 		OPCODE(0xFF, 32, RST_C_F__7__C_F__F)
 
-		OPCODE(0xC9, 8, RET_C__9)
+		OPCODE(0xC9, 16, RET_C__9)
 
 		case 0xCB: // Extended opcodes
 			{
@@ -1516,13 +1571,13 @@ private:
 			}
 			break;
 
-		OPCODE(0xCD, 12, CALL_C__D)
+		OPCODE(0xCD, 24, CALL_C__D)
 
 		OPCODE(0xCE, 8, ADC_C__E)
 
 		OPCODE(0xD6, 8, SUB_D__6)
 
-		OPCODE(0xD9, 8, RETI_D__9)
+		OPCODE(0xD9, 16, RETI_D__9)
 		
 		OPCODE(0xDE, 8, SBC_D__E)
 
@@ -1588,7 +1643,7 @@ private:
 
 		++m_totalOpcodesExecuted;
 
-		return instructionCycles;
+		return instructionCycles + m_branchTakenCycles;
 	}
 
 	///////////////////////////////////////////////////////////////////////////
@@ -1618,7 +1673,7 @@ private:
 	};
 
 	// The following functions were preprocessed using a spreadsheet from http://imrannazar.com/Gameboy-Z80-Opcode-Map and http://www.pastraiser.com/cpu/gameboy/gameboy_opcodes.html
-	const char* GetOpcodeMnemonic(Uint8 opcode)
+	static const char* GetOpcodeMnemonic(Uint8 opcode)
 	{
 		static const char* opcodeMnemonics[256] =
 		{
@@ -1643,7 +1698,7 @@ private:
 		return opcodeMnemonics[opcode];
 	}
 
-	const char* GetExtendedOpcodeMnemonic(Uint8 opcode)
+	static const char* GetExtendedOpcodeMnemonic(Uint8 opcode)
 	{
 		static const char* extOpsMnemonics[256] = 
 		{
@@ -1668,7 +1723,7 @@ private:
 		return extOpsMnemonics[opcode];
 	}
 
-	int GetOpcodeSize(Uint8 opcode)
+	static int GetOpcodeSize(Uint8 opcode)
 	{
 		static const Uint8 opcodeSizes[256] =
 		{
@@ -1692,7 +1747,7 @@ private:
 		return opcodeSizes[opcode];
 	}
 
-	int GetExtendedOpcodeSize(Uint8 opcode)
+	static int GetExtendedOpcodeSize(Uint8 opcode)
 	{
 		static const Uint8 extOpsSizes[256] =
 		{
@@ -1725,12 +1780,12 @@ private:
 	//	}
 	//}
 
-	bool IsExtendedOpcode(Uint8 opcode)
+	static bool IsExtendedOpcode(Uint8 opcode)
 	{
 		return opcode == 0xCB;
 	}
 
-	void ParseMnemonic(const char* mnemonic, OpcodeMetadata& meta)
+	static void ParseMnemonic(const char* mnemonic, OpcodeMetadata& meta)
 	{
 		std::string* pToken = &meta.baseMnemonic;
 		while (*mnemonic)
@@ -1775,7 +1830,8 @@ private:
 		}
 	}
 	
-	void ComputeTracingData()
+	// Runs once per process; the tables are read-only afterwards, and shared by every Cpu
+	static void ComputeTracingData()
 	{
 		// First, parse what we can from the static opcode metadata
 		for (Uint16 opcode16 = 0; opcode16 < 0xFF; ++opcode16)
@@ -1786,7 +1842,7 @@ private:
 				continue;
 			}
 
-			auto& meta = m_opcodeMetadata[opcode];
+			auto& meta = s_opcodeMetadata[opcode];
 			ParseMnemonic(GetOpcodeMnemonic(opcode), meta);
 			meta.size = GetOpcodeSize(opcode);
 		}
@@ -1795,7 +1851,7 @@ private:
 		{
 			Uint8 opcode = static_cast<Uint8>(opcode16);
 			
-			auto& meta = m_extendedOpcodeMetadata[opcode];
+			auto& meta = s_extendedOpcodeMetadata[opcode];
 			ParseMnemonic(GetExtendedOpcodeMnemonic(opcode), meta);
 			meta.size = GetExtendedOpcodeSize(opcode);
 		}
@@ -1844,9 +1900,7 @@ private:
 	{
 		Uint8 value = 0;
 		bool success = m_pMemory->SafeRead8(address, value);
-		char szBuffer[32];
-		_snprintf_s(szBuffer, ARRAY_SIZE(szBuffer), "%02lX", value);
-		return success ? szBuffer : "??";
+		return success ? Format("%02X", value) : "??";
 	}
 	
 	std::string DebugStringPeek16(Uint16 address)
@@ -2041,6 +2095,13 @@ private:
     DualViewRegisterPair(D, E)
     DualViewRegisterPair(H, L)
 
+	// Cpu isn't standard-layout, so offsetof can't be used on it; a standard-layout struct with the same kind of pair stands in
+	struct DualViewRegisterPairLayout
+	{
+		DualViewRegisterPair(A, F)
+	};
+	static_assert(offsetof(DualViewRegisterPairLayout, F) == offsetof(DualViewRegisterPairLayout, AF), "Target machine is not little-endian; register unions must be revised");
+
 #undef DualViewRegisterPair
 
 	Uint16 SP;
@@ -2053,12 +2114,15 @@ private:
 
 	bool m_cpuHalted;
 	bool m_cpuStopped;
+	Sint32 m_branchTakenCycles;
 
 	Uint32 m_totalOpcodesExecuted;
 	bool m_traceEnabled;
 	std::string m_traceLog;
-	OpcodeMetadata m_opcodeMetadata[0x100];
-	OpcodeMetadata m_extendedOpcodeMetadata[0x100];
+
+	static OpcodeMetadata s_opcodeMetadata[0x100];
+	static OpcodeMetadata s_extendedOpcodeMetadata[0x100];
+	static std::once_flag s_opcodeMetadataComputed;
 
 	std::shared_ptr<MemoryBus> m_pMemory;
 };
@@ -1,4 +1,7 @@
 #include "GameBoy.h"
+#include "GbsPlayer.h"
+#include "WavFileAudioSink.h"
+#include "AudioDeviceSink.h"
 #include "Utils.h"
 
 #include "SDL.h"
@@ -10,7 +13,187 @@
 
 #include <Windows.h>
 
-float g_totalCyclesExecuted = 0.0f;
+SDL_Keycode DebugWaitForKeypress()
+{
+	SDL_Event event;
+	for (;;)
+	{
+		while (SDL_PollEvent(&event))
+		{
+			switch (event.type)
+			{
+			case SDL_KEYDOWN: return event.key.keysym.sym;
+			}
+		}
+		SDL_Delay(10);
+	}
+	return SDLK_UNKNOWN;
+}
+
+SDL_Keycode DebugCheckForKeypress()
+{
+	SDL_Event event;
+	while (SDL_PollEvent(&event))
+	{
+		switch (event.type)
+		{
+		case SDL_KEYDOWN: return event.key.keysym.sym;
+		}
+	}
+	return SDLK_UNKNOWN;
+}
+
+static bool HasExtension(const char* pFileName, const char* pExtension)
+{
+	size_t length = strlen(pFileName);
+	size_t extensionLength = strlen(pExtension);
+	return (length > extensionLength) && (SDL_strcasecmp(pFileName + length - extensionLength, pExtension) == 0);
+}
+
+// Renders a song (1-based) to a .wav file without a window or audio device, as fast as the host allows
+static void RenderGbsFile(const char* pFileName, int song, float seconds, const char* pOutputFileName)
+{
+	GbsPlayer player(pFileName);
+	player.SetAudioSink(std::make_shared<WavFileAudioSink>(pOutputFileName));
+	if (song > 0)
+	{
+		player.StartSong(song - 1);
+	}
+
+	auto startCounter = SDL_GetPerformanceCounter();
+	player.Render(seconds);
+	auto hostSeconds = static_cast<float>(SDL_GetPerformanceCounter() - startCounter) / SDL_GetPerformanceFrequency();
+
+	// Closes the file
+	player.SetAudioSink(nullptr);
+
+	printf("Rendered %.1f seconds of song %d in %.2f seconds\n", seconds, player.GetCurrentSong() + 1, hostSeconds);
+}
+
+// Synthesizes an APU register log recorded with GameBoy::StartAudioLog into a .wav file
+static void RenderApuLog(const char* pFileName, const char* pOutputFileName)
+{
+	ApuLogReader log(pFileName);
+	Sound sound;
+	sound.SetAudioSink(std::make_shared<WavFileAudioSink>(pOutputFileName));
+	while (sound.ReplayRegisterLogSlice(log))
+	{
+	}
+}
+
+// Plays through the audio device; left and right change songs
+static void PlayGbsFile(SDL_Window* pWindow, SDL_Renderer* pRenderer, const char* pFileName)
+{
+	GbsPlayer player(pFileName);
+	player.SetAudioSink(std::make_shared<AudioDeviceSink>());
+
+	bool done = false;
+	Uint32 lastTicks = SDL_GetTicks();
+	int shownSong = -1;
+
+	while (!done)
+	{
+		SDL_Event event;
+		while (SDL_PollEvent(&event))
+		{
+			switch (event.type)
+			{
+			case SDL_KEYDOWN:
+				switch (event.key.keysym.sym)
+				{
+				case SDLK_ESCAPE:
+					done = true;
+					break;
+				case SDLK_LEFT:
+					player.StartSong((player.GetCurrentSong() + player.GetNumSongs() - 1) % player.GetNumSongs());
+					break;
+				case SDLK_RIGHT:
+					player.StartSong((player.GetCurrentSong() + 1) % player.GetNumSongs());
+					break;
+				}
+				break;
+			case SDL_QUIT:
+				done = true;
+				break;
+			}
+		}
+
+		if (player.GetCurrentSong() != shownSong)
+		{
+			shownSong = player.GetCurrentSong();
+			SDL_SetWindowTitle(pWindow, Format("%s - %s - %d/%d", player.GetTitle().c_str(), player.GetAuthor().c_str(), shownSong + 1, player.GetNumSongs()).c_str());
+		}
+
+		Uint32 ticks = SDL_GetTicks();
+		player.Update(SDL_min((ticks - lastTicks) / 1000.0f, 0.1f));
+		lastTicks = ticks;
+
+		SDL_RenderClear(pRenderer);
+		SDL_RenderPresent(pRenderer);
+	}
+}
+
+// Searches for the specific knockoff USB NES pad I own, because it's awesome
+static std::shared_ptr<SDL_Joystick> OpenJoystick()
+{
+	std::shared_ptr<SDL_Joystick> pFoundJoystick;
+	for (int i = 0; i < SDL_NumJoysticks(); ++i)
+	{
+		std::shared_ptr<SDL_Joystick> pJoystick(SDL_JoystickOpen(i), SDL_JoystickClose);
+		std::string joystickName = SDL_JoystickName(pJoystick.get());
+		if (joystickName == "USB Gamepad ") // note the space
+		{
+			pFoundJoystick = pJoystick;
+		}
+	}
+	return pFoundJoystick;
+}
+
+// Keyboard: arrows, P (A), O (B), Q (Select), W (Start)
+static Uint8 ReadJoypadButtons(SDL_Joystick* pJoystick)
+{
+	const auto pKeyState = SDL_GetKeyboardState(nullptr);
+
+	Uint8 buttons = 0;
+	if (pKeyState[SDL_SCANCODE_RIGHT]) { buttons |= JoypadButton::Right; }
+	if (pKeyState[SDL_SCANCODE_LEFT]) { buttons |= JoypadButton::Left; }
+	if (pKeyState[SDL_SCANCODE_UP]) { buttons |= JoypadButton::Up; }
+	if (pKeyState[SDL_SCANCODE_DOWN]) { buttons |= JoypadButton::Down; }
+	if (pKeyState[SDL_SCANCODE_P]) { buttons |= JoypadButton::A; }
+	if (pKeyState[SDL_SCANCODE_O]) { buttons |= JoypadButton::B; }
+	if (pKeyState[SDL_SCANCODE_Q]) { buttons |= JoypadButton::Select; }
+	if (pKeyState[SDL_SCANCODE_W]) { buttons |= JoypadButton::Start; }
+
+	if (pJoystick)
+	{
+		if (SDL_JoystickGetButton(pJoystick, 1)) { buttons |= JoypadButton::A; }
+		if (SDL_JoystickGetButton(pJoystick, 2)) { buttons |= JoypadButton::B; }
+		if (SDL_JoystickGetButton(pJoystick, 8)) { buttons |= JoypadButton::Select; }
+		if (SDL_JoystickGetButton(pJoystick, 9)) { buttons |= JoypadButton::Start; }
+
+		auto axis0 = SDL_JoystickGetAxis(pJoystick, 0);
+		if (axis0 > 16384)
+		{
+			buttons |= JoypadButton::Right;
+		}
+		else if (axis0 < -16384)
+		{
+			buttons |= JoypadButton::Left;
+		}
+
+		auto axis4 = SDL_JoystickGetAxis(pJoystick, 4);
+		if (axis4 < -16384)
+		{
+			buttons |= JoypadButton::Up;
+		}
+		else if (axis4 > 16384)
+		{
+			buttons |= JoypadButton::Down;
+		}
+	}
+
+	return buttons;
+}
 
 int main(int argc, char **argv)
 {
@@ -21,6 +204,20 @@ int main(int argc, char **argv)
 
 		SDL_LogSetPriority(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_INFO);
 
+		// GBEmuNative music.gbs [song seconds output.wav]
+		if ((argc > 4) && HasExtension(argv[1], ".gbs"))
+		{
+			RenderGbsFile(argv[1], atoi(argv[2]), static_cast<float>(atof(argv[3])), argv[4]);
+			return 0;
+		}
+
+		// GBEmuNative audio.gbal output.wav
+		if ((argc > 2) && HasExtension(argv[1], ".gbal"))
+		{
+			RenderApuLog(argv[1], argv[2]);
+			return 0;
+		}
+
 		if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_JOYSTICK | SDL_INIT_GAMECONTROLLER) < 0)
 		{
 			throw Exception("Couldn't initialize SDL: %s", SDL_GetError());
@@ -41,7 +238,13 @@ int main(int argc, char **argv)
 			throw Exception("Couldn't create renderer");
 		}
 
-		//GameBoy gb("cpu_instrs\\cpu_instrs.gb", pRenderer.get());
+		if ((argc > 1) && HasExtension(argv[1], ".gbs"))
+		{
+			PlayGbsFile(pWindow.get(), pRenderer.get(), argv[1]);
+			return 0;
+		}
+
+		//GameBoy gb("cpu_instrs\\cpu_instrs.gb");
 		//GameBoy gb("cpu_instrs\\source\\test.gb");
 		//GameBoy gb("cpu_instrs\\individual\\01-special.gb");
 		//GameBoy gb("cpu_instrs\\individual\\02-interrupts.gb");
@@ -54,18 +257,33 @@ int main(int argc, char **argv)
 		//GameBoy gb("cpu_instrs\\individual\\09-op r,r.gb");
 		//GameBoy gb("cpu_instrs\\individual\\10-bit ops.gb");
 		//GameBoy gb("cpu_instrs\\individual\\11-op a,(hl).gb");
-		//GameBoy gb("dmg_sound\\dmg_sound.gb", pRenderer.get());
-		//GameBoy gb("dmg_sound-2\\dmg_sound.gb", pRenderer.get());
-
-		//GameBoy gb("Alleyway (JUE) [!].gb", pRenderer.get()); // messed up attract mode
-		//GameBoy gb("Balloon Kid (JUE) [!].gb", pRenderer.get());
-		//GameBoy gb("F-1 Race (JUE) (V1.1) [!].gb", pRenderer.get()); // MBC2 + battery
-		GameBoy gb("Metroid II - Return of Samus (UE) [!].gb", pRenderer.get());
-		//GameBoy gb("Radar Mission (UE) [!].gb", pRenderer.get());
-		//GameBoy gb("SolarStriker (JU) [!].gb", pRenderer.get()); // keeps LCD disabled
-		//GameBoy gb("Super Mario Land (JUE) (V1.1) [!].gb", pRenderer.get());
-		//GameBoy gb("Tetris (JUE) (V1.1) [!].gb", pRenderer.get());
-		//GameBoy gb("Turok - Battle of the Bionosaurs (UE) (M4) [!].gb", pRenderer.get());
+		//GameBoy gb("dmg_sound\\dmg_sound.gb");
+		//GameBoy gb("dmg_sound-2\\dmg_sound.gb");
+
+		//GameBoy gb("Alleyway (JUE) [!].gb"); // messed up attract mode
+		//GameBoy gb("Balloon Kid (JUE) [!].gb");
+		//GameBoy gb("F-1 Race (JUE) (V1.1) [!].gb"); // MBC2 + battery
+		GameBoy gb("Metroid II - Return of Samus (UE) [!].gb");
+		//GameBoy gb("Radar Mission (UE) [!].gb");
+		//GameBoy gb("SolarStriker (JU) [!].gb"); // keeps LCD disabled
+		//GameBoy gb("Super Mario Land (JUE) (V1.1) [!].gb");
+		//GameBoy gb("Tetris (JUE) (V1.1) [!].gb");
+		//GameBoy gb("Turok - Battle of the Bionosaurs (UE) (M4) [!].gb");
+
+		std::shared_ptr<SDL_Texture> pFrameBuffer(SDL_CreateTexture(pRenderer.get(), SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, Lcd::kScreenWidth, Lcd::kScreenHeight), SDL_DestroyTexture);
+		if (!pFrameBuffer)
+		{
+			throw Exception("Couldn't create framebuffer texture");
+		}
+		gb.SetFrameOutputFormat(FrameOutputFormat::Argb8888);
+		Uint32 lastFrameOutputCount = gb.GetFrameOutputCount();
+
+		gb.SetAudioSink(std::make_shared<AudioDeviceSink>());
+
+		// Hold backspace to rewind, or press [ to pause and step back one frame at a time (g resumes)
+		gb.SetRewindEnabled(true);
+
+		auto pJoystick = OpenJoystick();
 
 		const auto& gameName = gb.GetRom().GetRomName();
 		SDL_SetWindowTitle(pWindow.get(), gameName.c_str());
@@ -103,6 +321,90 @@ int main(int argc, char **argv)
 						case SDLK_n:
 							gb.BreakAtNextInstruction();
 							break;
+						case SDLK_f:
+							// Toggle adaptive frame skipping: skip up to 3 out of every 4 frames while running behind
+							if (gb.GetFrameSkipMode() == Lcd::FrameSkipMode::Disabled)
+							{
+								gb.SetFrameSkip(Lcd::FrameSkipMode::Adaptive, 3, 4);
+							}
+							else
+							{
+								gb.SetFrameSkip(Lcd::FrameSkipMode::Disabled);
+							}
+							break;
+						case SDLK_t:
+							gb.SetRenderThreadEnabled(!gb.IsRenderThreadEnabled());
+							break;
+						case SDLK_a:
+							gb.SetAudioThreadEnabled(!gb.IsAudioThreadEnabled());
+							break;
+						case SDLK_m:
+							gb.SetAudioSynthesisEnabled(!gb.IsAudioSynthesisEnabled());
+							break;
+						case SDLK_l:
+							if (gb.IsAudioLogging())
+							{
+								gb.StopAudioLog();
+							}
+							else
+							{
+								gb.StartAudioLog("audio.gbal");
+							}
+							break;
+						case SDLK_h:
+							// Cycle through the resampler quality presets (not Q, which is the Select button)
+							switch (gb.GetAudioResamplerQuality())
+							{
+							case Sound::ResamplerQuality::Fast: gb.SetAudioResamplerQuality(Sound::ResamplerQuality::Balanced); break;
+							case Sound::ResamplerQuality::Balanced: gb.SetAudioResamplerQuality(Sound::ResamplerQuality::High); break;
+							default: gb.SetAudioResamplerQuality(Sound::ResamplerQuality::Fast); break;
+							}
+							break;
+						case SDLK_F5:
+							{
+								std::vector<Uint8> state;
+								gb.SaveState(state);
+								FILE* pFile = nullptr;
+								fopen_s(&pFile, "savestate.gbss", "wb");
+								if (pFile)
+								{
+									fwrite(state.data(), 1, state.size(), pFile);
+									fclose(pFile);
+								}
+							}
+							break;
+						case SDLK_F9:
+							try
+							{
+								gb.LoadState(*LoadFileAsByteArray("savestate.gbss"));
+							}
+							catch (const Exception& e)
+							{
+								SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Couldn't load state: %s", e.GetMessage());
+							}
+							break;
+						case SDLK_r:
+							// Cycle through 0-2 frames of run-ahead
+							gb.SetRunAheadFrames((gb.GetRunAheadFrames() + 1) % 3);
+							break;
+						case SDLK_LEFTBRACKET:
+							gb.Stop();
+							gb.Rewind();
+							break;
+						case SDLK_c:
+							{
+								// Toggle between plain gray and the greenish tint of the original screen (not P, which is the A button)
+								FramePalette palette = FramePalette::GetDefault();
+								if (gb.GetFramePalette().colors[0] == palette.colors[0])
+								{
+									palette.colors[0] = 0xFF9BBC0F;
+									palette.colors[1] = 0xFF8BAC0F;
+									palette.colors[2] = 0xFF306230;
+									palette.colors[3] = 0xFF0F380F;
+								}
+								gb.SetFramePalette(palette);
+							}
+							break;
 						}
 					}
 					break;
@@ -122,16 +424,31 @@ int main(int argc, char **argv)
 			averageSeconds = (averageSeconds > 0.0f) ? (averageSeconds * (1.0f - averagingRate) + (seconds * averagingRate)) : seconds;
 			if (ticks - lastPrintTicks > 1000)
 			{
-				SDL_SetWindowTitle(pWindow.get(), Format("%s - %3.1f FPS", gameName.c_str(), 1.0f / averageSeconds).c_str());
+				SDL_SetWindowTitle(pWindow.get(), Format("%s - %3.1f FPS - run-ahead %d, %3.1fx headroom", gameName.c_str(), 1.0f / averageSeconds,
+					gb.GetRunAheadFrames(), gb.GetSpeedHeadroom()).c_str());
 				//printf("%3.1f FPS\n", 1.0f / averageSeconds);
 				lastPrintTicks = ticks;
 			}
 
-			gb.Update(seconds);
+			if (SDL_GetKeyboardState(nullptr)[SDL_SCANCODE_BACKSPACE])
+			{
+				gb.Rewind();
+			}
+			else
+			{
+				gb.SetJoypadButtons(ReadJoypadButtons(pJoystick.get()));
+				gb.Update(seconds);
+			}
 			lastTicks = ticks;
 
+			if (gb.GetFrameOutputCount() != lastFrameOutputCount)
+			{
+				SDL_UpdateTexture(pFrameBuffer.get(), NULL, gb.GetFrameOutput(), gb.GetFrameOutputPitch());
+				lastFrameOutputCount = gb.GetFrameOutputCount();
+			}
+
 		    SDL_RenderClear(pRenderer.get());
-		    SDL_RenderCopy(pRenderer.get(), gb.GetFrameBufferTexture(), NULL, NULL);
+		    SDL_RenderCopy(pRenderer.get(), pFrameBuffer.get(), NULL, NULL);
 		    SDL_RenderPresent(pRenderer.get());
 		}
 	}
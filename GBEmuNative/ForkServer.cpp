@@ -0,0 +1,215 @@
+#include "GameBoy.h"
+#include "InputMovie.h"
+#include "Utils.h"
+
+#include "SDL.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// gbforkserver: boots a ROM once, then runs each request in a fork()ed child of that process, so the runs start straight from the
+// booted machine, without loading the ROM, mapping out the memory bus or booting again.  POSIX only.
+//
+//     gbforkserver rom.gb [--boot-movie movie.txt] [--boot-frames N]
+//
+// Boots for N frames (0 by default) with the boot movie's input, prints "ready", then reads requests from stdin, one per line:
+//
+//     <input movie or -> <frames> [<output .pgm or ->]
+//
+// The child plays the movie (its frame numbers count from the fork) for that many frames, optionally writes the last frame, and
+// the server answers each request on stdout, in order, with one line:
+//
+//     ok <pid> <state hash> <frame hash> <seconds from fork to exit>
+//     error <pid> <message>
+//
+// The machine runs without audio synthesis or worker threads: fork() only carries over the calling thread.
+
+// Runs one request in the forked child, and reports on 'resultPipe'
+static void RunChild(GameBoy& gb, const std::vector<std::string>& request, double forkSeconds, int resultPipe)
+{
+	// Exactly one frame's worth of cycles per Update; the float is exact
+	const float kSecondsPerFrame = static_cast<float>(Lcd::kCyclesPerFrame) / MemoryBus::kCyclesPerSecond;
+
+	std::string result;
+	try
+	{
+		if ((request.size() < 2) || (request.size() > 3))
+		{
+			throw Exception("Expected an input movie, a frame count and optionally an output file");
+		}
+
+		std::vector<MovieEvent> movie;
+		if (request[0] != "-")
+		{
+			movie = LoadInputMovie(request[0].c_str());
+		}
+		int numFrames = atoi(request[1].c_str());
+
+		size_t nextEvent = 0;
+		for (int frame = 0; frame < numFrames; ++frame)
+		{
+			while ((nextEvent < movie.size()) && (movie[nextEvent].frame <= frame))
+			{
+				gb.SetJoypadButtons(movie[nextEvent].buttons);
+				++nextEvent;
+			}
+			gb.Update(kSecondsPerFrame);
+		}
+
+		if ((request.size() == 3) && (request[2] != "-"))
+		{
+			FILE* pFile = nullptr;
+			fopen_s(&pFile, request[2].c_str(), "wb");
+			if (!pFile)
+			{
+				throw Exception("Couldn't open %s for writing", request[2].c_str());
+			}
+			fprintf(pFile, "P5\n%d %d\n255\n", Lcd::kScreenWidth, Lcd::kScreenHeight);
+			for (int y = 0; y < Lcd::kScreenHeight; ++y)
+			{
+				fwrite(gb.GetFrameOutput() + y * gb.GetFrameOutputPitch(), 1, Lcd::kScreenWidth, pFile);
+			}
+			fclose(pFile);
+		}
+
+		std::vector<Uint8> state;
+		gb.SaveState(state);
+		result = Format("ok %d %08X %08X %.6f\n", static_cast<int>(getpid()), HashBytes(state.data(), state.size()),
+			HashBytes(gb.GetFrameOutput(), gb.GetFrameOutputSize()), GetHostSeconds() - forkSeconds);
+	}
+	catch (const Exception& e)
+	{
+		result = Format("error %d %s\n", static_cast<int>(getpid()), e.GetMessage());
+	}
+
+	// Well under the pipe's buffer size, so this can't block
+	ssize_t written = write(resultPipe, result.data(), result.size());
+	(void)written;
+}
+
+int main(int argc, char** argv)
+{
+	// Exactly one frame's worth of cycles per Update; the float is exact
+	const float kSecondsPerFrame = static_cast<float>(Lcd::kCyclesPerFrame) / MemoryBus::kCyclesPerSecond;
+
+	if (argc < 2)
+	{
+		printf("Usage: gbforkserver rom.gb [--boot-movie movie.txt] [--boot-frames N]\n");
+		return 1;
+	}
+
+	try
+	{
+		std::vector<MovieEvent> bootMovie;
+		int numBootFrames = 0;
+		for (int i = 2; i < argc; ++i)
+		{
+			if ((strcmp(argv[i], "--boot-movie") == 0) && (i + 1 < argc))
+			{
+				bootMovie = LoadInputMovie(argv[++i]);
+			}
+			else if ((strcmp(argv[i], "--boot-frames") == 0) && (i + 1 < argc))
+			{
+				numBootFrames = atoi(argv[++i]);
+			}
+			else
+			{
+				throw Exception("Unknown option: %s", argv[i]);
+			}
+		}
+
+		GameBoy gb(argv[1]);
+		gb.SetAudioSynthesisEnabled(false);
+		gb.SetFrameOutputFormat(FrameOutputFormat::Gray8);
+
+		size_t nextEvent = 0;
+		for (int frame = 0; frame < numBootFrames; ++frame)
+		{
+			while ((nextEvent < bootMovie.size()) && (bootMovie[nextEvent].frame <= frame))
+			{
+				gb.SetJoypadButtons(bootMovie[nextEvent].buttons);
+				++nextEvent;
+			}
+			gb.Update(kSecondsPerFrame);
+		}
+
+		printf("ready\n");
+		fflush(stdout);
+
+		// One child at a time, so answers come back in request order
+		char line[4096];
+		while (fgets(line, sizeof(line), stdin))
+		{
+			std::vector<std::string> request;
+			try
+			{
+				request = Tokenize(line);
+			}
+			catch (const Exception& e)
+			{
+				printf("error 0 %s\n", e.GetMessage());
+				fflush(stdout);
+				continue;
+			}
+			if (request.empty())
+			{
+				continue;
+			}
+
+			int resultPipe[2];
+			if (pipe(resultPipe) != 0)
+			{
+				throw Exception("Couldn't create a pipe");
+			}
+
+			double forkSeconds = GetHostSeconds();
+			pid_t pid = fork();
+			if (pid < 0)
+			{
+				throw Exception("Couldn't fork");
+			}
+			if (pid == 0)
+			{
+				close(resultPipe[0]);
+				RunChild(gb, request, forkSeconds, resultPipe[1]);
+				// Skips the parent's atexit handlers and stdio buffers
+				_exit(0);
+			}
+
+			close(resultPipe[1]);
+			std::string result;
+			char buffer[512];
+			ssize_t numRead;
+			while ((numRead = read(resultPipe[0], buffer, sizeof(buffer))) > 0)
+			{
+				result.append(buffer, numRead);
+			}
+			close(resultPipe[0]);
+
+			int status = 0;
+			waitpid(pid, &status, 0);
+			if (result.empty())
+			{
+				// Died before it could say anything
+				result = WIFSIGNALED(status) ? Format("error %d killed by signal %d\n", static_cast<int>(pid), WTERMSIG(status))
+					: Format("error %d exited with status %d\n", static_cast<int>(pid), WEXITSTATUS(status));
+			}
+			fputs(result.c_str(), stdout);
+			fflush(stdout);
+		}
+	}
+	catch (const Exception& e)
+	{
+		printf("error 0 %s\n", e.GetMessage());
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,239 @@
+#pragma once
+
+#include "SDL.h"
+
+#include <string.h>
+
+#if defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2)) || defined(__SSE2__)
+#define FRAME_OUTPUT_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// The Lcd rasterizes into a buffer of shades (0 = lightest, 3 = darkest, after the BGP/OBPx palettes are applied).
+// Consumers pick the format they want the frame in; nothing is converted for formats nobody asked for.
+enum class FrameOutputFormat
+{
+	None,		// No conversion, frames are only rasterized
+	Argb8888,	// 4 bytes per pixel, through the frame palette
+	Rgb565,		// 2 bytes per pixel, through the frame palette
+	Gray8,		// 1 byte per pixel, luminance of the frame palette colors
+	Packed2bpp,	// 4 pixels per byte, leftmost pixel in the two most significant bits; raw shades, the palette is not applied
+};
+
+// Colors for the 4 shades, as ARGB8888
+struct FramePalette
+{
+	Uint32 colors[4];
+
+	static FramePalette GetDefault()
+	{
+		FramePalette palette;
+		for (int shade = 0; shade < 4; ++shade)
+		{
+			Uint8 luminosity = (3 - shade) * 0x55;
+			palette.colors[shade] = 0xFF000000 | (luminosity << 16) | (luminosity << 8) | luminosity;
+		}
+		return palette;
+	}
+};
+
+namespace FrameOutput
+{
+	inline int GetBytesPerRow(FrameOutputFormat format, int width)
+	{
+		switch (format)
+		{
+		case FrameOutputFormat::Argb8888: return width * 4;
+		case FrameOutputFormat::Rgb565: return width * 2;
+		case FrameOutputFormat::Gray8: return width;
+		case FrameOutputFormat::Packed2bpp: return (width + 3) / 4;
+		default: return 0;
+		}
+	}
+
+	inline Uint16 ToRgb565(Uint32 argb)
+	{
+		return static_cast<Uint16>(((argb >> 8) & 0xF800) | ((argb >> 5) & 0x07E0) | ((argb >> 3) & 0x001F));
+	}
+
+	inline Uint8 ToGray8(Uint32 argb)
+	{
+		// Rec. 601 luma weights, in 8-bit fixed point
+		Uint32 r = (argb >> 16) & 0xFF;
+		Uint32 g = (argb >> 8) & 0xFF;
+		Uint32 b = argb & 0xFF;
+		return static_cast<Uint8>((r * 77 + g * 150 + b * 29) >> 8);
+	}
+
+	// All kernels convert numPixels shades starting at pShades.  The SSE2 paths handle 16 pixels at a time and finish with the scalar loop.
+	// SSE2 has no byte shuffle, so the 4-entry palette lookup is done with one compare-and-select per shade.
+
+	inline void ConvertToArgb8888(const Uint8* pShades, int numPixels, const FramePalette& palette, Uint32* pDestination)
+	{
+		int i = 0;
+#ifdef FRAME_OUTPUT_SSE2
+		const __m128i zero = _mm_setzero_si128();
+		__m128i shadeValues[4];
+		__m128i colors[4];
+		for (int shade = 0; shade < 4; ++shade)
+		{
+			shadeValues[shade] = _mm_set1_epi32(shade);
+			colors[shade] = _mm_set1_epi32(static_cast<int>(palette.colors[shade]));
+		}
+
+		for ( ; i + 16 <= numPixels; i += 16)
+		{
+			__m128i shades8 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pShades + i));
+			__m128i shades16[2] = { _mm_unpacklo_epi8(shades8, zero), _mm_unpackhi_epi8(shades8, zero) };
+			for (int half = 0; half < 2; ++half)
+			{
+				__m128i shades32[2] = { _mm_unpacklo_epi16(shades16[half], zero), _mm_unpackhi_epi16(shades16[half], zero) };
+				for (int quarter = 0; quarter < 2; ++quarter)
+				{
+					__m128i result = zero;
+					for (int shade = 0; shade < 4; ++shade)
+					{
+						result = _mm_or_si128(result, _mm_and_si128(_mm_cmpeq_epi32(shades32[quarter], shadeValues[shade]), colors[shade]));
+					}
+					_mm_storeu_si128(reinterpret_cast<__m128i*>(pDestination + i + half * 8 + quarter * 4), result);
+				}
+			}
+		}
+#endif
+		for ( ; i < numPixels; ++i)
+		{
+			pDestination[i] = palette.colors[pShades[i] & 3];
+		}
+	}
+
+	inline void ConvertToRgb565(const Uint8* pShades, int numPixels, const FramePalette& palette, Uint16* pDestination)
+	{
+		Uint16 colors565[4];
+		for (int shade = 0; shade < 4; ++shade)
+		{
+			colors565[shade] = ToRgb565(palette.colors[shade]);
+		}
+
+		int i = 0;
+#ifdef FRAME_OUTPUT_SSE2
+		const __m128i zero = _mm_setzero_si128();
+		__m128i shadeValues[4];
+		__m128i colors[4];
+		for (int shade = 0; shade < 4; ++shade)
+		{
+			shadeValues[shade] = _mm_set1_epi16(static_cast<short>(shade));
+			colors[shade] = _mm_set1_epi16(static_cast<short>(colors565[shade]));
+		}
+
+		for ( ; i + 16 <= numPixels; i += 16)
+		{
+			__m128i shades8 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pShades + i));
+			__m128i shades16[2] = { _mm_unpacklo_epi8(shades8, zero), _mm_unpackhi_epi8(shades8, zero) };
+			for (int half = 0; half < 2; ++half)
+			{
+				__m128i result = zero;
+				for (int shade = 0; shade < 4; ++shade)
+				{
+					result = _mm_or_si128(result, _mm_and_si128(_mm_cmpeq_epi16(shades16[half], shadeValues[shade]), colors[shade]));
+				}
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(pDestination + i + half * 8), result);
+			}
+		}
+#endif
+		for ( ; i < numPixels; ++i)
+		{
+			pDestination[i] = colors565[pShades[i] & 3];
+		}
+	}
+
+	inline void ConvertToGray8(const Uint8* pShades, int numPixels, const FramePalette& palette, Uint8* pDestination)
+	{
+		Uint8 grays[4];
+		for (int shade = 0; shade < 4; ++shade)
+		{
+			grays[shade] = ToGray8(palette.colors[shade]);
+		}
+
+		int i = 0;
+#ifdef FRAME_OUTPUT_SSE2
+		__m128i shadeValues[4];
+		__m128i colors[4];
+		for (int shade = 0; shade < 4; ++shade)
+		{
+			shadeValues[shade] = _mm_set1_epi8(static_cast<char>(shade));
+			colors[shade] = _mm_set1_epi8(static_cast<char>(grays[shade]));
+		}
+
+		for ( ; i + 16 <= numPixels; i += 16)
+		{
+			__m128i shades8 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pShades + i));
+			__m128i result = _mm_setzero_si128();
+			for (int shade = 0; shade < 4; ++shade)
+			{
+				result = _mm_or_si128(result, _mm_and_si128(_mm_cmpeq_epi8(shades8, shadeValues[shade]), colors[shade]));
+			}
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(pDestination + i), result);
+		}
+#endif
+		for ( ; i < numPixels; ++i)
+		{
+			pDestination[i] = grays[pShades[i] & 3];
+		}
+	}
+
+	// numPixels must be a multiple of 4
+	inline void ConvertToPacked2bpp(const Uint8* pShades, int numPixels, Uint8* pDestination)
+	{
+		SDL_assert((numPixels % 4) == 0);
+
+		int i = 0;
+#ifdef FRAME_OUTPUT_SSE2
+		// Each 32-bit lane holds 4 consecutive shades (first one in the low byte); fold them into the lane's low byte, then narrow
+		const __m128i mask0 = _mm_set1_epi32(0xC0);
+		const __m128i mask1 = _mm_set1_epi32(0x30);
+		const __m128i mask2 = _mm_set1_epi32(0x0C);
+		const __m128i mask3 = _mm_set1_epi32(0x03);
+		for ( ; i + 16 <= numPixels; i += 16)
+		{
+			__m128i shades = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pShades + i));
+			__m128i packed = _mm_and_si128(_mm_slli_epi32(shades, 6), mask0);
+			packed = _mm_or_si128(packed, _mm_and_si128(_mm_srli_epi32(shades, 4), mask1));
+			packed = _mm_or_si128(packed, _mm_and_si128(_mm_srli_epi32(shades, 14), mask2));
+			packed = _mm_or_si128(packed, _mm_and_si128(_mm_srli_epi32(shades, 24), mask3));
+			packed = _mm_packs_epi32(packed, packed);
+			packed = _mm_packus_epi16(packed, packed);
+			Uint32 bytes = static_cast<Uint32>(_mm_cvtsi128_si32(packed));
+			memcpy(pDestination + i / 4, &bytes, sizeof(bytes));
+		}
+#endif
+		for ( ; i < numPixels; i += 4)
+		{
+			pDestination[i / 4] = ((pShades[i] & 3) << 6) | ((pShades[i + 1] & 3) << 4) | ((pShades[i + 2] & 3) << 2) | (pShades[i + 3] & 3);
+		}
+	}
+
+	// Converts a tightly packed shade buffer; pDestination must hold GetBytesPerRow(format, width) * height bytes
+	inline void Convert(FrameOutputFormat format, const Uint8* pShades, int width, int height, const FramePalette& palette, void* pDestination)
+	{
+		int numPixels = width * height;
+		switch (format)
+		{
+		case FrameOutputFormat::Argb8888:
+			ConvertToArgb8888(pShades, numPixels, palette, static_cast<Uint32*>(pDestination));
+			break;
+		case FrameOutputFormat::Rgb565:
+			ConvertToRgb565(pShades, numPixels, palette, static_cast<Uint16*>(pDestination));
+			break;
+		case FrameOutputFormat::Gray8:
+			ConvertToGray8(pShades, numPixels, palette, static_cast<Uint8*>(pDestination));
+			break;
+		case FrameOutputFormat::Packed2bpp:
+			// Rows stay byte-aligned as long as the width is a multiple of 4, which is the case for the LCD
+			SDL_assert((width % 4) == 0);
+			ConvertToPacked2bpp(pShades, numPixels, static_cast<Uint8*>(pDestination));
+			break;
+		default:
+			break;
+		}
+	}
+}
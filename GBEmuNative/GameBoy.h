@@ -10,6 +10,7 @@
 #include "Sound.h"
 #include "Memory.h"
 #include "UnknownMemoryMappedRegisters.h"
+#include "RewindBuffer.h"
 
 #include "RomOnlyMapper.h"
 #include "Mbc1Mapper.h"
@@ -23,52 +24,36 @@ public:
 		SingleStepping
 	};
 
-	GameBoy(const char* pFileName, SDL_Renderer* pRenderer)
+	// Needs no window, renderer or audio device: frames come out through GetFrameOutput, audio through the sink given to SetAudioSink,
+	// and input goes in through SetJoypadButtons
+	GameBoy(const char* pFileName)
 	{
-		m_pFrameBuffer.reset(SDL_CreateTexture(pRenderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, Lcd::kScreenWidth, Lcd::kScreenHeight), SDL_DestroyTexture);
-		if (!pRenderer)
-		{
-			throw Exception("Couldn't create framebuffer texture");
-		}
-
-		m_pRom.reset(new Rom(pFileName));
-
-		auto cartridgeType = m_pRom->GetCartridgeType();
-		switch (cartridgeType)
-		{
-		case CartridgeType::ROM_ONLY: m_pMapper.reset(new RomOnlyMapper(m_pRom)); break;
-		
-		case CartridgeType::MBC1:
-		case CartridgeType::MBC1_RAM:
-		case CartridgeType::MBC1_RAM_BATTERY:
-			m_pMapper.reset(new Mbc1Mapper(m_pRom)); break;
-
-		default:
-			throw Exception("Unsupported cartridge type: %d", cartridgeType);
-		}
+		Initialize(std::make_shared<Rom>(pFileName), nullptr);
+	}
 
-		m_pMemoryBus.reset(new MemoryBus());
-		m_pMemory.reset(new Memory());
-		m_pCpu.reset(new Cpu(m_pMemoryBus));
-		m_pTimer.reset(new Timer(m_pMemoryBus, m_pCpu));
-		m_pJoypad.reset(new Joypad(m_pMemoryBus, m_pCpu));
-		m_pGameLinkPort.reset(new GameLinkPort());
-		m_pLcd.reset(new Lcd(m_pMemoryBus, m_pCpu, m_pFrameBuffer));
-		m_pSound.reset(new Sound());
-		m_pUnknownMemoryMappedRegisters.reset(new UnknownMemoryMappedRegisters());
+	// Instances running the same game can share one ROM; nothing writes to it
+	GameBoy(const std::shared_ptr<Rom>& pRom)
+	{
+		Initialize(pRom, nullptr);
+	}
 
-		m_pMemoryBus->AddDevice(m_pMemory);
-		m_pMemoryBus->AddDevice(m_pMapper);
-		m_pMemoryBus->AddDevice(m_pCpu);
-		m_pMemoryBus->AddDevice(m_pTimer);
-		m_pMemoryBus->AddDevice(m_pJoypad);
-		m_pMemoryBus->AddDevice(m_pGameLinkPort);
-		m_pMemoryBus->AddDevice(m_pLcd);
-		m_pMemoryBus->AddDevice(m_pSound);
-		m_pMemoryBus->AddDevice(m_pUnknownMemoryMappedRegisters);
-		m_pMemoryBus->LockDevices();
+	// A new instance in exactly this one's state, showing the same frame, sharing the ROM, and with the same joypad buttons, frame
+	// output format, palette and audio synthesis setting.  The audio sink, rewind, run-ahead and the debugger aren't carried over.
+	// Most of the cost of constructing an instance is mapping out the memory bus, which the fork takes from this one, so forking
+	// costs little more than saving and loading a state.  To branch from the same point over and over, LoadState into instances
+	// forked once is cheaper still.
+	std::shared_ptr<GameBoy> Fork()
+	{
+		std::shared_ptr<GameBoy> pChild(new GameBoy(m_pRom, m_pMemoryBus.get()));
+		pChild->SetAudioSynthesisEnabled(IsAudioSynthesisEnabled());
+		pChild->SetFrameOutputFormat(m_pLcd->GetFrameOutputFormat());
+		pChild->SetFramePalette(GetFramePalette());
+		pChild->SetJoypadButtons(GetJoypadButtons());
 
-		Reset();
+		SaveState(m_forkState);
+		pChild->LoadState(m_forkState);
+		pChild->RestoreFrameOutput(GetFrameOutput(), GetFrameOutputSize());
+		return pChild;
 	}
 
 	const Rom& GetRom() const
@@ -76,9 +61,9 @@ public:
 		return *m_pRom;
 	}
 
-	SDL_Texture* GetFrameBufferTexture() const
+	const std::shared_ptr<Rom>& GetSharedRom() const
 	{
-		return m_pFrameBuffer.get();
+		return m_pRom;
 	}
 
 	void Reset()
@@ -140,7 +125,267 @@ public:
 
 	void BreakInDebugger()
 	{
-		DebugBreak();
+		SDL_TriggerBreakpoint();
+	}
+
+	void SetFrameSkip(Lcd::FrameSkipMode mode, int framesToSkip = 0, int frameSkipPeriod = 1)
+	{
+		m_pLcd->SetFrameSkip(mode, framesToSkip, frameSkipPeriod);
+	}
+
+	Lcd::FrameSkipMode GetFrameSkipMode() const
+	{
+		return m_pLcd->GetFrameSkipMode();
+	}
+
+	void RequestRenderNextFrame()
+	{
+		m_pLcd->RequestRenderNextFrame();
+	}
+
+	// Not together with run-ahead; enabling one disables the other
+	void SetRenderThreadEnabled(bool enabled)
+	{
+		if (enabled)
+		{
+			m_runAheadFrames = 0;
+		}
+		m_pLcd->SetRenderThreadEnabled(enabled);
+	}
+
+	bool IsRenderThreadEnabled() const
+	{
+		return m_pLcd->IsRenderThreadEnabled();
+	}
+
+	void SetAudioSampleRate(int sampleRate)
+	{
+		m_pSound->SetOutputSampleRate(sampleRate);
+	}
+
+	void SetAudioResamplerQuality(Sound::ResamplerQuality quality)
+	{
+		m_pSound->SetResamplerQuality(quality);
+	}
+
+	Sound::ResamplerQuality GetAudioResamplerQuality() const
+	{
+		return m_pSound->GetResamplerQuality();
+	}
+
+	// An AudioDeviceSink to listen, or a WavFileAudioSink/MemoryAudioSink to render; nothing is output until one is set
+	void SetAudioSink(std::shared_ptr<IAudioSink> pSink)
+	{
+		m_pSound->SetAudioSink(pSink);
+	}
+
+	// Records every APU register write to a file (see ApuLog.h); the log replays exactly from the next reset on
+	void StartAudioLog(const char* pFileName)
+	{
+		m_pSound->SetRegisterLog(std::make_shared<ApuLogWriter>(pFileName));
+	}
+
+	void StopAudioLog()
+	{
+		m_pSound->SetRegisterLog(nullptr);
+	}
+
+	bool IsAudioLogging() const
+	{
+		return m_pSound->GetRegisterLog() != nullptr;
+	}
+
+	// Disabled, the APU's registers still behave exactly, but no audio is synthesized; for headless runs
+	void SetAudioSynthesisEnabled(bool enabled)
+	{
+		m_pSound->SetSynthesisEnabled(enabled);
+	}
+
+	bool IsAudioSynthesisEnabled() const
+	{
+		return m_pSound->IsSynthesisEnabled();
+	}
+
+	void SetAudioThreadEnabled(bool enabled)
+	{
+		m_pSound->SetSynthesisThreadEnabled(enabled);
+	}
+
+	bool IsAudioThreadEnabled() const
+	{
+		return m_pSound->IsSynthesisThreadEnabled();
+	}
+
+	void SetFrameOutputFormat(FrameOutputFormat format)
+	{
+		m_pLcd->SetFrameOutputFormat(format);
+	}
+
+	void SetFramePalette(const FramePalette& palette)
+	{
+		m_pLcd->SetFramePalette(palette);
+	}
+
+	const FramePalette& GetFramePalette() const
+	{
+		return m_pLcd->GetFramePalette();
+	}
+
+	// Last completed frame in the format selected with SetFrameOutputFormat
+	const Uint8* GetFrameOutput() const
+	{
+		return m_pLcd->GetFrameOutput();
+	}
+
+	int GetFrameOutputPitch() const
+	{
+		return m_pLcd->GetFrameOutputPitch();
+	}
+
+	size_t GetFrameOutputSize() const
+	{
+		return m_pLcd->GetFrameOutputSize();
+	}
+
+	Uint32 GetFrameOutputCount() const
+	{
+		return m_pLcd->GetFrameOutputCount();
+	}
+
+	// Puts back a frame saved from GetFrameOutput along with a save state, after loading that state
+	void RestoreFrameOutput(const Uint8* pFrame, size_t size)
+	{
+		m_pLcd->RestoreFrameOutput(pFrame, size);
+	}
+
+	// Reads memory without going through the bus, so nothing is triggered; for RAM, ROM and VRAM, not I/O registers, which read 0xFF
+	Uint8 PeekMemory(Uint16 address) const
+	{
+		const Uint8* pByte = m_pMemoryBus->GetReadPointer(address, 1);
+		return pByte ? *pByte : 0xFF;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Save states
+	///////////////////////////////////////////////////////////////////////////
+
+	// Bumped whenever a component's SerializeState changes
+	static const Uint32 kSaveStateVersion = 2;
+
+	// Replaces the buffer's contents with the machine's state.  Reusing the buffer from one save to the next avoids allocating.
+	// The debugger, frame skip settings, audio output and joypad buttons are the host's, and aren't part of the state.
+	void SaveState(std::vector<Uint8>& buffer)
+	{
+		buffer.clear();
+		StateSerializer state(buffer);
+
+		SaveStateHeader header = { { 'G', 'B', 'S', 'S' }, kSaveStateVersion, m_pRom->GetHash(), 0 };
+		state.Value(header);
+		SerializeState(state);
+
+		// Now that the size is known
+		header.size = static_cast<Uint32>(buffer.size());
+		memcpy(buffer.data(), &header, sizeof(header));
+	}
+
+	// Throws if the state isn't one saved by this build, for this ROM, leaving the machine untouched.  A state that passes those
+	// checks but is corrupt past the header can still throw partway through, leaving a mix of old and new state; Reset recovers.
+	void LoadState(const Uint8* pData, size_t size)
+	{
+		SaveStateHeader header;
+		if (size < sizeof(header))
+		{
+			throw Exception("Save state is truncated");
+		}
+		memcpy(&header, pData, sizeof(header));
+
+		if (memcmp(header.magic, "GBSS", 4) != 0)
+		{
+			throw Exception("Not a save state");
+		}
+		if (header.version != kSaveStateVersion)
+		{
+			throw Exception("Save state is version %d, expected %d", header.version, kSaveStateVersion);
+		}
+		if (header.romHash != m_pRom->GetHash())
+		{
+			throw Exception("Save state is for a different ROM");
+		}
+		if (header.size != size)
+		{
+			throw Exception("Save state is %d bytes, expected %d", static_cast<int>(size), header.size);
+		}
+
+		StateSerializer state(pData + sizeof(header), size - sizeof(header));
+		SerializeState(state);
+	}
+
+	void LoadState(const std::vector<Uint8>& buffer)
+	{
+		LoadState(buffer.data(), buffer.size());
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Rewind
+	///////////////////////////////////////////////////////////////////////////
+
+	static const size_t kDefaultRewindBufferSize = 32 * 1024 * 1024;
+
+	// While enabled, Update takes a snapshot of the machine and the frame output every few frames, keeping as many as fit in the
+	// buffer size given (plus one whole snapshot).  At one frame per snapshot, 32 MB typically goes back a few minutes.
+	void SetRewindEnabled(bool enabled, size_t bufferSize = kDefaultRewindBufferSize, int framesPerSnapshot = 1)
+	{
+		if (enabled)
+		{
+			m_pRewindBuffer = std::make_shared<RewindBuffer>(bufferSize);
+			m_rewindCyclesPerSnapshot = SDL_max(framesPerSnapshot, 1) * static_cast<Sint32>(Lcd::kCyclesPerFrame);
+			m_rewindCyclesUntilSnapshot = 0;
+		}
+		else
+		{
+			m_pRewindBuffer.reset();
+		}
+	}
+
+	bool IsRewindEnabled() const
+	{
+		return m_pRewindBuffer != nullptr;
+	}
+
+	size_t GetNumRewindSnapshots() const
+	{
+		return m_pRewindBuffer ? m_pRewindBuffer->GetNumSnapshots() : 0;
+	}
+
+	// Puts the machine and the frame output back to the newest snapshot, and drops it, so the next call goes further back.  Returns
+	// false when there's nothing left to go back to.  Audio isn't rewound; the sink just gets nothing while this is called instead
+	// of Update.
+	bool Rewind()
+	{
+		if (!m_pRewindBuffer || !m_pRewindBuffer->Pop(m_rewindSnapshot))
+		{
+			return false;
+		}
+
+		// The save state, then the frame output
+		SaveStateHeader header;
+		memcpy(&header, m_rewindSnapshot.data(), sizeof(header));
+		LoadState(m_rewindSnapshot.data(), header.size);
+		m_pLcd->RestoreFrameOutput(m_rewindSnapshot.data() + header.size, m_rewindSnapshot.size() - header.size);
+
+		m_rewindCyclesUntilSnapshot = m_rewindCyclesPerSnapshot;
+		return true;
+	}
+
+	// A combination of JoypadButton values for the buttons held down
+	void SetJoypadButtons(Uint8 buttons)
+	{
+		m_pJoypad->SetButtons(buttons);
+	}
+
+	Uint8 GetJoypadButtons() const
+	{
+		return m_pJoypad->GetButtons();
 	}
 
 	void Update(float seconds)
@@ -153,14 +398,143 @@ public:
 
 		// CPU cycles are counted here, and not in the CPU, because they are the atom of emulator execution
 		m_cyclesRemaining += seconds * MemoryBus::kCyclesPerSecond;
-	
+
+		auto startSeconds = GetHostSeconds();
+
+		Sint32 cyclesExecuted = RunCycles();
+
+		// Sound is synthesized lazily; bring it up to date and hand this slice's samples to the audio sink
+		m_pSound->EndTimeSlice();
+
+		// Pick up whatever the render thread finished in the meantime
+		m_pLcd->PresentRenderThreadFrame();
+
+		if (m_pRewindBuffer)
+		{
+			m_rewindCyclesUntilSnapshot -= cyclesExecuted;
+			if (m_rewindCyclesUntilSnapshot <= 0)
+			{
+				TakeRewindSnapshot();
+				m_rewindCyclesUntilSnapshot += m_rewindCyclesPerSnapshot;
+			}
+		}
+
+		if ((m_runAheadFrames > 0) && (seconds > 0.0f))
+		{
+			RunAhead();
+		}
+
+		// If emulating this slice took longer than the slice itself, we're falling behind real time; adaptive frame skipping keys off this
+		if (seconds > 0.0f)
+		{
+			auto hostSeconds = GetHostSeconds() - startSeconds;
+			m_pLcd->SetRunningBehind(hostSeconds > seconds);
+			m_speedHeadroom = static_cast<float>(seconds / SDL_max(hostSeconds, 1e-9));
+		}
+
+		//@TODO: synchronize updates to LCD controller vblanks to avoid tearing
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Run-ahead
+	///////////////////////////////////////////////////////////////////////////
+
+	// With N frames of run-ahead, every Update ends by saving the state, emulating N more frames with the buttons as they are now,
+	// keeping the frame output from that, and loading the state back.  The frames shown are N frames into a future where the buttons
+	// were pressed that much earlier, hiding the frame or two most games take to react.  Audio comes from the real timeline only.
+	// Each frame of run-ahead costs about as much as emulating a frame, so check GetSpeedHeadroom.  Turns the render thread off.
+	void SetRunAheadFrames(int frames)
+	{
+		m_runAheadFrames = SDL_max(frames, 0);
+		if (m_runAheadFrames > 0)
+		{
+			m_pLcd->SetRenderThreadEnabled(false);
+		}
+	}
+
+	int GetRunAheadFrames() const
+	{
+		return m_runAheadFrames;
+	}
+
+	// How many times over the last Update could have run in the time it covered, run-ahead and all; below 1, it's falling behind
+	float GetSpeedHeadroom() const
+	{
+		return m_speedHeadroom;
+	}
+
+private:
+	// For Fork
+	GameBoy(const std::shared_ptr<Rom>& pRom, const MemoryBus* pBusLayout)
+	{
+		Initialize(pRom, pBusLayout);
+	}
+
+	// The memory bus is mapped out from scratch, or copied from pBusLayout, the bus of another instance running the same ROM
+	void Initialize(const std::shared_ptr<Rom>& pRom, const MemoryBus* pBusLayout)
+	{
+		m_pRom = pRom;
+		m_rewindCyclesPerSnapshot = 0;
+		m_rewindCyclesUntilSnapshot = 0;
+		m_runAheadFrames = 0;
+		m_speedHeadroom = 0.0f;
+
+		auto cartridgeType = m_pRom->GetCartridgeType();
+		switch (cartridgeType)
+		{
+		case CartridgeType::ROM_ONLY: m_pMapper.reset(new RomOnlyMapper(m_pRom)); break;
+		
+		case CartridgeType::MBC1:
+		case CartridgeType::MBC1_RAM:
+		case CartridgeType::MBC1_RAM_BATTERY:
+			m_pMapper.reset(new Mbc1Mapper(m_pRom)); break;
+
+		default:
+			throw Exception("Unsupported cartridge type: %d", cartridgeType);
+		}
+
+		m_pMemoryBus.reset(new MemoryBus());
+		m_pMemory.reset(new Memory());
+		m_pCpu.reset(new Cpu(m_pMemoryBus));
+		m_pTimer.reset(new Timer(m_pMemoryBus, m_pCpu));
+		m_pJoypad.reset(new Joypad(m_pMemoryBus, m_pCpu));
+		m_pGameLinkPort.reset(new GameLinkPort());
+		m_pLcd.reset(new Lcd(m_pMemoryBus, m_pCpu));
+		m_pSound.reset(new Sound());
+		m_pUnknownMemoryMappedRegisters.reset(new UnknownMemoryMappedRegisters());
+
+		m_pMemoryBus->AddDevice(m_pMemory);
+		m_pMemoryBus->AddDevice(m_pMapper);
+		m_pMemoryBus->AddDevice(m_pCpu);
+		m_pMemoryBus->AddDevice(m_pTimer);
+		m_pMemoryBus->AddDevice(m_pJoypad);
+		m_pMemoryBus->AddDevice(m_pGameLinkPort);
+		m_pMemoryBus->AddDevice(m_pLcd);
+		m_pMemoryBus->AddDevice(m_pSound);
+		m_pMemoryBus->AddDevice(m_pUnknownMemoryMappedRegisters);
+		if (pBusLayout)
+		{
+			m_pMemoryBus->LockDevicesLike(*pBusLayout);
+		}
+		else
+		{
+			m_pMemoryBus->LockDevices();
+		}
+
+		Reset();
+	}
+
+	// Runs until m_cyclesRemaining is used up; returns the number of cycles run
+	Sint32 RunCycles()
+	{
 		const float timePerClockCycle = 1.0f / MemoryBus::kCyclesPerSecond;
+		Sint32 cyclesExecuted = 0;
 
 		while (m_cyclesRemaining > 0)
 		{
 			auto instructionCycles = m_pCpu->ExecuteSingleInstruction();
+			cyclesExecuted += instructionCycles;
 			m_totalCyclesExecuted += instructionCycles;
-			g_totalCyclesExecuted += instructionCycles;
 			m_cyclesRemaining -= instructionCycles;
 
 			auto timeSpentOnInstruction = timePerClockCycle * instructionCycles;
@@ -182,10 +556,64 @@ public:
 			m_pCpu->DebugNextOpcode();
 		}
 
-		//@TODO: synchronize updates to LCD controller vblanks to avoid tearing
+		return cyclesExecuted;
+	}
+
+	void RunAhead()
+	{
+		SaveState(m_runAheadState);
+		m_pSound->SetSpeculating(true);
+
+		// Breakpoints are for the real timeline
+		auto debuggerState = m_debuggerState;
+		auto breakpointAddress = m_breakpointAddress;
+		m_breakpointAddress = -1;
+
+		m_cyclesRemaining += m_runAheadFrames * static_cast<float>(Lcd::kCyclesPerFrame);
+		RunCycles();
+
+		m_debuggerState = debuggerState;
+		m_breakpointAddress = breakpointAddress;
+
+		// The frame output keeps the frame from the future
+		LoadState(m_runAheadState);
+		m_pSound->SetSpeculating(false);
+	}
+
+	void TakeRewindSnapshot()
+	{
+		SaveState(m_rewindSnapshot);
+		const Uint8* pFrameOutput = m_pLcd->GetFrameOutput();
+		if (pFrameOutput)
+		{
+			m_rewindSnapshot.insert(m_rewindSnapshot.end(), pFrameOutput, pFrameOutput + m_pLcd->GetFrameOutputSize());
+		}
+		m_pRewindBuffer->Push(m_rewindSnapshot);
+	}
+
+	struct SaveStateHeader
+	{
+		char magic[4];
+		Uint32 version;
+		Uint32 romHash;
+		Uint32 size; // including the header
+	};
+
+	void SerializeState(StateSerializer& state)
+	{
+		state.Value(m_totalCyclesExecuted);
+		state.Value(m_cyclesRemaining);
+
+		m_pMemory->SerializeState(state);
+		m_pMapper->SerializeState(state);
+		m_pCpu->SerializeState(state);
+		m_pTimer->SerializeState(state);
+		m_pJoypad->SerializeState(state);
+		m_pGameLinkPort->SerializeState(state);
+		m_pLcd->SerializeState(state);
+		m_pSound->SerializeState(state);
 	}
 
-private:
 	static bool s_stopOnNextInstruction;
 	
 	// @TODO: possibly refactor into some kind of system component collection?
@@ -206,5 +634,14 @@ private:
 	DebuggerState m_debuggerState;
 	Sint32 m_breakpointAddress;
 
-	std::shared_ptr<SDL_Texture> m_pFrameBuffer;
+	std::shared_ptr<RewindBuffer> m_pRewindBuffer;
+	std::vector<Uint8> m_rewindSnapshot;
+	Sint32 m_rewindCyclesPerSnapshot;
+	Sint32 m_rewindCyclesUntilSnapshot;
+
+	int m_runAheadFrames;
+	std::vector<Uint8> m_runAheadState;
+	float m_speedHeadroom;
+
+	std::vector<Uint8> m_forkState;
 };
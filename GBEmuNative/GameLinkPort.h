@@ -7,10 +7,13 @@
 class GameLinkPort : public IMemoryBusDevice
 {
 public:
-	enum class Registers
+	struct Registers
 	{
-		SB = 0xFF01,	// Serial transfer data
-		SC = 0xFF02,	// Serial transfer control
+		enum Type
+		{
+			SB = 0xFF01,	// Serial transfer data
+			SC = 0xFF02,	// Serial transfer control
+		};
 	};
 
 	GameLinkPort()
@@ -24,6 +27,12 @@ public:
 		SC = 0;
 	}
 
+	void SerializeState(StateSerializer& state)
+	{
+		state.Value(SB);
+		state.Value(SC);
+	}
+
 	virtual bool HandleRequest(MemoryRequestType requestType, Uint16 address, Uint8& value)
 	{
 		switch (address)
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "MemoryMapper.h"
+#include "Utils.h"
+
+#include <vector>
+
+// The cartridge side of a GBS rip: the music code and data laid out as a ROM image, switched in 16k banks at 0x4000 by writes to
+// 0x2000-0x3FFF, the same way MBC1 does it, plus 8k of RAM at 0xA000.  GbsPlayer builds the image.
+class GbsMapper : public MemoryMapper
+{
+public:
+	static const int kRomFixedBankBase = 0x0000;
+	static const int kRomFixedBankSize = 0x4000;
+	static const int kRomSwitchedBankBase = 0x4000;
+	static const int kRomSwitchedBankSize = 0x8000 - kRomSwitchedBankBase;
+
+	static const int kRamBankBase = 0xA000;
+	static const int kRamBankSize = 0xC000 - kRamBankBase;
+
+	static const int kRomBankNumberBase = 0x2000;
+	static const int kRomBankNumberSize = 0x4000 - kRomBankNumberBase;
+
+	// The image must be a whole number of banks, at least two
+	GbsMapper(const std::vector<Uint8>& romImage)
+		: m_romBytes(romImage)
+		, m_numRomBanks(static_cast<int>(romImage.size() / kRomSwitchedBankSize))
+	{
+		SDL_assert((romImage.size() % kRomSwitchedBankSize == 0) && (m_numRomBanks >= 2));
+		Reset();
+	}
+
+	virtual void Reset()
+	{
+		memset(m_externalRam, 0, sizeof(m_externalRam));
+		m_romBankIndex = 1;
+	}
+
+	virtual void SerializeState(StateSerializer& state)
+	{
+		state.Value(m_externalRam);
+		state.Value(m_romBankIndex);
+	}
+
+	virtual bool HandleRequest(MemoryRequestType requestType, Uint16 address, Uint8& value)
+	{
+		if (requestType == MemoryRequestType::Read)
+		{
+			if (IsAddressInRange(address, kRomFixedBankBase, kRomFixedBankSize))
+			{
+				value = m_romBytes[address - kRomFixedBankBase];
+				return true;
+			}
+			else if (IsAddressInRange(address, kRomSwitchedBankBase, kRomSwitchedBankSize))
+			{
+				value = m_romBytes[m_romBankIndex * kRomSwitchedBankSize + (address - kRomSwitchedBankBase)];
+				return true;
+			}
+		}
+		else
+		{
+			if (IsAddressInRange(address, kRomBankNumberBase, kRomBankNumberSize))
+			{
+				// Bank 0 can't be switched in, as on MBC1; banks past the end of the rip wrap around rather than reading garbage
+				int bank = value % m_numRomBanks;
+				m_romBankIndex = (bank != 0) ? bank : 1;
+				return true;
+			}
+			else if (IsAddressInRange(address, kRomFixedBankBase, kRomFixedBankSize + kRomSwitchedBankSize))
+			{
+				// No other mapper registers; the music code may still poke at them
+				return true;
+			}
+		}
+
+		return ServiceMemoryRangeRequest(requestType, address, value, kRamBankBase, kRamBankSize, m_externalRam);
+	}
+
+	virtual const Uint8* GetReadPointer(Uint16 address, Uint16 size)
+	{
+		if (IsAddressInRange(address, kRomFixedBankBase, kRomFixedBankSize))
+		{
+			if (address - kRomFixedBankBase + size <= kRomFixedBankSize)
+			{
+				return m_romBytes.data() + (address - kRomFixedBankBase);
+			}
+			return nullptr;
+		}
+		else if (IsAddressInRange(address, kRomSwitchedBankBase, kRomSwitchedBankSize))
+		{
+			if (address - kRomSwitchedBankBase + size <= kRomSwitchedBankSize)
+			{
+				return m_romBytes.data() + m_romBankIndex * kRomSwitchedBankSize + (address - kRomSwitchedBankBase);
+			}
+			return nullptr;
+		}
+		return GetMemoryRangeReadPointer(address, size, kRamBankBase, kRamBankSize, m_externalRam);
+	}
+
+private:
+	std::vector<Uint8> m_romBytes;
+	int m_numRomBanks;
+	int m_romBankIndex;
+	Uint8 m_externalRam[kRamBankSize];
+};
@@ -0,0 +1,327 @@
+#pragma once
+
+#include "MemoryBus.h"
+#include "Cpu.h"
+#include "Timer.h"
+#include "Sound.h"
+#include "Memory.h"
+#include "UnknownMemoryMappedRegisters.h"
+
+#include "GbsMapper.h"
+
+#include <string>
+#include <vector>
+
+// Plays GBS (Game Boy Sound System) rips: the sound driver and music data lifted out of a game, with an init routine that starts a
+// song and a play routine the game called once per frame or timer interrupt.  The machine is just the CPU, work RAM and HRAM, the
+// timer and the APU; there is no LCD or joypad.  Between play calls the CPU has nothing to do, so that time is skipped in one step,
+// which is what lets Render run far faster than real time.
+class GbsPlayer
+{
+public:
+	// Cycles per frame, the rate play is called at unless the rip uses the timer
+	static const Sint32 kVBlankPeriodCycles = 70224;
+
+	GbsPlayer(const char* pFileName)
+	{
+		std::vector<Uint8> file;
+		LoadFileAsByteArray(file, pFileName);
+		if ((file.size() <= kHeaderSize) || (memcmp(file.data(), "GBS", 3) != 0))
+		{
+			throw Exception("%s is not a GBS file", pFileName);
+		}
+
+		m_numSongs = file[kNumSongsOffset];
+		m_firstSong = SDL_max(file[kFirstSongOffset], 1);
+		m_loadAddress = Make16(file[kLoadAddressOffset + 1], file[kLoadAddressOffset]);
+		m_initAddress = Make16(file[kInitAddressOffset + 1], file[kInitAddressOffset]);
+		m_playAddress = Make16(file[kPlayAddressOffset + 1], file[kPlayAddressOffset]);
+		m_stackPointer = Make16(file[kStackPointerOffset + 1], file[kStackPointerOffset]);
+		m_timerModulo = file[kTimerModuloOffset];
+		m_timerControl = file[kTimerControlOffset];
+		m_title = ReadHeaderString(file, kTitleOffset);
+		m_author = ReadHeaderString(file, kAuthorOffset);
+		m_copyright = ReadHeaderString(file, kCopyrightOffset);
+
+		if ((m_loadAddress < kVectorsSize) || (m_loadAddress >= GbsMapper::kRomSwitchedBankBase + GbsMapper::kRomSwitchedBankSize))
+		{
+			throw Exception("Unsupported GBS load address: 0x%04lX", m_loadAddress);
+		}
+
+		m_pMemoryBus.reset(new MemoryBus());
+		m_pMemory.reset(new Memory());
+		m_pMapper.reset(new GbsMapper(BuildRomImage(file)));
+		m_pCpu.reset(new Cpu(m_pMemoryBus));
+		m_pTimer.reset(new Timer(m_pMemoryBus, m_pCpu));
+		m_pSound.reset(new Sound());
+		m_pUnknownMemoryMappedRegisters.reset(new UnknownMemoryMappedRegisters());
+
+		m_pMemoryBus->AddDevice(m_pMemory);
+		m_pMemoryBus->AddDevice(m_pMapper);
+		m_pMemoryBus->AddDevice(m_pCpu);
+		m_pMemoryBus->AddDevice(m_pTimer);
+		m_pMemoryBus->AddDevice(m_pSound);
+		m_pMemoryBus->AddDevice(m_pUnknownMemoryMappedRegisters);
+		m_pMemoryBus->LockDevices();
+
+		StartSong(m_firstSong - 1);
+	}
+
+	int GetNumSongs() const
+	{
+		return m_numSongs;
+	}
+
+	// 0-based, unlike the header's first song field
+	int GetFirstSong() const
+	{
+		return m_firstSong - 1;
+	}
+
+	int GetCurrentSong() const
+	{
+		return m_currentSong;
+	}
+
+	const std::string& GetTitle() const
+	{
+		return m_title;
+	}
+
+	const std::string& GetAuthor() const
+	{
+		return m_author;
+	}
+
+	const std::string& GetCopyright() const
+	{
+		return m_copyright;
+	}
+
+	// An AudioDeviceSink to listen, or a WavFileAudioSink/MemoryAudioSink to render; nothing is output until one is set
+	void SetAudioSink(std::shared_ptr<IAudioSink> pSink)
+	{
+		m_pSound->SetAudioSink(pSink);
+	}
+
+	Sound& GetSound()
+	{
+		return *m_pSound;
+	}
+
+	// Resets the machine and runs the init routine for the song, 0-based
+	void StartSong(int songIndex)
+	{
+		m_currentSong = songIndex;
+		m_cyclesRemaining = 0.0f;
+
+		m_pMemoryBus->Reset();
+		m_pMemory->Reset();
+		m_pCpu->Reset();
+		m_pTimer->Reset();
+		m_pSound->Reset();
+		m_pMapper->Reset();
+
+		// Rips are made against players that clear RAM, and that leave the APU the way a game would have it before starting the
+		// music: on, at full volume, every channel to both sides
+		for (Uint32 address = Memory::kWorkMemoryBase; address < Memory::kWorkMemoryBase + Memory::kWorkMemorySize; ++address)
+		{
+			m_pMemoryBus->Write8(static_cast<Uint16>(address), 0);
+		}
+		for (Uint32 address = Memory::kHramMemoryBase; address < Memory::kHramMemoryBase + Memory::kHramMemorySize; ++address)
+		{
+			m_pMemoryBus->Write8(static_cast<Uint16>(address), 0);
+		}
+		m_pMemoryBus->Write8(static_cast<Uint16>(Sound::Registers::NR52), 0x80);
+		m_pMemoryBus->Write8(static_cast<Uint16>(Sound::Registers::NR51), 0xFF);
+		m_pMemoryBus->Write8(static_cast<Uint16>(Sound::Registers::NR50), 0x77);
+
+		m_pTimer->TMA = m_timerModulo;
+		m_pTimer->TAC = m_timerControl;
+
+		m_pCpu->SetA(static_cast<Uint8>(songIndex));
+		CallRoutine(m_initAddress);
+		m_cyclesUntilPlay = GetPlayPeriodCycles();
+	}
+
+	// Real-time playback: emulates the given time and hands the samples to the sink
+	void Update(float seconds)
+	{
+		m_cyclesRemaining += seconds * MemoryBus::kCyclesPerSecond;
+		while (m_cyclesRemaining > 0)
+		{
+			m_cyclesRemaining -= RunToNextEvent(static_cast<Sint32>(ceil(m_cyclesRemaining)));
+		}
+
+		m_pSound->EndTimeSlice();
+	}
+
+	// Offline rendering: emulates the given time as fast as possible, in large slices since nothing is waiting on them
+	void Render(float seconds)
+	{
+		const float kRenderSliceSeconds = 0.25f;
+		while (seconds > 0.0f)
+		{
+			float sliceSeconds = SDL_min(seconds, kRenderSliceSeconds);
+			Update(sliceSeconds);
+			seconds -= sliceSeconds;
+		}
+		m_pSound->WaitForSynthesisThread();
+	}
+
+private:
+	static const size_t kHeaderSize = 0x70;
+	static const int kNumSongsOffset = 0x04;
+	static const int kFirstSongOffset = 0x05;
+	static const int kLoadAddressOffset = 0x06;
+	static const int kInitAddressOffset = 0x08;
+	static const int kPlayAddressOffset = 0x0A;
+	static const int kStackPointerOffset = 0x0C;
+	static const int kTimerModuloOffset = 0x0E;
+	static const int kTimerControlOffset = 0x0F;
+	static const int kTitleOffset = 0x10;
+	static const int kAuthorOffset = 0x30;
+	static const int kCopyrightOffset = 0x50;
+	static const int kHeaderStringLength = 0x20;
+
+	// RST and interrupt vectors, which the player provides ahead of the rip's code
+	static const int kVectorsSize = 0x68;
+
+	// The init and play routines return here.  Nothing is ever executed at this address: when PC reaches it the routine is done, and
+	// the CPU sits idle until the next play call.
+	static const Uint16 kIdleAddress = Memory::kUnusableMemoryBase;
+
+	static std::string ReadHeaderString(const std::vector<Uint8>& file, int offset)
+	{
+		std::string result;
+		for (int i = 0; (i < kHeaderStringLength) && file[offset + i]; ++i)
+		{
+			result += file[offset + i];
+		}
+		return result;
+	}
+
+	std::vector<Uint8> BuildRomImage(const std::vector<Uint8>& file) const
+	{
+		size_t dataSize = file.size() - kHeaderSize;
+		size_t imageSize = SDL_max(m_loadAddress + dataSize, static_cast<size_t>(2 * GbsMapper::kRomSwitchedBankSize));
+		imageSize = (imageSize + GbsMapper::kRomSwitchedBankSize - 1) / GbsMapper::kRomSwitchedBankSize * GbsMapper::kRomSwitchedBankSize;
+
+		std::vector<Uint8> image(imageSize, 0xFF);
+
+		// The rip's RST vectors are relocated to the load address; jump there from the real ones
+		for (int vector = 0x00; vector <= 0x38; vector += 0x08)
+		{
+			Uint16 target = static_cast<Uint16>(m_loadAddress + vector);
+			image[vector] = 0xC3; // JP nn
+			image[vector + 1] = GetLow8(target);
+			image[vector + 2] = GetHigh8(target);
+		}
+
+		// Play calls are made directly rather than from an interrupt handler, so any interrupt the music code enables just returns
+		for (int vector = 0x40; vector <= 0x60; vector += 0x08)
+		{
+			image[vector] = 0xD9; // RETI
+		}
+
+		memcpy(&image[m_loadAddress], &file[kHeaderSize], dataSize);
+		return image;
+	}
+
+	// With bit 2 of the rip's TAC set, play runs off the timer interrupt, at the rate the music code currently has it programmed to
+	Sint32 GetPlayPeriodCycles() const
+	{
+		if (!(m_timerControl & Bit2))
+		{
+			return kVBlankPeriodCycles;
+		}
+
+		Sint32 cyclesPerTick = 0;
+		switch (m_pTimer->TAC & 0x3)
+		{
+		case 0: cyclesPerTick = MemoryBus::kCyclesPerSecond / 4096; break;
+		case 1: cyclesPerTick = MemoryBus::kCyclesPerSecond / 262144; break;
+		case 2: cyclesPerTick = MemoryBus::kCyclesPerSecond / 65536; break;
+		case 3: cyclesPerTick = MemoryBus::kCyclesPerSecond / 16384; break;
+		}
+
+		Sint32 period = cyclesPerTick * (256 - m_pTimer->TMA);
+		if (m_pTimer->TAC & Bit7)
+		{
+			// Rips from CGB games flag double speed mode here
+			period /= 2;
+		}
+		return period;
+	}
+
+	bool IsIdle() const
+	{
+		return m_pCpu->GetPC() == kIdleAddress;
+	}
+
+	void CallRoutine(Uint16 address)
+	{
+		m_pCpu->SetSP(m_stackPointer);
+		m_pCpu->SetPC(kIdleAddress);
+		m_pCpu->CallSubroutine(address);
+	}
+
+	// Executes one instruction, or skips ahead to the next play call (at most maxCycles) when there's nothing to execute; returns the
+	// number of cycles run
+	Sint32 RunToNextEvent(Sint32 maxCycles)
+	{
+		if (IsIdle() && (m_cyclesUntilPlay <= 0))
+		{
+			CallRoutine(m_playAddress);
+			m_cyclesUntilPlay += GetPlayPeriodCycles();
+		}
+
+		Sint32 cycles = 0;
+		if (IsIdle())
+		{
+			cycles = SDL_max(1, SDL_min(maxCycles, m_cyclesUntilPlay));
+		}
+		else
+		{
+			cycles = m_pCpu->ExecuteSingleInstruction();
+		}
+
+		m_cyclesUntilPlay -= cycles;
+		while (m_cyclesUntilPlay <= -GetPlayPeriodCycles())
+		{
+			// The previous call overran a whole period; drop the missed calls rather than running them back to back
+			m_cyclesUntilPlay += GetPlayPeriodCycles();
+		}
+
+		// Exact, since kCyclesPerSecond is a power of two
+		float seconds = static_cast<float>(cycles) / MemoryBus::kCyclesPerSecond;
+		m_pTimer->Update(seconds);
+		m_pSound->Update(seconds);
+
+		return cycles;
+	}
+
+	int m_numSongs;
+	int m_firstSong; // 1-based, as in the header
+	Uint16 m_loadAddress;
+	Uint16 m_initAddress;
+	Uint16 m_playAddress;
+	Uint16 m_stackPointer;
+	Uint8 m_timerModulo;
+	Uint8 m_timerControl;
+	std::string m_title;
+	std::string m_author;
+	std::string m_copyright;
+
+	std::shared_ptr<MemoryBus> m_pMemoryBus;
+	std::shared_ptr<Memory> m_pMemory;
+	std::shared_ptr<GbsMapper> m_pMapper;
+	std::shared_ptr<Cpu> m_pCpu;
+	std::shared_ptr<Timer> m_pTimer;
+	std::shared_ptr<Sound> m_pSound;
+	std::shared_ptr<UnknownMemoryMappedRegisters> m_pUnknownMemoryMappedRegisters;
+
+	int m_currentSong;
+	float m_cyclesRemaining;
+	Sint32 m_cyclesUntilPlay;
+};
@@ -3,6 +3,7 @@
 #include "SDL.h"
 
 #include "Utils.h"
+#include "StateSerializer.h"
 
 enum class MemoryRequestType
 {
@@ -14,7 +15,24 @@ class IMemoryBusDevice
 {
 public:
 	virtual bool HandleRequest(MemoryRequestType requestType, Uint16 address, Uint8& value) = 0;
+
+	// Returns a host pointer to 'size' contiguous readable bytes starting at 'address', or nullptr when the range isn't backed by plain memory.
+	// Used for bulk transfers (OAM DMA), which fall back to byte-wise reads when this fails.
+	virtual const Uint8* GetReadPointer(Uint16 address, Uint16 size)
+	{
+		return nullptr;
+	}
+
 protected:
+	const Uint8* GetMemoryRangeReadPointer(Uint16 address, Uint16 size, Uint16 rangeBase, Uint16 rangeSize, const Uint8* pRangeMemory)
+	{
+		if (IsAddressInRange(address, rangeBase, rangeSize) && (address - rangeBase + size <= rangeSize))
+		{
+			return pRangeMemory + (address - rangeBase);
+		}
+		return nullptr;
+	}
+
 	bool ServiceMemoryRangeRequest(MemoryRequestType requestType, Uint16 address, Uint8& value, Uint16 rangeBase, Uint16 rangeSize, Uint8* pRangeMemory)
 	{
 		if (IsAddressInRange(address, rangeBase, rangeSize))
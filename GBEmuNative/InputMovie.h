@@ -0,0 +1,162 @@
+#pragma once
+
+#include "Joypad.h"
+#include "Utils.h"
+
+#include "SDL.h"
+
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+// Input movies, and the line-based text files the headless tools read them and their job lists from.  A movie is lines like
+// "120 A+Start": from frame 120 on, hold A and Start (and nothing else), until the next line.  Buttons are Right, Left, Up, Down,
+// A, B, Select and Start; "-" is none.  Fields are separated by spaces, paths with spaces go in double quotes, and # starts a
+// comment.
+
+// From this frame on, hold these buttons
+struct MovieEvent
+{
+	int frame;
+	Uint8 buttons;
+};
+
+// Splits a line on spaces and tabs, keeping double-quoted tokens together; stops at #
+inline std::vector<std::string> Tokenize(const std::string& line)
+{
+	std::vector<std::string> tokens;
+	size_t position = 0;
+	while (position < line.size())
+	{
+		char c = line[position];
+		if ((c == ' ') || (c == '\t') || (c == '\r') || (c == '\n'))
+		{
+			++position;
+		}
+		else if (c == '#')
+		{
+			break;
+		}
+		else if (c == '"')
+		{
+			size_t end = line.find('"', position + 1);
+			if (end == std::string::npos)
+			{
+				throw Exception("Unterminated quote in: %s", line.c_str());
+			}
+			tokens.push_back(line.substr(position + 1, end - position - 1));
+			position = end + 1;
+		}
+		else
+		{
+			size_t end = line.find_first_of(" \t\r\n#", position);
+			if (end == std::string::npos)
+			{
+				end = line.size();
+			}
+			tokens.push_back(line.substr(position, end - position));
+			position = end;
+		}
+	}
+	return tokens;
+}
+
+inline std::vector<std::string> ReadLines(const char* pFileName)
+{
+	std::vector<Uint8> bytes;
+	LoadFileAsByteArray(bytes, pFileName);
+
+	std::vector<std::string> lines;
+	std::string line;
+	for (size_t i = 0; i < bytes.size(); ++i)
+	{
+		if (bytes[i] == '\n')
+		{
+			lines.push_back(line);
+			line.clear();
+		}
+		else
+		{
+			line += static_cast<char>(bytes[i]);
+		}
+	}
+	if (!line.empty())
+	{
+		lines.push_back(line);
+	}
+	return lines;
+}
+
+inline Uint8 ParseButtons(const std::string& text)
+{
+	static const struct { const char* pName; Uint8 button; } kButtonNames[] =
+	{
+		{ "Right", JoypadButton::Right },
+		{ "Left", JoypadButton::Left },
+		{ "Up", JoypadButton::Up },
+		{ "Down", JoypadButton::Down },
+		{ "A", JoypadButton::A },
+		{ "B", JoypadButton::B },
+		{ "Select", JoypadButton::Select },
+		{ "Start", JoypadButton::Start },
+	};
+
+	if (text == "-")
+	{
+		return 0;
+	}
+
+	Uint8 buttons = 0;
+	size_t position = 0;
+	while (position <= text.size())
+	{
+		size_t end = text.find('+', position);
+		if (end == std::string::npos)
+		{
+			end = text.size();
+		}
+		std::string name = text.substr(position, end - position);
+
+		bool found = false;
+		for (int i = 0; i < ARRAY_SIZE(kButtonNames); ++i)
+		{
+			if (name == kButtonNames[i].pName)
+			{
+				buttons |= kButtonNames[i].button;
+				found = true;
+			}
+		}
+		if (!found)
+		{
+			throw Exception("Unknown button: %s", name.c_str());
+		}
+		position = end + 1;
+	}
+	return buttons;
+}
+
+inline std::vector<MovieEvent> LoadInputMovie(const char* pFileName)
+{
+	std::vector<MovieEvent> events;
+	std::vector<std::string> lines = ReadLines(pFileName);
+	for (size_t i = 0; i < lines.size(); ++i)
+	{
+		std::vector<std::string> tokens = Tokenize(lines[i]);
+		if (tokens.empty())
+		{
+			continue;
+		}
+		if (tokens.size() != 2)
+		{
+			throw Exception("%s line %d: expected a frame number and buttons", pFileName, static_cast<int>(i + 1));
+		}
+
+		MovieEvent event = { atoi(tokens[0].c_str()), ParseButtons(tokens[1]) };
+		if (!events.empty() && (event.frame < events.back().frame))
+		{
+			throw Exception("%s line %d: frames must be in order", pFileName, static_cast<int>(i + 1));
+		}
+		events.push_back(event);
+	}
+	return events;
+}
@@ -5,56 +5,50 @@
 
 #include <memory>
 
+// Bits for Joypad::SetButtons
+namespace JoypadButton
+{
+	enum Type
+	{
+		Right = Bit0,
+		Left = Bit1,
+		Up = Bit2,
+		Down = Bit3,
+		A = Bit4,
+		B = Bit5,
+		Select = Bit6,
+		Start = Bit7,
+	};
+}
+
 class Joypad : public IMemoryBusDevice
 {
 public:
-	enum class Registers
+	struct Registers
 	{
-		P1_JOYP = 0xFF00, // Joypad
+		enum Type
+		{
+			P1_JOYP = 0xFF00, // Joypad
+		};
 	};
 
 	Joypad(const std::shared_ptr<MemoryBus>& memory, const std::shared_ptr<Cpu>& cpu)
-		: m_pMemory(memory)
+		: m_buttons(0)
+		, m_pMemory(memory)
 		, m_pCpu(cpu)
 	{
 		Reset();
+	}
 
-		auto numJoysticks = SDL_NumJoysticks();
-
-		// Search for the specific knockoff  USB NES pad I own, because it's awesome
-		for (int i = 0; i < SDL_NumJoysticks(); ++i)
-		{
-			std::shared_ptr<SDL_Joystick> pJoystick(SDL_JoystickOpen(i), SDL_JoystickClose);
-			std::string joystickName = SDL_JoystickName(pJoystick.get());
-			if (joystickName == "USB Gamepad ") // note the space
-			{
-				m_pJoystick = pJoystick;
-			}
-		}
+	// The host's input, a combination of JoypadButton values for the buttons held down; the game sees it from the next poll on
+	void SetButtons(Uint8 buttons)
+	{
+		m_buttons = buttons;
+	}
 
-		//for (;;)
-		//{
-		//	SDL_JoystickUpdate();
-
-		//	for (int i = 0; i < SDL_JoystickNumAxes(m_pJoystick.get()); ++i)
-		//	{
-		//		auto value = SDL_JoystickGetAxis(m_pJoystick.get(), i);
-		//		printf("axis %d: %d\n", i, value);
-		//	}
-
-		//	for (int i = 0; i < SDL_JoystickNumHats(m_pJoystick.get()); ++i)
-		//	{
-		//		auto value = SDL_JoystickGetHat(m_pJoystick.get(), i);
-		//		printf("hat %d: %d\n", i, value);
-		//	}
-
-		//	for (int i = 0; i < SDL_JoystickNumButtons(m_pJoystick.get()); ++i)
-		//	{
-		//		auto value = SDL_JoystickGetButton(m_pJoystick.get(), i);
-		//		printf("button %d: %d\n", i, value);
-		//	}
-		//	Sleep(100);
-		//}
+	Uint8 GetButtons() const
+	{
+		return m_buttons;
 	}
 
 	void Reset()
@@ -64,6 +58,14 @@ public:
 		m_lastP1_JOYP = 0xFF;
 	}
 
+	// The buttons are the host's input, not machine state, and are left as they are
+	void SerializeState(StateSerializer& state)
+	{
+		state.Value(m_updateTimeLeft);
+		state.Value(P1_JOYP);
+		state.Value(m_lastP1_JOYP);
+	}
+
 	void Update(float seconds)
 	{
 		m_updateTimeLeft += seconds;
@@ -83,80 +85,24 @@ public:
 			}
 			forceUpdate = false;
 
-			//SDL_JoystickUpdate();
-
-			const auto pKeyState = SDL_GetKeyboardState(nullptr);
-
 			Uint8 oldValues = P1_JOYP & 0x0F;
 			
 			if ((P1_JOYP & Bit5) == 0)
 			{
 				// Buttons
-				SetBitValue(P1_JOYP, 0, pKeyState[SDL_SCANCODE_P] == 0); // A: P
-				SetBitValue(P1_JOYP, 1, pKeyState[SDL_SCANCODE_O] == 0); // B: O
-				SetBitValue(P1_JOYP, 2, pKeyState[SDL_SCANCODE_Q] == 0); // Select: Q
-				SetBitValue(P1_JOYP, 3, pKeyState[SDL_SCANCODE_W] == 0); // Start: W
-
-				if (m_pJoystick)
-				{
-					// A
-					if (SDL_JoystickGetButton(m_pJoystick.get(), 1))
-					{
-						P1_JOYP &= ~Bit0;
-					}
-
-					// B
-					if (SDL_JoystickGetButton(m_pJoystick.get(), 2))
-					{
-						P1_JOYP &= ~Bit1;
-					}
-
-					// Select
-					if (SDL_JoystickGetButton(m_pJoystick.get(), 8))
-					{
-						P1_JOYP &= ~Bit2;
-					}
-
-					// Start
-					if (SDL_JoystickGetButton(m_pJoystick.get(), 9))
-					{
-						P1_JOYP &= ~Bit3;
-					}
-				}
+				SetBitValue(P1_JOYP, 0, (m_buttons & JoypadButton::A) == 0);
+				SetBitValue(P1_JOYP, 1, (m_buttons & JoypadButton::B) == 0);
+				SetBitValue(P1_JOYP, 2, (m_buttons & JoypadButton::Select) == 0);
+				SetBitValue(P1_JOYP, 3, (m_buttons & JoypadButton::Start) == 0);
 			}
 			
 			if ((P1_JOYP & Bit4) == 0)
 			{
 				// D-pad
-				SetBitValue(P1_JOYP, 0, pKeyState[SDL_SCANCODE_RIGHT] == 0);
-				SetBitValue(P1_JOYP, 1, pKeyState[SDL_SCANCODE_LEFT] == 0);
-				SetBitValue(P1_JOYP, 2, pKeyState[SDL_SCANCODE_UP] == 0);
-				SetBitValue(P1_JOYP, 3, pKeyState[SDL_SCANCODE_DOWN] == 0);
-				
-				if (m_pJoystick)
-				{
-					// Right/left
-					auto axis0 = SDL_JoystickGetAxis(m_pJoystick.get(), 0);
-					if (axis0 > 16384)
-					{
-						P1_JOYP &= ~Bit0;
-					}
-					else if (axis0 < -16384)
-					{
-						P1_JOYP &= ~Bit1;
-					}
-
-					// Up/down
-					auto axis4 = SDL_JoystickGetAxis(m_pJoystick.get(), 4);
-					if (axis4 < -16384)
-					{
-						P1_JOYP &= ~Bit2;
-					}
-					else if (axis4 > 16384)
-					{
-						P1_JOYP &= ~Bit3;
-					}
-				}
+				SetBitValue(P1_JOYP, 0, (m_buttons & JoypadButton::Right) == 0);
+				SetBitValue(P1_JOYP, 1, (m_buttons & JoypadButton::Left) == 0);
+				SetBitValue(P1_JOYP, 2, (m_buttons & JoypadButton::Up) == 0);
+				SetBitValue(P1_JOYP, 3, (m_buttons & JoypadButton::Down) == 0);
 			}
 
 			Uint8 newValues = P1_JOYP & 0x0F;
@@ -195,7 +141,7 @@ public:
 private:
 	float m_updateTimeLeft;
 	Uint8 m_lastP1_JOYP;
-	std::shared_ptr<SDL_Joystick> m_pJoystick;
+	Uint8 m_buttons;
 
 	std::shared_ptr<MemoryBus> m_pMemory;
 	std::shared_ptr<Cpu> m_pCpu;
@@ -0,0 +1,6 @@
+#include "Lcd.h"
+
+const float Lcd::kReadingOamSeconds = 0.000019f;
+const float Lcd::kReadingOamAndVramSeconds = 0.000041f;
+const float Lcd::kHBlankSeconds = 0.0000486f;
+const float Lcd::kOamDmaSeconds = 640.0f / MemoryBus::kCyclesPerSecond;
\ No newline at end of file
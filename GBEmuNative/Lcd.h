@@ -1,26 +1,38 @@
 #pragma once
 
 #include "IMemoryBusDevice.h"
+#include "MemoryBus.h"
+#include "Cpu.h"
+#include "FrameOutput.h"
 
 #include "Utils.h"
 
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <string.h>
+
 class Lcd : public IMemoryBusDevice
 {
 public:
-	enum class Registers
-	{
-		LCDC = 0xFF40,	// LCD Control
-		STAT = 0xFF41,	// LCDC Status
-		SCY = 0xFF42,	// Scroll Y
-		SCX = 0xFF43,	// Scroll X
-		LY = 0xFF44,	// LCDC Y-coordinate
-		LYC = 0xFF45,	// LY compare
-		DMA = 0xFF46,	// DMA Transfer and start address
-		BGP = 0xFF47,	// BG palette data
-		OBP0 = 0xFF48,	// Object palette 0 data
-		OBP1 = 0xFF49,	// Object palette 1 data
-		WY = 0xFF4A,	// Window Y position
-		WX = 0xFF4B,	// Window X position minus 7
+	struct Registers
+	{
+		enum Type
+		{
+			LCDC = 0xFF40,	// LCD Control
+			STAT = 0xFF41,	// LCDC Status
+			SCY = 0xFF42,	// Scroll Y
+			SCX = 0xFF43,	// Scroll X
+			LY = 0xFF44,	// LCDC Y-coordinate
+			LYC = 0xFF45,	// LY compare
+			DMA = 0xFF46,	// DMA Transfer and start address
+			BGP = 0xFF47,	// BG palette data
+			OBP0 = 0xFF48,	// Object palette 0 data
+			OBP1 = 0xFF49,	// Object palette 1 data
+			WY = 0xFF4A,	// Window Y position
+			WX = 0xFF4B,	// Window X position minus 7
+		};
 	};
 
 	enum class State
@@ -31,26 +43,70 @@ public:
 		ReadingOamAndVram,
 	};
 
+	enum class FrameSkipMode
+	{
+		Disabled,	// Every frame is rendered
+		Fixed,		// Skip N out of every M frames
+		Adaptive,	// Skip up to N out of every M frames, but only while the emulator is running behind real time
+	};
+
 	static const int kScreenWidth = 160;
 	static const int kScreenHeight = 144;
 
+	// 154 lines of 456 clocks, whether the LCD is on or not
+	static const Uint32 kCyclesPerFrame = 70224;
+
 	static const int kVramBase = 0x8000;
 	static const int kVramSize = 0x2000;
 
 	static const int kOamBase = 0xFE00;
 	static const int kOamSize = 0xFE9F - kOamBase + 1;
 
-	Lcd(const std::shared_ptr<MemoryBus>& memory, const std::shared_ptr<Cpu>& cpu, const std::shared_ptr<SDL_Texture>& pFrameBuffer)
-		: m_pMemory(memory)
+	// Documentation on the exact timing here quotes various numbers.
+	static const float kReadingOamSeconds;
+	static const float kReadingOamAndVramSeconds;
+	static const float kHBlankSeconds;
+
+	// OAM DMA takes 160 machine cycles (4 clocks each), during which the CPU can only access HRAM
+	static const float kOamDmaSeconds;
+
+	// Mode 2 (OAM search) is 80 dots; kReadingOamSeconds is the same length, rounded to a float
+	static const int kReadingOamDots = 80;
+
+	// Pixel transfer spends a few dots fetching before the first pixel comes out; the remaining dots output one pixel each
+	static const int kPixelTransferWarmupDots = 12;
+
+	Lcd(const std::shared_ptr<MemoryBus>& memory, const std::shared_ptr<Cpu>& cpu)
+		: m_frameSkipMode(FrameSkipMode::Disabled)
+		, m_framesToSkip(0)
+		, m_frameSkipPeriod(1)
+		, m_isRunningBehind(false)
+		, m_vramVersion(0)
+		, m_oamVersion(0)
+		, m_frameOutputFormat(FrameOutputFormat::None)
+		, m_framePalette(FramePalette::GetDefault())
+		, m_frameOutputCount(0)
+		, m_frameCaptureIndex(0)
+		, m_pRenderJob(nullptr)
+		, m_renderJobPending(false)
+		, m_renderThreadFrameReady(false)
+		, m_renderThreadQuit(false)
+		, m_pMemory(memory)
 		, m_pMemoryUnsafe(memory.get())
 		, m_pCpu(cpu)
-		, m_pFrameBuffer(pFrameBuffer)
 	{
-		//@TODO SDL_QueryTexture
-		//SDL_assert()
+		m_lineRegisterWrites.reserve(64);
+		m_frameCaptures[0].Clear();
+		m_frameCaptures[1].Clear();
+
 		Reset();
 	}
 
+	~Lcd()
+	{
+		SetRenderThreadEnabled(false);
+	}
+
 	void Reset()
 	{
 		m_updateTimeLeft = 0.0f;
@@ -59,10 +115,21 @@ public:
 		m_wasLcdEnabledLastUpdate = true;
 		m_lastMode = 0;
 
+		m_frameSkipCounter = 0;
+		m_renderCurrentFrame = true;
+		m_renderNextFrameRequested = false;
+
+		m_lineRegisterWrites.clear();
+
+		m_oamDmaTimeLeft = 0.0f;
+		m_pMemoryUnsafe->SetOamDmaActive(false);
+
 		RenderDisabledFrameBuffer();
 
 		memset(m_vram, 0xFD, sizeof(m_vram));
 		memset(m_oam, 0xFD, sizeof(m_oam));
+		++m_vramVersion;
+		++m_oamVersion;
 
 		LCDC = 0x91;
 		STAT = 0;
@@ -76,11 +143,72 @@ public:
 		OBP1 = 0xFF;
 		WY = 0;
 		WX = 0;
+
+		m_lineRegisters = CaptureScanlineRegisters();
+	}
+
+	// Includes the lines of the frame being rasterized that are already drawn, so a frame finished after a load matches the one
+	// the saved machine would have finished.  Finished frames (GetFrameOutput) aren't included; see RestoreFrameOutput.
+	void SerializeState(StateSerializer& state)
+	{
+		state.Value(m_updateTimeLeft);
+		state.Value(m_nextState);
+		state.Value(m_scanLine);
+		state.Value(m_wasLcdEnabledLastUpdate);
+		state.Value(m_lastMode);
+		state.Value(m_frameSkipCounter);
+		state.Value(m_renderCurrentFrame);
+		state.Value(m_renderNextFrameRequested);
+
+		state.Value(m_vram);
+		state.Value(m_oam);
+		state.Value(m_oamDmaTimeLeft);
+
+		// The lines of this frame already drawn; the rest are drawn after a load
+		Uint32 numDrawnLines = (m_scanLine < kScreenHeight) ? static_cast<Uint32>(m_scanLine + 1) : 0;
+		state.Value(numDrawnLines);
+		if (numDrawnLines > kScreenHeight)
+		{
+			throw Exception("Save state is corrupt");
+		}
+		state.Bytes(m_frameBufferShades, numDrawnLines * kScreenWidth);
+
+		state.Value(m_lineRegisters);
+		state.Vector(m_lineRegisterWrites);
+
+		state.Value(LCDC);
+		state.Value(STAT);
+		state.Value(SCY);
+		state.Value(SCX);
+		state.Value(LY);
+		state.Value(LYC);
+		state.Value(DMA);
+		state.Value(BGP);
+		state.Value(OBP0);
+		state.Value(OBP1);
+		state.Value(WY);
+		state.Value(WX);
+
+		if (state.IsLoading())
+		{
+			// Have the render thread take fresh copies of memory
+			++m_vramVersion;
+			++m_oamVersion;
+			m_pMemoryUnsafe->SetOamDmaActive(m_oamDmaTimeLeft > 0.0f);
+		}
 	}
 
 	void Update(float seconds)
 	{
-		// Documentation on the exact timing here quotes various numbers.
+		if (m_oamDmaTimeLeft > 0.0f)
+		{
+			m_oamDmaTimeLeft -= seconds;
+			if (m_oamDmaTimeLeft <= 0.0f)
+			{
+				m_pMemoryUnsafe->SetOamDmaActive(false);
+			}
+		}
+
 		m_updateTimeLeft += seconds;
 
 		while (m_updateTimeLeft > 0.0f)
@@ -116,23 +244,36 @@ public:
 							LY = 0;
 						}
 
-						RenderScanline();
+						if (m_scanLine == 0)
+						{
+							BeginFrame();
+						}
 
-						m_updateTimeLeft -= 0.000019f;
+						if (m_scanLine == kScreenHeight)
+						{
+							EndFrame();
+						}
+
+						m_updateTimeLeft -= kReadingOamSeconds;
 						mode = 2;
 						m_nextState = State::ReadingOamAndVram;
 					}
 					break;
 				case State::ReadingOamAndVram:
 					{
-						m_updateTimeLeft -= 0.000041f;
+						BeginScanline();
+
+						m_updateTimeLeft -= kReadingOamAndVramSeconds;
 						mode = 3;
 						m_nextState = State::HBlank;
 					}
 					break;
 				case State::HBlank:
 					{
-						m_updateTimeLeft -= 0.0000486f;
+						// The line is drawn once pixel transfer is over, so writes made during the transfer can be replayed
+						RenderScanline();
+
+						m_updateTimeLeft -= kHBlankSeconds;
 						mode = 0;
 						m_nextState = State::ReadingOam;
 					}
@@ -199,48 +340,160 @@ public:
 		}
 	}
 
-	void RenderDisabledFrameBuffer()
+	// Frame skipping only affects pixel generation; timing, STAT/LY and interrupts are emulated exactly as usual.
+	// The frame skip settings and the render request take effect at the start of the next frame.
+	void SetFrameSkip(FrameSkipMode mode, int framesToSkip = 0, int frameSkipPeriod = 1)
 	{
-		void* pVoidPixels;
-		int pitch;
-		SDL_LockTexture(m_pFrameBuffer.get(), NULL, &pVoidPixels, &pitch);
+		SDL_assert(frameSkipPeriod > 0);
+		SDL_assert((framesToSkip >= 0) && (framesToSkip < frameSkipPeriod));
 
-		char* pPixels = reinterpret_cast<char*>(pVoidPixels);
+		m_frameSkipMode = mode;
+		m_framesToSkip = framesToSkip;
+		m_frameSkipPeriod = frameSkipPeriod;
+		m_frameSkipCounter = 0;
+	}
 
-		//@TODO: replace with a memset or something, but in the meantime this allows for patterns to help debugging
-		for (Sint16 x = 0; x < kScreenWidth; ++x)
+	FrameSkipMode GetFrameSkipMode() const
+	{
+		return m_frameSkipMode;
+	}
+
+	// Forces the next frame to be rendered, whatever the frame skip settings say
+	void RequestRenderNextFrame()
+	{
+		m_renderNextFrameRequested = true;
+	}
+
+	// Fed by the owner of the emulation loop; only consulted in adaptive mode
+	void SetRunningBehind(bool isRunningBehind)
+	{
+		m_isRunningBehind = isRunningBehind;
+	}
+
+	bool IsRenderingCurrentFrame() const
+	{
+		return m_renderCurrentFrame;
+	}
+
+	void BeginFrame()
+	{
+		bool skipFrame = false;
+		switch (m_frameSkipMode)
 		{
-			for (Sint16 y = 0; y < kScreenHeight; ++y)
-			{
-				Uint32* pARGB = reinterpret_cast<Uint32*>(pPixels + y * pitch + x * 4);
-				
-				Uint8 r = 0xFF;
-				Uint8 g = 0xFF; //0x00;
-				Uint8 b = 0xFF;
-				*pARGB = 0xFF000000 | (r << 16) | (g << 8) | b;
-			}
+		case FrameSkipMode::Disabled:
+			break;
+		case FrameSkipMode::Fixed:
+			skipFrame = (m_frameSkipCounter < m_framesToSkip);
+			break;
+		case FrameSkipMode::Adaptive:
+			// The period still applies, so the display keeps updating even when hopelessly behind
+			skipFrame = m_isRunningBehind && (m_frameSkipCounter < m_framesToSkip);
+			break;
 		}
-		
-		SDL_UnlockTexture(m_pFrameBuffer.get());
+		m_frameSkipCounter = (m_frameSkipCounter + 1) % m_frameSkipPeriod;
+
+		if (m_renderNextFrameRequested)
+		{
+			skipFrame = false;
+			m_renderNextFrameRequested = false;
+		}
+
+		m_renderCurrentFrame = !skipFrame;
+
+		m_frameCaptures[m_frameCaptureIndex].Clear();
 	}
 
-	Uint8 ReadVram(Uint16 address)
+	void RenderDisabledFrameBuffer()
+	{
+		// Whatever the render thread is working on is stale now
+		WaitForRenderThread();
+		m_renderThreadFrameReady = false;
+		m_frameCaptures[m_frameCaptureIndex].Clear();
+
+		// Lightest shade
+		memset(m_frameBufferShades, 0, sizeof(m_frameBufferShades));
+
+		PublishFrame(m_frameBufferShades);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Rasterization
+	///////////////////////////////////////////////////////////////////////////
+
+	// Everything the rasterizer needs to know about a scanline, besides VRAM and OAM contents.  Rasterizing from this instead of
+	// from the live registers lets a scanline be drawn later, on another thread, with exactly the same result.
+	struct ScanlineRegisters
+	{
+		Uint8 LCDC;
+		Uint8 SCY;
+		Uint8 SCX;
+		Uint8 BGP;
+		Uint8 OBP0;
+		Uint8 OBP1;
+		Uint8 WY;
+		Uint8 WX;
+		Uint8 line;
+
+		// Indices of the VRAM/OAM snapshots this line was captured with (see FrameCapture)
+		Uint8 vramSnapshot;
+		Uint8 oamSnapshot;
+	};
+
+	// A horizontal run of pixels on a scanline drawn with the same registers.  Lines without mid-line register writes are a single span.
+	struct ScanlineSpan
+	{
+		ScanlineRegisters registers;
+		Uint8 xBegin;
+		Uint8 xEnd;
+	};
+
+	// A register write made during pixel transfer, with the dot (clock cycle within the line, 0-455) at which it happened
+	struct RegisterWrite
+	{
+		Uint16 dot;
+		Uint8 address; // low byte of the register address
+		Uint8 value;
+	};
+
+	// A frame's worth of scanline spans, plus copies of VRAM and OAM.  A new copy is only taken when the memory was
+	// written to since the previous line was captured, so a typical frame (VRAM updated during vblank) holds a single copy of each.
+	struct FrameCapture
+	{
+		void Clear()
+		{
+			spans.clear();
+			numVramSnapshots = 0;
+			numOamSnapshots = 0;
+		}
+
+		std::vector<ScanlineSpan> spans;
+
+		int numVramSnapshots;
+		Uint32 vramVersion;
+		std::vector<Uint8> vramSnapshots;
+
+		int numOamSnapshots;
+		Uint32 oamVersion;
+		std::vector<Uint8> oamSnapshots;
+	};
+
+	static Uint8 ReadVram(const Uint8* pVram, Uint16 address)
 	{
 		Uint16 offset = address - kVramBase;
 		SDL_assert(offset < kVramSize);
 
-		return m_vram[offset];
+		return pVram[offset];
 	}
 
-	Uint8 ReadOam(Uint16 address)
+	static Uint8 ReadOam(const Uint8* pOam, Uint16 address)
 	{
 		Uint16 offset = address - kOamBase;
 		SDL_assert(offset < kOamSize);
 
-		return m_oam[offset];
+		return pOam[offset];
 	}
 
-	Uint8 GetTileIndexAtXY(Uint16 tileMapBaseAddress, int x, int y)
+	static Uint8 GetTileIndexAtXY(const Uint8* pVram, Uint16 tileMapBaseAddress, int x, int y)
 	{
 		// Tiles are 8x8; see which tile we're in
 		Uint8 tileMapX = x / 8;
@@ -249,12 +502,12 @@ public:
 		// Tile maps are 32x32
 		Uint16 tileOffset = tileMapY * 32 + tileMapX;
 
-		Uint8 tileIndex = ReadVram(tileMapBaseAddress + tileOffset);
+		Uint8 tileIndex = ReadVram(pVram, tileMapBaseAddress + tileOffset);
 		
 		return tileIndex;
 	}
 
-	Uint8 GetTileDataPixelColorIndex(Uint16 baseTileDataAddress, Sint16 tileIndex, int x, int y)
+	static Uint8 GetTileDataPixelColorIndex(const Uint8* pVram, Uint16 baseTileDataAddress, Sint16 tileIndex, int x, int y)
 	{
 		// Fetch the pixel's color index from the tile data
 		Uint8 tileDataX = x % 8;
@@ -265,237 +518,658 @@ public:
 		// Each tile's data occupies 16 bytes, and each row of tile data occupies two bytes
 		Uint16 tileDataAddress = baseTileDataAddress + tileIndex * 16 + tileDataY * 2;
 
-		Uint8 tileRowLsb = (ReadVram(tileDataAddress) & tileDataMask) >> tileDataShift;
-		Uint8 tileRowMsb = (ReadVram(tileDataAddress + 1) & tileDataMask) >> tileDataShift;
+		Uint8 tileRowLsb = (ReadVram(pVram, tileDataAddress) & tileDataMask) >> tileDataShift;
+		Uint8 tileRowMsb = (ReadVram(pVram, tileDataAddress + 1) & tileDataMask) >> tileDataShift;
 
 		Uint8 colorIndex = (tileRowMsb << 1) | tileRowLsb;
 
 		return colorIndex;
 	}
 
-	Uint8 GetLuminosityForColorIndex(Uint8 paletteRegister, Uint8 colorIndex)
+	static Uint8 GetShadeForColorIndex(Uint8 paletteRegister, Uint8 colorIndex)
 	{
-		// Translate the color index to an actual color using the palette registers
+		// Translate the color index to a shade using the palette registers; the frame palette turns shades into actual colors
 		Uint8 shadeShift = 2 * colorIndex;
 		Uint8 shadeMask = 0x3 << shadeShift;
 		Uint8 shade = (paletteRegister & shadeMask) >> shadeShift;
 
-		Uint8 luminosity = (3 - shade) * 0x55;
-		
-		return luminosity;
+		return shade;
 	}
 
-	void RenderScanline()
+	// Draws pixels [xBegin, xEnd) of a scanline as shades; pShades points to the start of the line
+	static void RasterizeScanline(const ScanlineRegisters& registers, const Uint8* pVram, const Uint8* pOam, Uint8* pShades, int xBegin = 0, int xEnd = kScreenWidth)
 	{
-		if (LY < kScreenHeight)
+		const Uint8 LCDC = registers.LCDC;
+		const Uint8 SCY = registers.SCY;
+		const Uint8 SCX = registers.SCX;
+		const Uint8 BGP = registers.BGP;
+		const Uint8 OBP0 = registers.OBP0;
+		const Uint8 OBP1 = registers.OBP1;
+		const Uint8 WY = registers.WY;
+		const Uint8 WX = registers.WX;
+		const int scanLine = registers.line;
+
+		pShades += xBegin;
+
+		for (int screenX = xBegin; screenX < xEnd; ++screenX)
 		{
-			void* pPixels;
-			int pitch;
-			SDL_LockTexture(m_pFrameBuffer.get(), NULL, &pPixels, &pitch);
+			Uint8 shade = 3;
 
-			Uint32* pARGB = reinterpret_cast<Uint32*>(static_cast<Uint8*>(pPixels) + LY * pitch);
+			bool backgroundIsTransparent = false;
 
-			//static Uint8 palette[] = {0xFF, 0xC0, }
-
-			static int c = 0;
-			for (int screenX = 0; screenX < kScreenWidth; ++screenX)
+			if (LCDC & Bit0)
 			{
-				Uint8 a = 0xFF;
-				Uint8 r = 0xFF;
-				Uint8 g = 0xFF;
-				Uint8 b = 0xFF;
-				Uint8 luminosity = 0;
+				// Background is active
+				Uint16 x = (SCX + screenX) % 256;
+				Uint16 y = (SCY + scanLine) % 256;
 
-				bool backgroundIsTransparent = false;
+				Uint16 tileMapBaseAddress = (LCDC & Bit3) ? 0x9C00 : 0x9800;
+				Sint16 tileIndex = GetTileIndexAtXY(pVram, tileMapBaseAddress, x, y);
 
-				if (LCDC & Bit0)
+				// Find the tile data
+				Uint16 baseTileDataAddress = 0;
+				if (LCDC & Bit4)
 				{
-					// Background is active
-					Uint16 x = (SCX + screenX) % 256;
-					Uint16 y = (SCY + m_scanLine) % 256;
-
-					Uint16 tileMapBaseAddress = (LCDC & Bit3) ? 0x9C00 : 0x9800;
-					Sint16 tileIndex = GetTileIndexAtXY(tileMapBaseAddress, x, y);
-
-					// Find the tile data
-					Uint16 baseTileDataAddress = 0;
-					if (LCDC & Bit4)
-					{
-						baseTileDataAddress = 0x8000;
-					}
-					else
+					baseTileDataAddress = 0x8000;
+				}
+				else
+				{
+					baseTileDataAddress = 0x9000; // tile data starts at 0x8800, but it's indexed using signed values so tile 0 is at 0x9000
+					if (tileIndex > 127)
 					{
-						baseTileDataAddress = 0x9000; // tile data starts at 0x8800, but it's indexed using signed values so tile 0 is at 0x9000
-						if (tileIndex > 127)
-						{
-							tileIndex -= 256;
-						}
+						tileIndex -= 256;
 					}
+				}
 
-					auto colorIndex = GetTileDataPixelColorIndex(baseTileDataAddress, tileIndex, x, y);
+				auto colorIndex = GetTileDataPixelColorIndex(pVram, baseTileDataAddress, tileIndex, x, y);
 
-					backgroundIsTransparent = (colorIndex == 0);
-					
-					luminosity = GetLuminosityForColorIndex(BGP, colorIndex);
-				}
+				backgroundIsTransparent = (colorIndex == 0);
+				
+				shade = GetShadeForColorIndex(BGP, colorIndex);
+			}
 
-				static bool enableWindow = true;
-				if (enableWindow && (LCDC & Bit5))
-				{
-					// Window is active - always displayed above background
-					Sint16 x = screenX - (WX - 7);
-					Sint16 y = m_scanLine - WY;
+			static bool enableWindow = true;
+			if (enableWindow && (LCDC & Bit5))
+			{
+				// Window is active - always displayed above background
+				Sint16 x = screenX - (WX - 7);
+				Sint16 y = scanLine - WY;
 
-					if ((x >= 0) && (x < 160) && (y >= 0) && (y < 144))
-					{
-						Uint16 tileMapBaseAddress = (LCDC & Bit6) ? 0x9C00 : 0x9800;
-						Sint8 tileIndex = GetTileIndexAtXY(tileMapBaseAddress, x, y); // Window tiles are always signed
+				if ((x >= 0) && (x < 160) && (y >= 0) && (y < 144))
+				{
+					Uint16 tileMapBaseAddress = (LCDC & Bit6) ? 0x9C00 : 0x9800;
+					Sint8 tileIndex = GetTileIndexAtXY(pVram, tileMapBaseAddress, x, y); // Window tiles are always signed
 
-						// Find the tile data
-						Uint16 baseTileDataAddress = 0x9000;
-						auto colorIndex = GetTileDataPixelColorIndex(baseTileDataAddress, tileIndex, x, y);
+					// Find the tile data
+					Uint16 baseTileDataAddress = 0x9000;
+					auto colorIndex = GetTileDataPixelColorIndex(pVram, baseTileDataAddress, tileIndex, x, y);
 
-						backgroundIsTransparent = (colorIndex == 0);
+					backgroundIsTransparent = (colorIndex == 0);
 
-						luminosity = GetLuminosityForColorIndex(BGP, colorIndex);
-					}
+					shade = GetShadeForColorIndex(BGP, colorIndex);
 				}
+			}
 
-				if (LCDC & Bit1)
-				{
-					// Sprites are active
+			if (LCDC & Bit1)
+			{
+				// Sprites are active
 
-					bool sprites8x16 = ((LCDC & Bit2) != 0);
+				bool sprites8x16 = ((LCDC & Bit2) != 0);
 
-					Sint16 bestBaseX;
-					int bestIndex = -1;
-					Uint8 bestLuminosity;
-					Uint8 bestAttributes;
+				Sint16 bestBaseX;
+				int bestIndex = -1;
+				Uint8 bestShade;
+				Uint8 bestAttributes;
 
-					// Find the best sprite hit for this pixel
-					for (int spriteIndex = 0; spriteIndex < 40; ++spriteIndex)
-					{
-						Uint16 spriteBaseAddress = 0xFE00 + spriteIndex * 4;
-						Sint16 spriteBaseX = ReadOam(spriteBaseAddress + 1) - 8;
-						Sint16 spriteBaseY = ReadOam(spriteBaseAddress + 0) - 16;
+				// Find the best sprite hit for this pixel
+				for (int spriteIndex = 0; spriteIndex < 40; ++spriteIndex)
+				{
+					Uint16 spriteBaseAddress = 0xFE00 + spriteIndex * 4;
+					Sint16 spriteBaseX = ReadOam(pOam, spriteBaseAddress + 1) - 8;
+					Sint16 spriteBaseY = ReadOam(pOam, spriteBaseAddress + 0) - 16;
 
-						Sint16 x = screenX - spriteBaseX;
-						Sint16 y = m_scanLine - spriteBaseY;
+					Sint16 x = screenX - spriteBaseX;
+					Sint16 y = scanLine - spriteBaseY;
 
-						Uint8 tileIndex = ReadOam(spriteBaseAddress + 2);
-						Uint8 attributes = ReadOam(spriteBaseAddress + 3);
+					Uint8 tileIndex = ReadOam(pOam, spriteBaseAddress + 2);
+					Uint8 attributes = ReadOam(pOam, spriteBaseAddress + 3);
 
-						bool verticalFlip = ((attributes & Bit6) != 0);
+					bool verticalFlip = ((attributes & Bit6) != 0);
 
-						if (sprites8x16)
+					if (sprites8x16)
+					{
+						if (y >= 8)
 						{
-							if (y >= 8)
+							y -= 8;
+							
+							if (!verticalFlip)
 							{
-								y -= 8;
-								
-								if (!verticalFlip)
-								{
-									tileIndex |= 1;
-								}
-								else
-								{
-									tileIndex &= ~1;
-								}
+								tileIndex |= 1;
 							}
 							else
 							{
-								if (!verticalFlip)
-								{
-									tileIndex &= ~1;
-								}
-								else
-								{
-									tileIndex |= 1;
-								}
+								tileIndex &= ~1;
 							}
 						}
-
-						// Horizontal flip
-						if (attributes & Bit5)
+						else
 						{
-							x = 7 - x;
+							if (!verticalFlip)
+							{
+								tileIndex &= ~1;
+							}
+							else
+							{
+								tileIndex |= 1;
+							}
 						}
+					}
 
-						// Vertical flip
-						if (verticalFlip)
-						{
-							y = 7 - y;
-						}
+					// Horizontal flip
+					if (attributes & Bit5)
+					{
+						x = 7 - x;
+					}
 
-						auto colorIndex = GetTileDataPixelColorIndex(0x8000, tileIndex, x, y);
-						
-						Uint8 palette = ((attributes & Bit4) != 0) ? OBP1 : OBP0;
-						auto spriteLuminosity = GetLuminosityForColorIndex(palette, colorIndex);
+					// Vertical flip
+					if (verticalFlip)
+					{
+						y = 7 - y;
+					}
 
-						if ((colorIndex != 0) && (x >= 0) && (x < 8) && (y >= 0) && (y < 8))
-						{
-							if ((bestIndex < 0) || (spriteBaseX < bestBaseX))
-							{
-								bestBaseX = spriteBaseX;
-								bestIndex = spriteIndex;
-								bestLuminosity = spriteLuminosity;
-								bestAttributes = attributes;
-							}
-						}
+					// Only fetch tile data for sprites that actually cover this pixel; other coordinates would index outside VRAM
+					if ((x < 0) || (x >= 8) || (y < 0) || (y >= 8))
+					{
+						continue;
 					}
 
-					if (bestIndex >= 0)
+					auto colorIndex = GetTileDataPixelColorIndex(pVram, 0x8000, tileIndex, x, y);
+					
+					Uint8 palette = ((attributes & Bit4) != 0) ? OBP1 : OBP0;
+					auto spriteShade = GetShadeForColorIndex(palette, colorIndex);
+
+					if (colorIndex != 0)
 					{
-						if (bestAttributes & Bit7)
+						if ((bestIndex < 0) || (spriteBaseX < bestBaseX))
 						{
-							// Sprite is behind background, it only shows if the background is transparent
-							if (backgroundIsTransparent)
-							{
-								luminosity = bestLuminosity;
-							}
+							bestBaseX = spriteBaseX;
+							bestIndex = spriteIndex;
+							bestShade = spriteShade;
+							bestAttributes = attributes;
 						}
-						else
+					}
+				}
+
+				if (bestIndex >= 0)
+				{
+					if (bestAttributes & Bit7)
+					{
+						// Sprite is behind background, it only shows if the background is transparent
+						if (backgroundIsTransparent)
 						{
-							// Sprite is in front of background, it always shows
-							luminosity = bestLuminosity;
+							shade = bestShade;
 						}
 					}
+					else
+					{
+						// Sprite is in front of background, it always shows
+						shade = bestShade;
+					}
 				}
+			}
+
+			*pShades = shade;
+
+			++pShades;
+		}
+	}
+
+	static void RasterizeFrame(const FrameCapture& capture, Uint8* pShades)
+	{
+		for (size_t i = 0; i < capture.spans.size(); ++i)
+		{
+			const auto& span = capture.spans[i];
+			const auto& registers = span.registers;
+			const Uint8* pVram = &capture.vramSnapshots[registers.vramSnapshot * kVramSize];
+			const Uint8* pOam = &capture.oamSnapshots[registers.oamSnapshot * kOamSize];
+			RasterizeScanline(registers, pVram, pOam, &pShades[registers.line * kScreenWidth], span.xBegin, span.xEnd);
+		}
+	}
+
+	ScanlineRegisters CaptureScanlineRegisters() const
+	{
+		ScanlineRegisters registers;
+		registers.LCDC = LCDC;
+		registers.SCY = SCY;
+		registers.SCX = SCX;
+		registers.BGP = BGP;
+		registers.OBP0 = OBP0;
+		registers.OBP1 = OBP1;
+		registers.WY = WY;
+		registers.WX = WX;
+		registers.line = static_cast<Uint8>(m_scanLine);
+		registers.vramSnapshot = 0;
+		registers.oamSnapshot = 0;
+		return registers;
+	}
+
+	// Position of the LCD within the current line, in dots.  Memory requests are serviced before Update accounts for the
+	// instruction that made them, so this is exact to the instruction.
+	int GetCurrentDot() const
+	{
+		float modeEndSeconds = 0.0f;
+		switch (m_nextState)
+		{
+		case State::ReadingOamAndVram: modeEndSeconds = kReadingOamSeconds; break;
+		case State::HBlank: modeEndSeconds = kReadingOamSeconds + kReadingOamAndVramSeconds; break;
+		case State::ReadingOam: modeEndSeconds = kReadingOamSeconds + kReadingOamAndVramSeconds + kHBlankSeconds; break;
+		}
+
+		// m_updateTimeLeft is minus the time left in the current mode
+		return static_cast<int>((modeEndSeconds + m_updateTimeLeft) * MemoryBus::kCyclesPerSecond);
+	}
 
-				r = luminosity;
-				g = luminosity;
-				b = luminosity;
+	static int GetScreenXForDot(int dot)
+	{
+		int x = dot - kReadingOamDots - kPixelTransferWarmupDots;
+		return SDL_max(0, SDL_min(x, static_cast<int>(kScreenWidth)));
+	}
 
-				*pARGB = 0xFF000000 | (r << 16) | (g << 8) | b;
+	bool IsTransferringPixels() const
+	{
+		return ((LCDC & Bit7) != 0) && (m_nextState == State::HBlank) && (m_scanLine < kScreenHeight);
+	}
 
-				++pARGB;
+	void LogRegisterWrite(Registers::Type reg, Uint8 value)
+	{
+		if (m_renderCurrentFrame && IsTransferringPixels())
+		{
+			RegisterWrite write;
+			write.dot = static_cast<Uint16>(GetCurrentDot());
+			write.address = static_cast<Uint8>(static_cast<int>(reg) & 0xFF);
+			write.value = value;
+			m_lineRegisterWrites.push_back(write);
+		}
+	}
+
+	static void ApplyRegisterWrite(ScanlineRegisters& registers, const RegisterWrite& write)
+	{
+		switch (0xFF00 | write.address)
+		{
+		case Registers::LCDC: registers.LCDC = write.value; break;
+		case Registers::SCY: registers.SCY = write.value; break;
+		case Registers::SCX: registers.SCX = write.value; break;
+		case Registers::BGP: registers.BGP = write.value; break;
+		case Registers::OBP0: registers.OBP0 = write.value; break;
+		case Registers::OBP1: registers.OBP1 = write.value; break;
+		case Registers::WY: registers.WY = write.value; break;
+		case Registers::WX: registers.WX = write.value; break;
+		}
+	}
+
+	// Called as pixel transfer starts: latch the registers the line starts with, and start logging writes
+	void BeginScanline()
+	{
+		m_lineRegisters = CaptureScanlineRegisters();
+		m_lineRegisterWrites.clear();
+	}
+
+	void RenderScanline()
+	{
+		if (!m_renderCurrentFrame)
+		{
+			return;
+		}
+
+		if (LY < kScreenHeight)
+		{
+			auto registers = m_lineRegisters;
+
+			if (m_renderThread.joinable())
+			{
+				CaptureMemorySnapshots(registers);
 			}
-			++c;
 
-			if (LY == 0)
+			// Replay the writes made during pixel transfer, drawing the pixels before each one with the registers in effect at the time
+			int xBegin = 0;
+			for (size_t i = 0; i < m_lineRegisterWrites.size(); ++i)
 			{
-				++c;
+				const auto& write = m_lineRegisterWrites[i];
+				int x = GetScreenXForDot(write.dot);
+				if (x > xBegin)
+				{
+					RenderSpan(registers, xBegin, x);
+					xBegin = x;
+				}
+				ApplyRegisterWrite(registers, write);
 			}
 
-			SDL_UnlockTexture(m_pFrameBuffer.get());
+			RenderSpan(registers, xBegin, kScreenWidth);
+
+			m_lineRegisterWrites.clear();
+		}
+	}
+
+	void RenderSpan(const ScanlineRegisters& registers, int xBegin, int xEnd)
+	{
+		if (xBegin >= xEnd)
+		{
+			return;
+		}
+
+		if (!m_renderThread.joinable())
+		{
+			RasterizeScanline(registers, m_vram, m_oam, &m_frameBufferShades[registers.line * kScreenWidth], xBegin, xEnd);
+			return;
+		}
+
+		// Defer the actual work to the render thread
+		ScanlineSpan span;
+		span.registers = registers;
+		span.xBegin = static_cast<Uint8>(xBegin);
+		span.xEnd = static_cast<Uint8>(xEnd);
+		m_frameCaptures[m_frameCaptureIndex].spans.push_back(span);
+	}
+
+	void CaptureMemorySnapshots(ScanlineRegisters& registers)
+	{
+		auto& capture = m_frameCaptures[m_frameCaptureIndex];
+
+		if ((capture.numVramSnapshots == 0) || (capture.vramVersion != m_vramVersion))
+		{
+			capture.vramSnapshots.resize((capture.numVramSnapshots + 1) * kVramSize);
+			memcpy(&capture.vramSnapshots[capture.numVramSnapshots * kVramSize], m_vram, kVramSize);
+			capture.vramVersion = m_vramVersion;
+			++capture.numVramSnapshots;
+		}
+
+		if ((capture.numOamSnapshots == 0) || (capture.oamVersion != m_oamVersion))
+		{
+			capture.oamSnapshots.resize((capture.numOamSnapshots + 1) * kOamSize);
+			memcpy(&capture.oamSnapshots[capture.numOamSnapshots * kOamSize], m_oam, kOamSize);
+			capture.oamVersion = m_oamVersion;
+			++capture.numOamSnapshots;
+		}
+
+		registers.vramSnapshot = static_cast<Uint8>(capture.numVramSnapshots - 1);
+		registers.oamSnapshot = static_cast<Uint8>(capture.numOamSnapshots - 1);
+	}
+
+	void EndFrame()
+	{
+		if (!m_renderCurrentFrame)
+		{
+			return;
+		}
+
+		if (!m_renderThread.joinable())
+		{
+			PublishFrame(m_frameBufferShades);
+			return;
+		}
+
+		// Collect the previous frame, then hand this one over.  The render thread never touches the capture being filled.
+		WaitForRenderThread();
+		PresentRenderThreadFrame();
+
+		{
+			std::lock_guard<std::mutex> lock(m_renderMutex);
+			m_pRenderJob = &m_frameCaptures[m_frameCaptureIndex];
+			m_renderJobPending = true;
+		}
+		m_renderJobAvailable.notify_one();
+
+		m_frameCaptureIndex = (m_frameCaptureIndex + 1) % 2;
+		m_frameCaptures[m_frameCaptureIndex].Clear();
+	}
+
+	// Converts a completed frame of shades for the frame output consumer, if any
+	void PublishFrame(const Uint8* pShades)
+	{
+		if (m_frameOutputFormat != FrameOutputFormat::None)
+		{
+			FrameOutput::Convert(m_frameOutputFormat, pShades, kScreenWidth, kScreenHeight, m_framePalette, m_frameOutput.data());
+			++m_frameOutputCount;
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Frame output
+	///////////////////////////////////////////////////////////////////////////
+
+	// Selects the format of the frames returned by GetFrameOutput; FrameOutputFormat::None skips the conversion entirely
+	void SetFrameOutputFormat(FrameOutputFormat format)
+	{
+		m_frameOutputFormat = format;
+		m_frameOutput.assign(GetFrameOutputPitch() * kScreenHeight, 0);
+	}
+
+	FrameOutputFormat GetFrameOutputFormat() const
+	{
+		return m_frameOutputFormat;
+	}
+
+	// Used for every output format except Packed2bpp
+	void SetFramePalette(const FramePalette& palette)
+	{
+		m_framePalette = palette;
+	}
+
+	const FramePalette& GetFramePalette() const
+	{
+		return m_framePalette;
+	}
+
+	// Last completed frame in the selected format, rows are tightly packed
+	const Uint8* GetFrameOutput() const
+	{
+		return m_frameOutput.empty() ? nullptr : m_frameOutput.data();
+	}
+
+	int GetFrameOutputPitch() const
+	{
+		return FrameOutput::GetBytesPerRow(m_frameOutputFormat, kScreenWidth);
+	}
+
+	size_t GetFrameOutputSize() const
+	{
+		return m_frameOutput.size();
+	}
+
+	// Incremented every time GetFrameOutput holds a new frame
+	Uint32 GetFrameOutputCount() const
+	{
+		return m_frameOutputCount;
+	}
+
+	// Puts back a frame read from GetFrameOutput earlier, when the machine goes back to the state it was in then; save states hold
+	// the partly drawn frame, but not the last finished one.  A frame the render thread was still working on is dropped.
+	void RestoreFrameOutput(const Uint8* pFrame, size_t size)
+	{
+		WaitForRenderThread();
+		{
+			std::lock_guard<std::mutex> lock(m_renderMutex);
+			m_renderThreadFrameReady = false;
+		}
+
+		if ((size > 0) && (size == m_frameOutput.size()))
+		{
+			memcpy(m_frameOutput.data(), pFrame, size);
+			++m_frameOutputCount;
 		}
 	}
 
+	///////////////////////////////////////////////////////////////////////////
+	// Render thread
+	///////////////////////////////////////////////////////////////////////////
+
+	// When enabled, frame N is rasterized on a worker thread while the CPU emulates frame N+1.  The output is identical to inline
+	// rendering, but shows up one frame later at most.
+	void SetRenderThreadEnabled(bool enabled)
+	{
+		if (enabled == m_renderThread.joinable())
+		{
+			return;
+		}
+
+		if (enabled)
+		{
+			m_renderThreadQuit = false;
+			m_renderJobPending = false;
+			m_renderThreadFrameReady = false;
+			m_frameCaptures[0].Clear();
+			m_frameCaptures[1].Clear();
+			m_frameCaptureIndex = 0;
+			m_renderThreadShades.resize(kScreenWidth * kScreenHeight);
+
+			// Lines of the current frame that were already drawn inline can't be captured anymore; start with the next frame
+			m_renderCurrentFrame = false;
+
+			m_renderThread = std::thread(&Lcd::RenderThreadMain, this);
+		}
+		else
+		{
+			WaitForRenderThread();
+			PresentRenderThreadFrame();
+
+			{
+				std::lock_guard<std::mutex> lock(m_renderMutex);
+				m_renderThreadQuit = true;
+			}
+			m_renderJobAvailable.notify_one();
+			m_renderThread.join();
+
+			m_renderCurrentFrame = false;
+		}
+	}
+
+	bool IsRenderThreadEnabled() const
+	{
+		return m_renderThread.joinable();
+	}
+
+	// Uploads the last frame completed by the render thread, if any, without blocking
+	void PresentRenderThreadFrame()
+	{
+		if (!m_renderThread.joinable())
+		{
+			return;
+		}
+
+		bool frameReady = false;
+		{
+			std::lock_guard<std::mutex> lock(m_renderMutex);
+			frameReady = m_renderThreadFrameReady && !m_renderJobPending;
+			if (frameReady)
+			{
+				m_renderThreadFrameReady = false;
+			}
+		}
+
+		if (frameReady)
+		{
+			PublishFrame(m_renderThreadShades.data());
+		}
+	}
+
+	void WaitForRenderThread()
+	{
+		if (!m_renderThread.joinable())
+		{
+			return;
+		}
+
+		std::unique_lock<std::mutex> lock(m_renderMutex);
+		while (m_renderJobPending)
+		{
+			m_renderJobDone.wait(lock);
+		}
+	}
+
+	void RenderThreadMain()
+	{
+		for (;;)
+		{
+			const FrameCapture* pJob = nullptr;
+			{
+				std::unique_lock<std::mutex> lock(m_renderMutex);
+				while (!m_renderJobPending && !m_renderThreadQuit)
+				{
+					m_renderJobAvailable.wait(lock);
+				}
+
+				if (m_renderThreadQuit)
+				{
+					return;
+				}
+
+				pJob = m_pRenderJob;
+			}
+
+			RasterizeFrame(*pJob, m_renderThreadShades.data());
+
+			{
+				std::lock_guard<std::mutex> lock(m_renderMutex);
+				m_renderJobPending = false;
+				m_renderThreadFrameReady = true;
+			}
+			m_renderJobDone.notify_all();
+		}
+	}
+
+	// Same as SERVICE_MMR_RW, but writes are logged for mid-line raster effects
+#define SERVICE_MMR_RW_LOGGED(x) case Registers::x: { if (requestType == MemoryRequestType::Read) { value = x; } else { LogRegisterWrite(Registers::x, value); x = value; } return true; } break;
+
+	virtual const Uint8* GetReadPointer(Uint16 address, Uint16 size)
+	{
+		return GetMemoryRangeReadPointer(address, size, kVramBase, kVramSize, m_vram);
+	}
+
+	void StartOamDma(Uint8 sourcePage)
+	{
+		// The whole transfer is done up front, then the bus stays locked for the duration of the real transfer
+		Uint16 sourceAddress = sourcePage << 8;
+		m_pMemoryUnsafe->SetOamDmaActive(false);
+		if (const Uint8* pSource = m_pMemoryUnsafe->GetReadPointer(sourceAddress, kOamSize))
+		{
+			memcpy(m_oam, pSource, kOamSize);
+		}
+		else
+		{
+			// Not plain memory (e.g. memory-mapped registers), go through the bus
+			for (int offset = 0; offset < kOamSize; ++offset)
+			{
+				m_oam[offset] = m_pMemoryUnsafe->Read8(sourceAddress + offset, false);
+			}
+		}
+		++m_oamVersion;
+
+		m_oamDmaTimeLeft = kOamDmaSeconds;
+		m_pMemoryUnsafe->SetOamDmaActive(true);
+	}
+
 	virtual bool HandleRequest(MemoryRequestType requestType, Uint16 address, Uint8& value)
 	{
 		if (ServiceMemoryRangeRequest(requestType, address, value, kVramBase, kVramSize, m_vram))
 		{
+			if (requestType == MemoryRequestType::Write)
+			{
+				++m_vramVersion;
+			}
 			return true;
 		}
 		else if (ServiceMemoryRangeRequest(requestType, address, value, kOamBase, kOamSize, m_oam))
 		{
+			if (requestType == MemoryRequestType::Write)
+			{
+				++m_oamVersion;
+			}
 			return true;
 		}
 		else
 		{
 			switch (address)
 			{
-			SERVICE_MMR_RW(LCDC)
+			SERVICE_MMR_RW_LOGGED(LCDC)
 
 			case Registers::STAT:
 				{
@@ -511,8 +1185,8 @@ public:
 					return true;
 				}
 		
-			SERVICE_MMR_RW(SCY)
-			SERVICE_MMR_RW(SCX)
+			SERVICE_MMR_RW_LOGGED(SCY)
+			SERVICE_MMR_RW_LOGGED(SCX)
 
 			case Registers::LY:
 				{
@@ -533,14 +1207,7 @@ public:
 				{
 					if (requestType == MemoryRequestType::Write)
 					{
-						auto dmaSourceAddress = value << 8;
-						auto dmaDestinationAddress = 0xFE00;
-
-						for ( ; dmaDestinationAddress <= 0xFE9F; ++dmaSourceAddress, ++dmaDestinationAddress)
-						{
-							m_pMemoryUnsafe->Write8(dmaDestinationAddress, m_pMemoryUnsafe->Read8(dmaSourceAddress));
-						}
-						//@TODO: DMA transfer time emulation
+						StartOamDma(value);
 					}
 					else
 					{
@@ -550,16 +1217,18 @@ public:
 				}
 				break;
 
-			SERVICE_MMR_RW(BGP)
-			SERVICE_MMR_RW(OBP0)
-			SERVICE_MMR_RW(OBP1)
-			SERVICE_MMR_RW(WY)
-			SERVICE_MMR_RW(WX)
+			SERVICE_MMR_RW_LOGGED(BGP)
+			SERVICE_MMR_RW_LOGGED(OBP0)
+			SERVICE_MMR_RW_LOGGED(OBP1)
+			SERVICE_MMR_RW_LOGGED(WY)
+			SERVICE_MMR_RW_LOGGED(WX)
 			}
 		}
 	
 		return false;
 	}
+
+#undef SERVICE_MMR_RW_LOGGED
 private:
 	float m_updateTimeLeft;
 	State m_nextState;
@@ -567,9 +1236,47 @@ private:
 	bool m_wasLcdEnabledLastUpdate;
 	int m_lastMode;
 
+	FrameSkipMode m_frameSkipMode;
+	int m_framesToSkip;
+	int m_frameSkipPeriod;
+	int m_frameSkipCounter;
+	bool m_isRunningBehind;
+	bool m_renderCurrentFrame;
+	bool m_renderNextFrameRequested;
+
 	Uint8 m_vram[kVramSize];
 	Uint8 m_oam[kOamSize];
 
+	float m_oamDmaTimeLeft;
+
+	// Bumped on every write, so the render thread captures only know to copy memory when it actually changed
+	Uint32 m_vramVersion;
+	Uint32 m_oamVersion;
+
+	// Registers at the start of pixel transfer on the current line, and the writes made during the transfer
+	ScanlineRegisters m_lineRegisters;
+	std::vector<RegisterWrite> m_lineRegisterWrites;
+
+	Uint8 m_frameBufferShades[kScreenWidth * kScreenHeight];
+
+	FrameOutputFormat m_frameOutputFormat;
+	FramePalette m_framePalette;
+	std::vector<Uint8> m_frameOutput;
+	Uint32 m_frameOutputCount;
+
+	FrameCapture m_frameCaptures[2];
+	int m_frameCaptureIndex;
+
+	std::thread m_renderThread;
+	std::mutex m_renderMutex;
+	std::condition_variable m_renderJobAvailable;
+	std::condition_variable m_renderJobDone;
+	const FrameCapture* m_pRenderJob;
+	bool m_renderJobPending;
+	bool m_renderThreadFrameReady;
+	bool m_renderThreadQuit;
+	std::vector<Uint8> m_renderThreadShades; // allocated with the thread, so headless instances that never use it stay small
+
 	Uint8 LCDC;
 	Uint8 STAT;
 	Uint8 SCY;
@@ -586,5 +1293,4 @@ private:
 	std::shared_ptr<MemoryBus> m_pMemory;
 	MemoryBus* m_pMemoryUnsafe;
 	std::shared_ptr<Cpu> m_pCpu;
-	std::shared_ptr<SDL_Texture> m_pFrameBuffer;
 };
\ No newline at end of file
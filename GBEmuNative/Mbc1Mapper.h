@@ -28,6 +28,14 @@ public:
 		m_romRam2Bits = 0;
 	}
 
+	virtual void SerializeState(StateSerializer& state)
+	{
+		state.Value(m_externalRam);
+		state.Value(m_bankingMode);
+		state.Value(m_romBankLower5Bits);
+		state.Value(m_romRam2Bits);
+	}
+
 	static const int kRomFixedBankBase = 0x0000;
 	static const int kRomFixedBankSize = 0x4000;
 	static const int kRomSwitchedBankBase = 0x4000;
@@ -106,6 +114,39 @@ public:
 		return false;
 	}
 
+	virtual const Uint8* GetReadPointer(Uint16 address, Uint16 size)
+	{
+		int offset = -1;
+		if (IsAddressInRange(address, kRomFixedBankBase, kRomFixedBankSize))
+		{
+			if (address - kRomFixedBankBase + size <= kRomFixedBankSize)
+			{
+				offset = address - kRomFixedBankBase;
+			}
+		}
+		else if (IsAddressInRange(address, kRomSwitchedBankBase, kRomSwitchedBankSize))
+		{
+			if (address - kRomSwitchedBankBase + size <= kRomSwitchedBankSize)
+			{
+				offset = GetEffectiveRomBankIndex() * kRomSwitchedBankSize + (address - kRomSwitchedBankBase);
+			}
+		}
+		else if (IsAddressInRange(address, kRamBankBase, kRamBankSize))
+		{
+			if (address - kRamBankBase + size <= kRamBankSize)
+			{
+				return m_externalRam + GetEffectiveRamBankIndex() * kRamBankSize + (address - kRamBankBase);
+			}
+			return nullptr;
+		}
+
+		if ((offset >= 0) && (offset + size <= static_cast<int>(m_pRomBytes.size())))
+		{
+			return m_pRomBytes.data() + offset;
+		}
+		return nullptr;
+	}
+
 private:
 	Uint8 GetEffectiveRomBankIndex()
 	{
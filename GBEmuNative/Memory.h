@@ -1,3 +1,5 @@
+#pragma once
+
 #include "IMemoryBusDevice.h"
 
 #include "Utils.h"
@@ -30,6 +32,29 @@ public:
 		memset(m_hram, 0xFD, sizeof(m_hram));
 	}
 
+	void SerializeState(StateSerializer& state)
+	{
+		state.Value(m_workMemory);
+		state.Value(m_hram);
+	}
+
+	virtual const Uint8* GetReadPointer(Uint16 address, Uint16 size)
+	{
+		if (IsAddressInRange(address, kWorkMemoryBase, kWorkMemorySize))
+		{
+			return GetMemoryRangeReadPointer(address, size, kWorkMemoryBase, kWorkMemorySize, m_workMemory);
+		}
+		else if (IsAddressInRange(address, kEchoBase, kEchoSize))
+		{
+			return GetMemoryRangeReadPointer(address, size, kEchoBase, kEchoSize, m_workMemory);
+		}
+		else if (IsAddressInRange(address, kHramMemoryBase, kHramMemorySize))
+		{
+			return GetMemoryRangeReadPointer(address, size, kHramMemoryBase, kHramMemorySize, m_hram);
+		}
+		return nullptr;
+	}
+
 private:
 	virtual bool HandleRequest(MemoryRequestType requestType, Uint16 address, Uint8& value)
 	{
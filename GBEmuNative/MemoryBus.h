@@ -8,8 +8,6 @@
 #include <memory>
 #include <vector>
 
-extern float g_totalCyclesExecuted;
-
 namespace MemoryDeviceStatus
 {
 	enum Type
@@ -24,9 +22,14 @@ class MemoryBus
 public:
 
 	static const int kAddressSpaceSize = 0x10000;
+	static const int kPageSize = 0x100;
+	static const int kNumPages = kAddressSpaceSize / kPageSize;
 
 	static Uint32 const kCyclesPerSecond = 4194304;
 
+	// While OAM DMA is running, the CPU can only reach HRAM and the memory-mapped registers below it
+	static const Uint16 kOamDmaAccessibleBase = 0xFF00;
+
 
 	MemoryBus()
 	{
@@ -44,16 +47,74 @@ public:
 
 	void LockDevices()
 	{
-		for (Uint32 address = 0; address < kAddressSpaceSize; ++address)
+		SDL_assert(m_devicesUnsafe.size() <= 0x7F); // indices are stored as Sint8
+
+		// Pages handled entirely by one device (or by none) all share that device's block
+		std::vector<int> uniformBlockOffsets(m_devicesUnsafe.size() - MemoryDeviceStatus::Unknown, -1);
+
+		m_deviceIndexBlocks.clear();
+		for (int page = 0; page < kNumPages; ++page)
 		{
-			m_deviceIndexAtAddress[address] = MemoryDeviceStatus::Unknown;
-			EnsureDeviceIsProbed(address);
+			Sint8 pageDeviceIndices[kPageSize];
+			bool uniform = true;
+			for (int offset = 0; offset < kPageSize; ++offset)
+			{
+				pageDeviceIndices[offset] = static_cast<Sint8>(ProbeDevice(static_cast<Uint16>(page * kPageSize + offset)));
+				uniform = uniform && (pageDeviceIndices[offset] == pageDeviceIndices[0]);
+			}
+
+			int* pUniformBlockOffset = uniform ? &uniformBlockOffsets[pageDeviceIndices[0] - MemoryDeviceStatus::Unknown] : nullptr;
+			if (pUniformBlockOffset && (*pUniformBlockOffset >= 0))
+			{
+				m_pageBlockOffsets[page] = static_cast<Uint16>(*pUniformBlockOffset);
+				continue;
+			}
+
+			m_pageBlockOffsets[page] = static_cast<Uint16>(m_deviceIndexBlocks.size());
+			m_deviceIndexBlocks.insert(m_deviceIndexBlocks.end(), pageDeviceIndices, pageDeviceIndices + kPageSize);
+			if (pUniformBlockOffset)
+			{
+				*pUniformBlockOffset = m_pageBlockOffsets[page];
+			}
 		}
 		m_devicesLocked = true;
 	}
 
+	// Takes the address map of a bus with the same kinds of devices, added in the same order, instead of probing every address again
+	void LockDevicesLike(const MemoryBus& other)
+	{
+		SDL_assert(other.m_devicesLocked && (other.m_devicesUnsafe.size() == m_devicesUnsafe.size()));
+
+		memcpy(m_pageBlockOffsets, other.m_pageBlockOffsets, sizeof(m_pageBlockOffsets));
+		m_deviceIndexBlocks = other.m_deviceIndexBlocks;
+		m_devicesLocked = true;
+	}
+
 	void Reset()
 	{
+		m_oamDmaActive = false;
+	}
+
+	void SetOamDmaActive(bool active)
+	{
+		m_oamDmaActive = active;
+	}
+
+	bool IsOamDmaActive() const
+	{
+		return m_oamDmaActive;
+	}
+
+	// Host pointer to 'size' contiguous bytes starting at 'address', or nullptr if the owning device can't provide one
+	const Uint8* GetReadPointer(Uint16 address, Uint16 size)
+	{
+		SDL_assert(m_devicesLocked);
+		int deviceIndex = GetDeviceIndex(address);
+		if (deviceIndex >= 0)
+		{
+			return m_devicesUnsafe[deviceIndex]->GetReadPointer(address, size);
+		}
+		return nullptr;
 	}
 
 	Uint8 Read8(Uint16 address, bool throwIfFailed = true, bool* pSuccess = nullptr)
@@ -69,7 +130,13 @@ public:
 		}
 
 		SDL_assert(m_devicesLocked);
-		const auto& deviceIndex = m_deviceIndexAtAddress[address];
+		if (m_oamDmaActive && (address < kOamDmaAccessibleBase))
+		{
+			// The bus is busy with the DMA transfer
+			return 0xFF;
+		}
+
+		int deviceIndex = GetDeviceIndex(address);
 		if (deviceIndex >= 0)
 		{
 			Uint8 result = 0;
@@ -109,7 +176,13 @@ public:
 		}
 
 		SDL_assert(m_devicesLocked);
-		const auto& deviceIndex = m_deviceIndexAtAddress[address];
+		if (m_oamDmaActive && (address < kOamDmaAccessibleBase))
+		{
+			// The bus is busy with the DMA transfer, the write is lost
+			return;
+		}
+
+		int deviceIndex = GetDeviceIndex(address);
 		if (deviceIndex >= 0)
 		{
 			m_devicesUnsafe[deviceIndex]->HandleRequest(MemoryRequestType::Write, address, value);
@@ -130,53 +203,62 @@ private:
 	static bool dataBreakpointActive;
 	static Uint16 dataBreakpointAddress;
 
-	void EnsureDeviceIsProbed(Uint16 address)
+	int GetDeviceIndex(Uint16 address) const
+	{
+		return m_deviceIndexBlocks[m_pageBlockOffsets[address / kPageSize] + (address % kPageSize)];
+	}
+
+	int ProbeDevice(Uint16 address)
 	{
 		// WARNING: this logic assumes reading is a completely "const" operation, and that it changes the state of the hardware in no way.
 		// This is definitely not true on many platforms, but it appears to be the case on GB.  If this assumption does not hold true,
 		// we'll have to add another method or perhaps MemoryRequestType to probe the address without altering state.
-		int& deviceIndexAtAddress = m_deviceIndexAtAddress[address];
-		if (deviceIndexAtAddress == MemoryDeviceStatus::Unknown)
+		int deviceIndexAtAddress = MemoryDeviceStatus::Unknown;
+
+		// very fast
+		//if (m_devicesUnsafe[0]->HandleRequest(MemoryRequestType::Read, address, result)) { return result; }
+		//if (m_devicesUnsafe[1]->HandleRequest(MemoryRequestType::Read, address, result)) { return result; }
+
+		//for (const auto& pDevice: m_devicesUnsafe) // extremely slow(300-400x slower) in debug, even with iterator debugging turned off
+		//for (size_t i = 0; i < m_devicesUnsafe.size(); ++i) // 10-12x slower
+
+		// About the same speed as the range-based for in release
+		//auto end = m_devicesUnsafe.data() + m_devicesUnsafe.size();
+		//for (IMemoryBusDevice** ppDevice = m_devicesUnsafe.data(); ppDevice != end; ++ppDevice)
+		auto numDevices = m_devicesUnsafe.size();
+		for (size_t deviceIndex = 0; deviceIndex < numDevices; ++deviceIndex) // 10-12x slower
 		{
-			// very fast
-			//if (m_devicesUnsafe[0]->HandleRequest(MemoryRequestType::Read, address, result)) { return result; }
-			//if (m_devicesUnsafe[1]->HandleRequest(MemoryRequestType::Read, address, result)) { return result; }
-
-			//for (const auto& pDevice: m_devicesUnsafe) // extremely slow(300-400x slower) in debug, even with iterator debugging turned off
-			//for (size_t i = 0; i < m_devicesUnsafe.size(); ++i) // 10-12x slower
-
-			// About the same speed as the range-based for in release
-			//auto end = m_devicesUnsafe.data() + m_devicesUnsafe.size();
-			//for (IMemoryBusDevice** ppDevice = m_devicesUnsafe.data(); ppDevice != end; ++ppDevice)
-			auto numDevices = m_devicesUnsafe.size();
-			for (size_t deviceIndex = 0; deviceIndex < numDevices; ++deviceIndex) // 10-12x slower
+			const auto& pDevice = m_devicesUnsafe[deviceIndex];
+			Uint8 result;
+			if (pDevice->HandleRequest(MemoryRequestType::Read, address, result))
 			{
-				const auto& pDevice = m_devicesUnsafe[deviceIndex];
-				Uint8 result;
-				if (pDevice->HandleRequest(MemoryRequestType::Read, address, result))
+				if (deviceIndexAtAddress == MemoryDeviceStatus::Unknown)
 				{
-					if (deviceIndexAtAddress == MemoryDeviceStatus::Unknown)
-					{
-						deviceIndexAtAddress = deviceIndex;
-						break;
-					}
-					//else
-					//{
-					//	throw Exception("Two memory devices handle address 0x%04lX", address);
-					//}
+					deviceIndexAtAddress = deviceIndex;
+					break;
 				}
+				//else
+				//{
+				//	throw Exception("Two memory devices handle address 0x%04lX", address);
+				//}
 			}
-			
-			if (deviceIndexAtAddress == MemoryDeviceStatus::Unknown)
-			{
-				deviceIndexAtAddress = MemoryDeviceStatus::Unset;
-			}
 		}
+		
+		if (deviceIndexAtAddress == MemoryDeviceStatus::Unknown)
+		{
+			deviceIndexAtAddress = MemoryDeviceStatus::Unset;
+		}
+
+		return deviceIndexAtAddress;
 	}
 
 	bool m_devicesLocked;
+	bool m_oamDmaActive;
 	std::vector<std::shared_ptr<IMemoryBusDevice>> m_devices;
 	std::vector<IMemoryBusDevice*> m_devicesUnsafe;
 
-	int m_deviceIndexAtAddress[kAddressSpaceSize]; // it's good to be in 2014 - this could be much more efficient in terms of space but there's no need for that right now
+	// Which device handles each address, two levels deep: a flat table would be 256k per instance, but most pages belong to a single
+	// device and can share its block of indices, leaving only the pages split between devices (the registers, mostly) with their own
+	Uint16 m_pageBlockOffsets[kNumPages];
+	std::vector<Sint8> m_deviceIndexBlocks;
 };
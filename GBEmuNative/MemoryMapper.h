@@ -6,4 +6,7 @@ class MemoryMapper : public IMemoryBusDevice
 {
 public:
 	virtual void Reset() = 0;
+
+	// Banking registers and external RAM
+	virtual void SerializeState(StateSerializer& state) = 0;
 };
\ No newline at end of file
@@ -0,0 +1,237 @@
+#pragma once
+
+#include "Utils.h"
+
+#include "SDL.h"
+
+#include <deque>
+#include <string.h>
+#include <vector>
+
+// Snapshots of the machine (save states, or anything else that's mostly the same from one snapshot to the next), going back as far
+// as a fixed amount of memory allows.  Only the newest snapshot is kept whole.  Each older one is stored as the XOR of itself with
+// the snapshot after it, run-length encoded: WRAM, VRAM and OAM change little from frame to frame, so that's mostly runs of zeros.
+// Stepping back decodes one delta against the snapshot after it; when memory runs out, the oldest deltas are dropped.
+//
+// A delta starts with the size of the snapshot it decodes to, then alternates between a run of unchanged bytes and a run of
+// literal XORed bytes (each run's length first), until it has covered that size.  Lengths are little-endian base-128 varints.
+class RewindBuffer
+{
+public:
+	// The deltas are kept in a ring of 'capacity' bytes; the newest snapshot, whole, is on top of that
+	RewindBuffer(size_t capacity)
+		: m_ring(capacity)
+		, m_hasNewest(false)
+	{
+	}
+
+	void Clear()
+	{
+		m_entries.clear();
+		m_hasNewest = false;
+	}
+
+	size_t GetNumSnapshots() const
+	{
+		return m_entries.size() + (m_hasNewest ? 1 : 0);
+	}
+
+	void Push(const std::vector<Uint8>& snapshot)
+	{
+		if (m_hasNewest)
+		{
+			EncodeDelta(m_newest, snapshot, m_delta);
+			Store(m_delta);
+		}
+		m_newest.assign(snapshot.begin(), snapshot.end());
+		m_hasNewest = true;
+	}
+
+	// Removes the newest snapshot and returns it; the one before it becomes the newest.  Returns false when there are none left.
+	bool Pop(std::vector<Uint8>& snapshot)
+	{
+		if (!m_hasNewest)
+		{
+			return false;
+		}
+
+		snapshot.swap(m_newest);
+		if (m_entries.empty())
+		{
+			m_hasNewest = false;
+			return true;
+		}
+
+		const Entry& entry = m_entries.back();
+		DecodeDelta(&m_ring[entry.offset], entry.size, snapshot, m_newest);
+		m_entries.pop_back();
+		return true;
+	}
+
+private:
+	struct Entry
+	{
+		size_t offset;
+		size_t size;
+	};
+
+	// A pair of zero bytes ends a literal run; a single one costs less to carry along than to start a new pair of runs for
+	void EncodeDelta(const std::vector<Uint8>& older, const std::vector<Uint8>& newer, std::vector<Uint8>& delta)
+	{
+		size_t size = older.size();
+		m_xor.resize(size);
+		// Through plain pointers, or every byte stored could be one of the vectors' own pointers as far as the compiler knows
+		Uint8* pXor = m_xor.data();
+		const Uint8* pOlder = older.data();
+		const Uint8* pNewer = newer.data();
+		size_t commonSize = SDL_min(size, newer.size());
+		size_t i = 0;
+		for (; i + sizeof(Uint64) <= commonSize; i += sizeof(Uint64))
+		{
+			Uint64 olderWord, newerWord;
+			memcpy(&olderWord, pOlder + i, sizeof(olderWord));
+			memcpy(&newerWord, pNewer + i, sizeof(newerWord));
+			olderWord ^= newerWord;
+			memcpy(pXor + i, &olderWord, sizeof(olderWord));
+		}
+		for (; i < commonSize; ++i)
+		{
+			pXor[i] = pOlder[i] ^ pNewer[i];
+		}
+		if (size > commonSize)
+		{
+			memcpy(pXor + commonSize, pOlder + commonSize, size - commonSize);
+		}
+
+		delta.clear();
+		WriteVarint(delta, size);
+
+		size_t position = 0;
+		while (position < size)
+		{
+			// Unchanged bytes are the bulk of it; skip them eight at a time
+			size_t unchangedEnd = position;
+			Uint64 word = 0;
+			while ((unchangedEnd + sizeof(word) <= size) && (memcpy(&word, pXor + unchangedEnd, sizeof(word)), word == 0))
+			{
+				unchangedEnd += sizeof(word);
+			}
+			while ((unchangedEnd < size) && (pXor[unchangedEnd] == 0))
+			{
+				++unchangedEnd;
+			}
+
+			size_t literalEnd = unchangedEnd;
+			while ((literalEnd < size) && !((pXor[literalEnd] == 0) && ((literalEnd + 1 == size) || (pXor[literalEnd + 1] == 0))))
+			{
+				++literalEnd;
+			}
+
+			WriteVarint(delta, unchangedEnd - position);
+			WriteVarint(delta, literalEnd - unchangedEnd);
+			delta.insert(delta.end(), pXor + unchangedEnd, pXor + literalEnd);
+			position = literalEnd;
+		}
+	}
+
+	static void DecodeDelta(const Uint8* pDelta, size_t deltaSize, const std::vector<Uint8>& newer, std::vector<Uint8>& older)
+	{
+		const Uint8* pEnd = pDelta + deltaSize;
+		size_t size = ReadVarint(pDelta, pEnd);
+
+		// Start from the newer snapshot and apply the literal runs on top
+		older.resize(size);
+		Uint8* pOlder = older.data();
+		size_t commonSize = SDL_min(size, newer.size());
+		memcpy(pOlder, newer.data(), commonSize);
+		memset(pOlder + commonSize, 0, size - commonSize);
+
+		size_t position = 0;
+		while (position < size)
+		{
+			size_t unchangedSize = ReadVarint(pDelta, pEnd);
+			size_t literalSize = ReadVarint(pDelta, pEnd);
+			if ((unchangedSize == 0) && (literalSize == 0))
+			{
+				// Only a corrupt delta has an empty pair of runs; stop rather than spin
+				SDL_assert(false && "Corrupt rewind delta");
+				break;
+			}
+
+			position = SDL_min(position + unchangedSize, size);
+			size_t literalEnd = SDL_min(position + literalSize, size);
+			SDL_assert(static_cast<size_t>(pEnd - pDelta) >= literalEnd - position);
+			for (; position < literalEnd; ++position)
+			{
+				pOlder[position] ^= *pDelta++;
+			}
+		}
+	}
+
+	static void WriteVarint(std::vector<Uint8>& output, size_t value)
+	{
+		while (value >= 0x80)
+		{
+			output.push_back(static_cast<Uint8>(value | 0x80));
+			value >>= 7;
+		}
+		output.push_back(static_cast<Uint8>(value));
+	}
+
+	static size_t ReadVarint(const Uint8*& pInput, const Uint8* pEnd)
+	{
+		size_t value = 0;
+		int shift = 0;
+		while (pInput < pEnd)
+		{
+			Uint8 byte = *pInput++;
+			value |= static_cast<size_t>(byte & 0x7F) << shift;
+			if (!(byte & 0x80))
+			{
+				break;
+			}
+			shift += 7;
+		}
+		return value;
+	}
+
+	void Store(const std::vector<Uint8>& delta)
+	{
+		size_t size = delta.size();
+		if (size > m_ring.size())
+		{
+			// Can't go back past this snapshot anymore
+			m_entries.clear();
+			return;
+		}
+
+		size_t offset = m_entries.empty() ? 0 : m_entries.back().offset + m_entries.back().size;
+		if (offset + size > m_ring.size())
+		{
+			// Doesn't fit before the end of the ring; the end goes unused this time around
+			EvictOverlapping(offset, m_ring.size());
+			offset = 0;
+		}
+		EvictOverlapping(offset, offset + size);
+
+		memcpy(&m_ring[offset], delta.data(), size);
+		Entry entry = { offset, size };
+		m_entries.push_back(entry);
+	}
+
+	// Going around the ring from the end of the newest entry, the oldest entries come first
+	void EvictOverlapping(size_t begin, size_t end)
+	{
+		while (!m_entries.empty() && (m_entries.front().offset < end) && (m_entries.front().offset + m_entries.front().size > begin))
+		{
+			m_entries.pop_front();
+		}
+	}
+
+	std::vector<Uint8> m_ring;
+	std::deque<Entry> m_entries; // oldest first
+	std::vector<Uint8> m_newest;
+	bool m_hasNewest;
+	std::vector<Uint8> m_delta;
+	std::vector<Uint8> m_xor;
+};
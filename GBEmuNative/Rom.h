@@ -72,11 +72,17 @@ public:
 		return static_cast<CartridgeType>(m_pRom[kCartridgeTypeOffset]);
 	}
 
-	const std::vector<Uint8>& GetRom()
+	const std::vector<Uint8>& GetRom() const
 	{
 		return m_pRom;
 	}
 
+	// FNV-1a of the whole image; save states are only loaded into the ROM they were saved with
+	Uint32 GetHash() const
+	{
+		return m_hash;
+	}
+
 private:
 	static const int kNameOffset = 0x134;
 	static const int kNameLength = 0x11;
@@ -85,7 +91,10 @@ private:
 	void LoadFromFile(const char* pFileName)
 	{
 		LoadFileAsByteArray(m_pRom, pFileName);
+
+		m_hash = HashBytes(m_pRom.data(), m_pRom.size());
 	}
 
 	std::vector<Uint8> m_pRom;
+	Uint32 m_hash;
 };
@@ -9,10 +9,18 @@ public:
 	RomOnlyMapper(const std::shared_ptr<Rom>& rom)
 		: m_pRom(rom)
 	{
+		Reset();
 	}
 
 	virtual void Reset()
 	{
+		memset(m_externalRam, 0, sizeof(m_externalRam));
+	}
+
+	// Only the first bank of external RAM is ever mapped
+	virtual void SerializeState(StateSerializer& state)
+	{
+		state.Bytes(m_externalRam, kRamBankSize);
 	}
 
 	static const int kRomBase = 0x0000;
@@ -45,6 +53,20 @@ public:
 		return false;
 	}
 
+	virtual const Uint8* GetReadPointer(Uint16 address, Uint16 size)
+	{
+		if (IsAddressInRange(address, kRomBase, kRomSize))
+		{
+			const auto& romBytes = m_pRom->GetRom();
+			if ((address - kRomBase + size <= kRomSize) && (address - kRomBase + size <= static_cast<int>(romBytes.size())))
+			{
+				return romBytes.data() + (address - kRomBase);
+			}
+			return nullptr;
+		}
+		return GetMemoryRangeReadPointer(address, size, kRamBankBase, kRamBankSize, m_externalRam);
+	}
+
 private:
 	std::shared_ptr<Rom> m_pRom;
 
@@ -0,0 +1,4 @@
+#include "Sound.h"
+
+const Sound::NoiseGenerator::LfsrTable Sound::NoiseGenerator::s_lfsrTable;
+const BlipBuffer::Kernel BlipBuffer::s_kernel;
\ No newline at end of file
@@ -1,12 +1,23 @@
 #pragma once
 
 #include "IMemoryBusDevice.h"
+#include "ApuLog.h"
+#include "AudioSink.h"
+#include "AudioResampler.h"
+#include "BlipBuffer.h"
+#include "MemoryBus.h"
 
 #include "Utils.h"
 
+#include <atomic>
+#include <condition_variable>
 #include <math.h>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
-#ifdef NDEBUG
+#if defined(NDEBUG) && defined(_MSC_VER)
 #pragma optimize("", off)
 #endif
 
@@ -18,33 +29,36 @@ public:
 	// Implemented loosely following http://gbdev.gg8.se/wiki/articles/Gameboy_sound_hardware.  There are many strange behaviours
 	// in the DMG hardware; this code is commented very loosely, and readers should refer to the above page for further details.
 
-	enum class Registers
+	struct Registers
 	{
-		NR10 = 0xFF10, 	// Sound: channel 1 sweep register
-		NR11 = 0xFF11, 	// Sound: channel 1 sound length/wave pattern duty
-		NR12 = 0xFF12, 	// Sound: channel 1 volume envelope
-		NR13 = 0xFF13, 	// Sound: channel 1 frequency low
-		NR14 = 0xFF14, 	// Sound: channel 1 frequency high
-
-		NR21 = 0xFF16,	// Sound: channel 2 sound length/wave pattern duty
-		NR22 = 0xFF17,	// Sound: channel 2 volume envelope
-		NR23 = 0xFF18,	// Sound: channel 2 frequency low
-		NR24 = 0xFF19,	// Sound: channel 2 frequency high
-
-		NR30 = 0xFF1A,	// Sound: channel 3 sound on/off
-		NR31 = 0xFF1B,	// Sound: channel 3 sound length
-		NR32 = 0xFF1C,	// Sound: channel 3 select output level
-		NR33 = 0xFF1D,	// Sound: channel 3 frequency low
-		NR34 = 0xFF1E,	// Sound: channel 3 frequency high
-
-		NR41 = 0xFF20,	// Sound: channel 4 sound length
-		NR42 = 0xFF21,	// Sound: channel 4 volume envelope
-		NR43 = 0xFF22,	// Sound: channel 4 polynomial counter
-		NR44 = 0xFF23,	// Sound: channel 4 counter/consecutive; initial
-
-		NR50 = 0xFF24, 	// Sound: channel control, on/off, volume
-		NR51 = 0xFF25, 	// Sound: selection of sound output terminal
-		NR52 = 0xFF26, 	// Sound: sound on/off
+		enum Type
+		{
+			NR10 = 0xFF10, 	// Sound: channel 1 sweep register
+			NR11 = 0xFF11, 	// Sound: channel 1 sound length/wave pattern duty
+			NR12 = 0xFF12, 	// Sound: channel 1 volume envelope
+			NR13 = 0xFF13, 	// Sound: channel 1 frequency low
+			NR14 = 0xFF14, 	// Sound: channel 1 frequency high
+
+			NR21 = 0xFF16,	// Sound: channel 2 sound length/wave pattern duty
+			NR22 = 0xFF17,	// Sound: channel 2 volume envelope
+			NR23 = 0xFF18,	// Sound: channel 2 frequency low
+			NR24 = 0xFF19,	// Sound: channel 2 frequency high
+
+			NR30 = 0xFF1A,	// Sound: channel 3 sound on/off
+			NR31 = 0xFF1B,	// Sound: channel 3 sound length
+			NR32 = 0xFF1C,	// Sound: channel 3 select output level
+			NR33 = 0xFF1D,	// Sound: channel 3 frequency low
+			NR34 = 0xFF1E,	// Sound: channel 3 frequency high
+
+			NR41 = 0xFF20,	// Sound: channel 4 sound length
+			NR42 = 0xFF21,	// Sound: channel 4 volume envelope
+			NR43 = 0xFF22,	// Sound: channel 4 polynomial counter
+			NR44 = 0xFF23,	// Sound: channel 4 counter/consecutive; initial
+
+			NR50 = 0xFF24, 	// Sound: channel control, on/off, volume
+			NR51 = 0xFF25, 	// Sound: selection of sound output terminal
+			NR52 = 0xFF26, 	// Sound: sound on/off
+		};
 	};
 
 	class LengthCounter
@@ -110,6 +124,12 @@ public:
 			}
 		}
 
+		void SerializeState(StateSerializer& state)
+		{
+			state.Value(m_enabled);
+			state.Value(m_lengthCounter);
+		}
+
 	private:
 		const Uint8& m_NRx1;
 		const Uint8& m_NRx4;
@@ -185,6 +205,12 @@ public:
 			}
 		}
 
+		void SerializeState(StateSerializer& state)
+		{
+			state.Value(m_volumeCounter);
+			state.Value(m_volume);
+		}
+
 	private:
 		const Uint8& m_NRx2;
 
@@ -233,7 +259,7 @@ public:
 
 			if (GetCurrentFrequency() != frequency)
 			{
-				DebugBreak();
+				SDL_TriggerBreakpoint();
 			}
 		}
 
@@ -309,6 +335,13 @@ public:
 			}
 		}
 
+		void SerializeState(StateSerializer& state)
+		{
+			state.Value(m_shadowFrequency);
+			state.Value(m_sweepTimer);
+			state.Value(m_enabled);
+		}
+
 	private:
 		const Uint8& m_NRx0;
 		Uint8& m_NRx3;
@@ -368,10 +401,16 @@ public:
 			m_samplePosition = 0;
 		}
 
-		void Tick()
+		Uint32 GetCyclesUntilNextStep() const
+		{
+			return m_frequencyTimerCounter;
+		}
+
+		// Runs the timer for at most GetCyclesUntilNextStep() cycles
+		void Advance(Uint32 cycles)
 		{
-			SDL_assert(m_frequencyTimerCounter > 0);
-			--m_frequencyTimerCounter;
+			SDL_assert(cycles <= m_frequencyTimerCounter);
+			m_frequencyTimerCounter -= cycles;
 			if (m_frequencyTimerCounter == 0)
 			{
 				ResetTimerPeriodFromFrequency();
@@ -381,6 +420,21 @@ public:
 			}
 		}
 
+		// Runs the timer for any number of cycles at once, when nobody can hear the steps
+		void Skip(Uint32 cycles)
+		{
+			if (cycles < m_frequencyTimerCounter)
+			{
+				m_frequencyTimerCounter -= cycles;
+				return;
+			}
+
+			cycles -= m_frequencyTimerCounter;
+			Uint32 period = GetTimerPeriodFromFrequency(GetDefaultFrequency());
+			m_samplePosition = (m_samplePosition + 1 + cycles / period) % 8;
+			m_frequencyTimerCounter = period - cycles % period;
+		}
+
 		Sint16 GetOutput() const
 		{
 			static Uint8 duties[4][8] =
@@ -395,6 +449,12 @@ public:
 
 			return (duties[duty][m_samplePosition] != 0) ? MAX_GENERATOR_OUTPUT : MIN_GENERATOR_OUTPUT;
 		}
+
+		void SerializeState(StateSerializer& state)
+		{
+			state.Value(m_frequencyTimerCounter);
+			state.Value(m_samplePosition);
+		}
 		
 	private:
 		const Uint8& m_NRx1;
@@ -430,9 +490,9 @@ public:
 			return m_NRx3 & 0x7;
 		}
 
-		Uint16 GetTimerPeriod() const
+		Uint32 GetTimerPeriod() const
 		{
-			static Uint16 baseDivisors[] = {8, 16, 32, 48, 64, 80, 96, 112};
+			static Uint32 baseDivisors[] = {8, 16, 32, 48, 64, 80, 96, 112};
 			return baseDivisors[GetDivisorCode()] << GetClockShift();
 		}
 
@@ -444,41 +504,119 @@ public:
 		void Reset()
 		{
 			ResetTimerPeriodFromFrequency();
-			m_lfsr = 0xFFFF;
-			//m_lfsr = rand();
+			m_lfsr = 0x7FFF;
 		}
 
-		void Tick()
+		// Cycles until the output can next change.  The output is bit 0 and the bits above it are shifted down unchanged until they
+		// reach the feedback position, so runs of equal bits are covered in one go instead of one LFSR step at a time.
+		Uint32 GetCyclesUntilNextStep() const
 		{
-			--m_frequencyTimerCounter;
-			if (m_frequencyTimerCounter == 0)
-			{
-				ResetTimerPeriodFromFrequency();
-				
-				// Documented implementation sounds further from the hardware than just a call to rand()
-				Uint16 xor01 = (m_lfsr & Bit0) ^ ((m_lfsr & Bit1) >> 1);
-				m_lfsr >>= 1;
-				m_lfsr |= xor01 << 15;
-				if (IsSevenBitMode())
-				{
-					m_lfsr |= xor01 << 6;
-				}
+			return m_frequencyTimerCounter + (GetNumStepsUntilOutputChange() - 1) * GetTimerPeriod();
+		}
 
-				// Crush the above with a simple pseudorandom call - at high enough frequencies this sounds very similar to actual hardware... not true to the hardware, but it sounds better than the above
-				m_lfsr = rand() % 2;
+		// Runs the timer for any number of cycles, stepping the LFSR once per expiry
+		void Advance(Uint32 cycles)
+		{
+			if (cycles < m_frequencyTimerCounter)
+			{
+				m_frequencyTimerCounter -= cycles;
+				return;
 			}
+
+			cycles -= m_frequencyTimerCounter;
+			Uint32 period = GetTimerPeriod();
+			StepLfsr(1 + cycles / period);
+			m_frequencyTimerCounter = period - cycles % period;
+		}
+
+		// Nobody can hear the steps; same as Advance, which is already cheap for long stretches
+		void Skip(Uint32 cycles)
+		{
+			Advance(cycles);
 		}
 
 		Sint16 GetOutput() const
 		{
 			return ((1 ^ (m_lfsr & Bit0)) != 0) ? MAX_GENERATOR_OUTPUT : MIN_GENERATOR_OUTPUT;
 		}
+
+		void SerializeState(StateSerializer& state)
+		{
+			state.Value(m_lfsr);
+			state.Value(m_frequencyTimerCounter);
+		}
 		
+		// The 15-bit LFSR steps 8 times at once through this, separately for each width mode; shared by all instances
+		struct LfsrTable
+		{
+			LfsrTable()
+			{
+				for (int sevenBitMode = 0; sevenBitMode < 2; ++sevenBitMode)
+				{
+					for (Uint32 lfsr = 0; lfsr < kLfsrStates; ++lfsr)
+					{
+						Uint16 value = static_cast<Uint16>(lfsr);
+						for (int step = 0; step < 8; ++step)
+						{
+							value = StepLfsrOnce(value, sevenBitMode != 0);
+						}
+						advance8[sevenBitMode][lfsr] = value;
+					}
+				}
+			}
+
+			static const Uint32 kLfsrStates = 1 << 15;
+			Uint16 advance8[2][kLfsrStates];
+		};
+
 	private:
+		// Bits 0 and 1 are XORed and shifted in at the top (bit 14), and also into bit 6 in 7-bit mode
+		static Uint16 StepLfsrOnce(Uint16 lfsr, bool sevenBitMode)
+		{
+			Uint16 feedback = (lfsr ^ (lfsr >> 1)) & 1;
+			lfsr = (lfsr >> 1) | (feedback << 14);
+			if (sevenBitMode)
+			{
+				lfsr = (lfsr & ~Bit6) | (feedback << 6);
+			}
+			return lfsr;
+		}
+
+		void StepLfsr(Uint32 numSteps)
+		{
+			bool sevenBitMode = IsSevenBitMode();
+			const Uint16* pAdvance8 = s_lfsrTable.advance8[sevenBitMode ? 1 : 0];
+			for ( ; numSteps >= 8; numSteps -= 8)
+			{
+				m_lfsr = pAdvance8[m_lfsr];
+			}
+			for ( ; numSteps > 0; --numSteps)
+			{
+				m_lfsr = StepLfsrOnce(m_lfsr, sevenBitMode);
+			}
+		}
+
+		// Output after k steps is the current bit k, for k up to the feedback position (6 or 14)
+		Uint32 GetNumStepsUntilOutputChange() const
+		{
+			Uint32 numKnownSteps = IsSevenBitMode() ? 6 : 14;
+			Uint32 changes = (m_lfsr ^ (m_lfsr >> 1)) & ((1 << numKnownSteps) - 1);
+			for (Uint32 step = 1; step < numKnownSteps; ++step, changes >>= 1)
+			{
+				if (changes & 1)
+				{
+					return step;
+				}
+			}
+			return numKnownSteps;
+		}
+
+		static const LfsrTable s_lfsrTable;
+
 		const Uint8& m_NRx3;
 
 		Uint16 m_lfsr;
-		Uint16 m_frequencyTimerCounter;
+		Uint32 m_frequencyTimerCounter;
 	};
 
 	class WavetableGenerator
@@ -529,26 +667,60 @@ public:
 			m_samplePosition = 0;
 		}
 
-		void Tick()
+		Uint32 GetCyclesUntilNextStep() const
+		{
+			return m_frequencyTimerCounter;
+		}
+
+		// Runs the timer for at most GetCyclesUntilNextStep() cycles
+		void Advance(Uint32 cycles)
 		{
-			SDL_assert(m_frequencyTimerCounter > 0);
-			--m_frequencyTimerCounter;
+			SDL_assert(cycles <= m_frequencyTimerCounter);
+			m_frequencyTimerCounter -= cycles;
 			if (m_frequencyTimerCounter == 0)
 			{
 				ResetTimerPeriodFromFrequency();
 
 				m_samplePosition = (m_samplePosition + 1) % 32;
-				Uint8 sampleIndex = m_samplePosition >> 1;
-				Uint8 sample = ((m_samplePosition & 1) != 0) ? (m_pWaveRam[sampleIndex] & 0x0F) : ((m_pWaveRam[sampleIndex] >> 4) & 0xF);
-				m_output = sample >> GetVolumeShift(); // 0-15
-				m_output = MIN_GENERATOR_OUTPUT + (m_output * ((MAX_GENERATOR_OUTPUT - MIN_GENERATOR_OUTPUT) / 15));
+				UpdateOutputFromSamplePosition();
+			}
+		}
+
+		// Runs the timer for any number of cycles at once, when nobody can hear the steps
+		void Skip(Uint32 cycles)
+		{
+			if (cycles < m_frequencyTimerCounter)
+			{
+				m_frequencyTimerCounter -= cycles;
+				return;
 			}
+
+			cycles -= m_frequencyTimerCounter;
+			Uint32 period = GetTimerPeriodFromFrequency(GetDefaultFrequency());
+			m_samplePosition = (m_samplePosition + 1 + cycles / period) % 32;
+			m_frequencyTimerCounter = period - cycles % period;
+			UpdateOutputFromSamplePosition();
+		}
+
+		void UpdateOutputFromSamplePosition()
+		{
+			Uint8 sampleIndex = m_samplePosition >> 1;
+			Uint8 sample = ((m_samplePosition & 1) != 0) ? (m_pWaveRam[sampleIndex] & 0x0F) : ((m_pWaveRam[sampleIndex] >> 4) & 0xF);
+			m_output = sample >> GetVolumeShift(); // 0-15
+			m_output = MIN_GENERATOR_OUTPUT + (m_output * ((MAX_GENERATOR_OUTPUT - MIN_GENERATOR_OUTPUT) / 15));
 		}
 
 		Sint16 GetOutput() const
 		{
 			return IsEnabled() ? m_output : 0;
 		}
+
+		void SerializeState(StateSerializer& state)
+		{
+			state.Value(m_frequencyTimerCounter);
+			state.Value(m_samplePosition);
+			state.Value(m_output);
+		}
 		
 	private:
 		const Uint8& m_NRx0;
@@ -565,724 +737,1517 @@ public:
 	static const int kWaveRamBase = 0xFF30;
 	static const int kWaveRamSize = 0xFF3F - kWaveRamBase + 1;
 
-	static const int kDeviceFrequency = 44100;
-	static const int kDeviceNumChannels = 2;
-	static const int kDeviceNumBufferSamples = 1024; // below 1024, things start to get dicey with xaudio on my hardware
-	static const int kDeviceBufferNumMonoSamples = kDeviceNumChannels * kDeviceNumBufferSamples;
-	static const int kDeviceBufferByteSize = kDeviceBufferNumMonoSamples * sizeof(Sint16);
-
-	static void AudioCallback(void* userdata, Uint8* pStream8, int numBytes)
-	{
-		Sint16* pStream16 = reinterpret_cast<Sint16*>(pStream8);
-		reinterpret_cast<Sound*>(userdata)->FillStreamBuffer(pStream16, numBytes);
-	}
-	
-	Sound()
-		: m_ch1Sweep(NR10, NR13, NR14, m_ch1LengthCounter)
-		, m_ch1Generator(NR11, NR13, NR14)
-		, m_ch1LengthCounter(NR11, NR14, false)
-		, m_ch1VolumeEnvelope(NR12)
-		, m_ch2Generator(NR21, NR23, NR24)
-		, m_ch2LengthCounter(NR21, NR24, false)
-		, m_ch2VolumeEnvelope(NR22)
-		, m_ch3Generator(NR30, NR32, NR33, NR34, m_waveRam)
-		, m_ch3LengthCounter(NR31, NR34, true)
-		, m_ch4Generator(NR43)
-		, m_ch4LengthCounter(NR41, NR44, false)
-		, m_ch4VolumeEnvelope(NR42)
-	{
-		if (SDL_GetNumAudioDevices(0) > 0)
-		{
-			// Get default audio device
-			auto deviceName = SDL_GetAudioDeviceName(0, 0);
-
-			SDL_AudioSpec desiredSpec;
-			desiredSpec.freq = kDeviceFrequency;
-			desiredSpec.format = AUDIO_S16SYS;
-			desiredSpec.channels = kDeviceNumChannels;
-			desiredSpec.samples = kDeviceNumBufferSamples;
-			desiredSpec.callback = &AudioCallback;
-			desiredSpec.userdata = this;
-			
-			SDL_AudioSpec obtainedSpec;
-
-			auto deviceId = SDL_OpenAudioDevice(deviceName, 0, &desiredSpec, &obtainedSpec, 0);
-			if (deviceId != 0)
-			{
-				m_deviceId = deviceId;
-			}
-		}
-
-		Reset();
-
-		if (m_deviceId != 0)
-		{
-			SDL_PauseAudioDevice(m_deviceId, 0);
-		}
-	}
+	static const int kDefaultOutputSampleRate = 44100;
+	static const int kDeviceNumChannels = IAudioSink::kNumChannels;
 
-	~Sound()
-	{
-		if (m_deviceId != 0)
-		{
-			SDL_CloseAudioDevice(m_deviceId);
-		}
-	}
+	// Rate the channels are mixed at when the output goes through the resampler (see ResamplerQuality).  Sits above the highest
+	// common output rates' Nyquist frequencies, and divides the clock evenly.
+	static const int kNativeSampleRate = MemoryBus::kCyclesPerSecond / 64;
 
-	void Reset()
+	enum class ResamplerQuality
 	{
-		m_updateTimeLeft = 0.0f;
-		m_sampleTimeLeft = 0.0f;
+		Fast,		// Synthesized directly at the output rate; no resampling
+		Balanced,	// Mixed at kNativeSampleRate, then a 32-tap polyphase filter down (or up) to the output rate
+		High,		// Same with a 64-tap filter: a sharper cutoff, so more of the treble is kept
+	};
 
-		NR10 = 0x80;
-		NR11 = 0xBF;
-		NR12 = 0xF3;
-		NR13 = 0x00;
-		NR14 = 0xBF;
+	// Samples are handed to the sink in batches rather than one at a time
+	static const int kSampleBatchFrames = 128;
 
-		NR21 = 0x3F;
-		NR22 = 0x00;
-		NR23 = 0x00;
-		NR24 = 0xBF;
+	// The frame sequencer clocks length, envelope and sweep at 512Hz
+	static const Uint32 kFrameSequencerPeriod = 8192;
 
-		NR30 = 0x7F;
-		NR31 = 0xFF;
-		NR32 = 0x9F;
-		NR33 = 0xBF;
-		NR34 = 0x00;
+	// Synthesized output is collected from the blip buffers at least this often (in clock cycles), which bounds their size
+	static const Uint32 kMaxBlipFrameCycles = 65536;
 
-		NR41 = 0xFF;
-		NR42 = 0x00;
-		NR43 = 0x00;
-		NR44 = 0xBF;
+	// The APU proper: registers, channels, frame sequencer, and the blip buffers the mix is synthesized into.  Sound keeps one of
+	// these for synthesis and a second one with synthesis disabled, which tracks what register reads can observe (see the synthesis
+	// thread below).  Without synthesis, only the frame sequencer runs: length counters, envelopes and sweep stay exact, and the
+	// waveform generators and blip buffers are left alone.
+	class Apu : public IMemoryBusDevice
+	{
+	public:
+		Apu(bool synthesisEnabled)
+			: m_synthesisEnabled(synthesisEnabled)
+			, m_ch1Sweep(NR10, NR13, NR14, m_ch1LengthCounter)
+			, m_ch1Generator(NR11, NR13, NR14)
+			, m_ch1LengthCounter(NR11, NR14, false)
+			, m_ch1VolumeEnvelope(NR12)
+			, m_ch2Generator(NR21, NR23, NR24)
+			, m_ch2LengthCounter(NR21, NR24, false)
+			, m_ch2VolumeEnvelope(NR22)
+			, m_ch3Generator(NR30, NR32, NR33, NR34, m_waveRam)
+			, m_ch3LengthCounter(NR31, NR34, true)
+			, m_ch4Generator(NR43)
+			, m_ch4LengthCounter(NR41, NR44, false)
+			, m_ch4VolumeEnvelope(NR42)
+		{
+			if (m_synthesisEnabled)
+			{
+				for (int channel = 0; channel < kDeviceNumChannels; ++channel)
+				{
+					m_blipBuffers[channel].SetRates(MemoryBus::kCyclesPerSecond, kDefaultOutputSampleRate, kMaxBlipFrameCycles);
+				}
+			}
 
-		NR50 = 0x77;
-		NR51 = 0xF3;
-		NR52 = 0xF1;
+			Reset();
+		}
 
-		if (m_deviceId != 0)
+		// Sets the nominal rate the blip buffers produce samples at, dropping anything not read yet
+		void SetRates(int sampleRate)
 		{
-			SDL_LockAudioDevice(m_deviceId);
-		}
+			if (!m_synthesisEnabled)
+			{
+				return;
+			}
 
-		m_nextBackBufferToTransfer = 0;
-		memset(m_backBuffers, 0, sizeof(m_backBuffers));
-		// Start in the middle of the second back buffer
-		m_numMonoSamplesAvailable = kDeviceBufferNumMonoSamples + kDeviceBufferNumMonoSamples / 2;
+			for (int channel = 0; channel < kDeviceNumChannels; ++channel)
+			{
+				m_blipBuffers[channel].SetRates(MemoryBus::kCyclesPerSecond, sampleRate, kMaxBlipFrameCycles);
+				m_outputLevels[channel] = 0;
+			}
 
-		m_audioDeviceActive = false;
-		m_masterCounter = 0;
-		m_sequencerCounter = 0;
+			// The buffers start from silence; step back up to the current level
+			UpdateOutputLevels();
+		}
 
-		m_sampleTimeStep = 1.0f / kDeviceFrequency;
+		void Reset()
+		{
+			m_masterCounter = 0;
+			m_sequencerCounter = 0;
+			m_blipFrameCycle = 0;
 
-		m_ch1Generator.Reset();
-		m_ch1LengthCounter.ResetLength();
-		m_ch1VolumeEnvelope.Reset();
+			NR10 = 0x80;
+			NR11 = 0xBF;
+			NR12 = 0xF3;
+			NR13 = 0x00;
+			NR14 = 0xBF;
 
-		m_ch2Generator.Reset();
-		m_ch2LengthCounter.ResetLength();
-		m_ch2VolumeEnvelope.Reset();
+			NR21 = 0x3F;
+			NR22 = 0x00;
+			NR23 = 0x00;
+			NR24 = 0xBF;
 
-		m_ch3Generator.Reset();
-		m_ch3LengthCounter.ResetLength();
+			NR30 = 0x7F;
+			NR31 = 0xFF;
+			NR32 = 0x9F;
+			NR33 = 0xBF;
+			NR34 = 0x00;
 
-		m_ch4Generator.Reset();
-		m_ch4LengthCounter.ResetLength();
-		m_ch4VolumeEnvelope.Reset();
+			NR41 = 0xFF;
+			NR42 = 0x00;
+			NR43 = 0x00;
+			NR44 = 0xBF;
 
-		if (m_deviceId != 0)
-		{
-			SDL_UnlockAudioDevice(m_deviceId);
-		}
+			NR50 = 0x77;
+			NR51 = 0xF3;
+			NR52 = 0xF1;
 
-		m_tracelogDumpTimer = 0.0f;
-		m_traceLog.clear();
-	}
+			// Power-on wave RAM is noise on hardware; zeroes here, so that every run starts the same
+			memset(m_waveRam, 0, sizeof(m_waveRam));
 
-	void OnMasterTick()
-	{
-		m_ch1Generator.Tick();
-		m_ch2Generator.Tick();
-		m_ch3Generator.Tick();
-		m_ch4Generator.Tick();
-	}
+			m_ch1Sweep.Reset();
+			m_ch1Generator.Reset();
+			m_ch1LengthCounter.ResetLength();
+			m_ch1VolumeEnvelope.Reset();
 
-	void OnLengthTick()
-	{
-		m_ch1LengthCounter.Tick();
-		m_ch2LengthCounter.Tick();
-		m_ch3LengthCounter.Tick();
-		m_ch4LengthCounter.Tick();
-	}
+			m_ch2Generator.Reset();
+			m_ch2LengthCounter.ResetLength();
+			m_ch2VolumeEnvelope.Reset();
 
-	void OnVolumeEnvelopeTick()
-	{
-		m_ch1VolumeEnvelope.Tick();
-		m_ch2VolumeEnvelope.Tick();
-		m_ch4VolumeEnvelope.Tick();
-	}
+			m_ch3Generator.Reset();
+			m_ch3LengthCounter.ResetLength();
 
-	void OnSweepEnvelopeTick()
-	{
-		m_ch1Sweep.Tick();
-	}
+			m_ch4Generator.Reset();
+			m_ch4LengthCounter.ResetLength();
+			m_ch4VolumeEnvelope.Reset();
 
-	void OnSequencerTick()
-	{
-		// Emulate the tick sequence as per the hardware docs
-		if (m_sequencerCounter % 2)
-		{
-			OnLengthTick();
+			for (int channel = 0; channel < kDeviceNumChannels; ++channel)
+			{
+				m_blipBuffers[channel].Clear();
+				m_outputLevels[channel] = 0;
+			}
+			UpdateOutputLevels();
 		}
 
-		if (m_sequencerCounter == 7)
+		void OnLengthTick()
 		{
-			OnVolumeEnvelopeTick();
+			m_ch1LengthCounter.Tick();
+			m_ch2LengthCounter.Tick();
+			m_ch3LengthCounter.Tick();
+			m_ch4LengthCounter.Tick();
 		}
 
-		if ((m_sequencerCounter + 2) % 4 == 0)
+		void OnVolumeEnvelopeTick()
 		{
-			OnSweepEnvelopeTick();
+			m_ch1VolumeEnvelope.Tick();
+			m_ch2VolumeEnvelope.Tick();
+			m_ch4VolumeEnvelope.Tick();
 		}
-	}
 
-	void Update(float seconds)
-	{
-		if (!m_deviceId)
+		void OnSweepEnvelopeTick()
 		{
-			return;
+			m_ch1Sweep.Tick();
 		}
 
-		m_updateTimeLeft += seconds;
-		m_sampleTimeLeft += seconds;
-		m_tracelogDumpTimer += seconds;
-
-		const float timeStep = 1.0f / MemoryBus::kCyclesPerSecond;
-
-		while (m_updateTimeLeft > 0.0f)
+		void OnSequencerTick()
 		{
-			m_masterCounter = (m_masterCounter + 1) % 8192;
-			if (m_masterCounter == 0)
+			// Emulate the tick sequence as per the hardware docs
+			if (m_sequencerCounter % 2)
 			{
-				m_sequencerCounter = (m_sequencerCounter + 1) % 8;
-				OnSequencerTick();
+				OnLengthTick();
 			}
 
-			OnMasterTick();
-
-			if (!m_audioDeviceActive)
+			if (m_sequencerCounter == 7)
 			{
-				m_sampleTimeLeft = 0.0f;
+				OnVolumeEnvelopeTick();
 			}
 
-			if (m_sampleTimeLeft > 0.0f)
+			if ((m_sequencerCounter + 2) % 4 == 0)
 			{
-				// Put a sound sample into the backbuffer
+				OnSweepEnvelopeTick();
+			}
+		}
 
-				SDL_LockAudioDevice(m_deviceId);
+		bool IsChannelAudible(const LengthCounter& lengthCounter) const
+		{
+			return lengthCounter.IsChannelEnabled();
+		}
 
-				if (m_numMonoSamplesAvailable < (kDeviceBufferNumMonoSamples * 2))
+		// Runs until 'cycles' have elapsed or the blip frame is full, whichever comes first, and returns the number of cycles run.
+		// Without synthesis there is no blip frame, and everything is run.
+		Uint32 RunCycles(Uint32 cycles)
+		{
+			if (!m_synthesisEnabled)
+			{
+				for (Uint32 cyclesLeft = cycles; cyclesLeft > 0; )
 				{
-					Uint16* pCurrentSample = (m_numMonoSamplesAvailable >= kDeviceBufferNumMonoSamples)
-						? &m_backBuffers[(m_nextBackBufferToTransfer + 1) % 2][m_numMonoSamplesAvailable - kDeviceBufferNumMonoSamples]
-						: &m_backBuffers[m_nextBackBufferToTransfer][m_numMonoSamplesAvailable];
-
-					Sint16 ch1Value = m_ch1LengthCounter.GetGatedSample(m_ch1VolumeEnvelope.GetAttenuatedSample(m_ch1Generator.GetOutput()));
-					Sint16 ch2Value = m_ch2LengthCounter.GetGatedSample(m_ch2VolumeEnvelope.GetAttenuatedSample(m_ch2Generator.GetOutput()));
-					Sint16 ch3Value = m_ch3LengthCounter.GetGatedSample(m_ch3Generator.GetOutput());
-					Sint16 ch4Value = m_ch4LengthCounter.GetGatedSample(m_ch4VolumeEnvelope.GetAttenuatedSample(m_ch4Generator.GetOutput()));
-
-					// Sine wave test
-					//static float f = 0.0f;
-					//f += m_sampleTimeStep;
-					//ch2Value = sinf(f * 220.0f * 2 * 3.14f) * 4000.0f;
-
-					static int const preMixShift = 2;
-					ch1Value >>= preMixShift;
-					ch2Value >>= preMixShift;
-					ch3Value >>= preMixShift;
-					ch4Value >>= preMixShift;
-
-					Sint16 leftValue = 0;
-					Sint16 rightValue = 0;
-
-					if (NR52 & Bit7)
-					{
-						if (NR51 & Bit7) leftValue += ch4Value;
-						if (NR51 & Bit6) leftValue += ch3Value;
-						if (NR51 & Bit5) leftValue += ch2Value;
-						if (NR51 & Bit4) leftValue += ch1Value;
-						if (NR51 & Bit3) rightValue += ch4Value;
-						if (NR51 & Bit2) rightValue += ch3Value;
-						if (NR51 & Bit1) rightValue += ch2Value;
-						if (NR51 & Bit0) rightValue += ch1Value;
-					}
+					Uint32 step = SDL_min(cyclesLeft, kFrameSequencerPeriod - m_masterCounter);
+					AdvanceFrameSequencer(step);
+					cyclesLeft -= step;
+				}
+				return cycles;
+			}
 
-					Sint16 leftVolume = (NR50 >> 4) & 0x7;
-					leftValue = (static_cast<Sint32>(leftValue) * leftVolume) / 0xF;
-					Sint16 rightVolume = (NR50 >> 0) & 0x7;
-					rightValue = (static_cast<Sint32>(rightValue) * rightVolume) / 0xF;
+			Uint32 cyclesRun = 0;
+			while ((cyclesRun < cycles) && !IsBlipFrameFull())
+			{
+				// Jump straight to the next event: a frame sequencer tick, a waveform step on a channel that can be heard, or the end of the
+				// blip frame.  Channels that can't be heard are skipped over in bulk.
+				bool ch1Audible = IsChannelAudible(m_ch1LengthCounter);
+				bool ch2Audible = IsChannelAudible(m_ch2LengthCounter);
+				bool ch3Audible = IsChannelAudible(m_ch3LengthCounter) && m_ch3Generator.IsEnabled();
+				bool ch4Audible = IsChannelAudible(m_ch4LengthCounter);
+
+				Uint32 step = SDL_min(cycles - cyclesRun, kFrameSequencerPeriod - m_masterCounter);
+				step = SDL_min(step, kMaxBlipFrameCycles - m_blipFrameCycle);
+				if (ch1Audible) step = SDL_min(step, m_ch1Generator.GetCyclesUntilNextStep());
+				if (ch2Audible) step = SDL_min(step, m_ch2Generator.GetCyclesUntilNextStep());
+				if (ch3Audible) step = SDL_min(step, m_ch3Generator.GetCyclesUntilNextStep());
+				if (ch4Audible) step = SDL_min(step, m_ch4Generator.GetCyclesUntilNextStep());
+
+				// The sequencer goes first when both land on the same cycle, so a sweep is picked up by a period reload on that cycle
+				AdvanceFrameSequencer(step);
+
+				if (ch1Audible) m_ch1Generator.Advance(step); else m_ch1Generator.Skip(step);
+				if (ch2Audible) m_ch2Generator.Advance(step); else m_ch2Generator.Skip(step);
+				if (ch3Audible) m_ch3Generator.Advance(step); else m_ch3Generator.Skip(step);
+				if (ch4Audible) m_ch4Generator.Advance(step); else m_ch4Generator.Skip(step);
+
+				m_blipFrameCycle += step;
+				cyclesRun += step;
+
+				UpdateOutputLevels();
+			}
+			return cyclesRun;
+		}
 
-					*pCurrentSample++ = leftValue;
-					*pCurrentSample++ = rightValue; 
+		// step must not go past the next sequencer tick
+		void AdvanceFrameSequencer(Uint32 step)
+		{
+			m_masterCounter += step;
+			if (m_masterCounter == kFrameSequencerPeriod)
+			{
+				m_masterCounter = 0;
+				m_sequencerCounter = (m_sequencerCounter + 1) % 8;
+				OnSequencerTick();
+			}
+		}
 
-					//printf("Producer: %d mono samples available; adding 2. ", m_numMonoSamplesAvailable);
-					m_numMonoSamplesAvailable += 2;
-				}
-				else
-				{
-					//printf("Sound device overstuff!  Skipping sample.");
-				}
+		void ComputeOutputLevels(Sint32& leftValue, Sint32& rightValue) const
+		{
+			Sint16 ch1Value = m_ch1LengthCounter.GetGatedSample(m_ch1VolumeEnvelope.GetAttenuatedSample(m_ch1Generator.GetOutput()));
+			Sint16 ch2Value = m_ch2LengthCounter.GetGatedSample(m_ch2VolumeEnvelope.GetAttenuatedSample(m_ch2Generator.GetOutput()));
+			Sint16 ch3Value = m_ch3LengthCounter.GetGatedSample(m_ch3Generator.GetOutput());
+			Sint16 ch4Value = m_ch4LengthCounter.GetGatedSample(m_ch4VolumeEnvelope.GetAttenuatedSample(m_ch4Generator.GetOutput()));
 
-				SDL_UnlockAudioDevice(m_deviceId);
+			static int const preMixShift = 2;
+			ch1Value >>= preMixShift;
+			ch2Value >>= preMixShift;
+			ch3Value >>= preMixShift;
+			ch4Value >>= preMixShift;
 
-				m_sampleTimeLeft -= m_sampleTimeStep;
+			leftValue = 0;
+			rightValue = 0;
+
+			if (NR52 & Bit7)
+			{
+				if (NR51 & Bit7) leftValue += ch4Value;
+				if (NR51 & Bit6) leftValue += ch3Value;
+				if (NR51 & Bit5) leftValue += ch2Value;
+				if (NR51 & Bit4) leftValue += ch1Value;
+				if (NR51 & Bit3) rightValue += ch4Value;
+				if (NR51 & Bit2) rightValue += ch3Value;
+				if (NR51 & Bit1) rightValue += ch2Value;
+				if (NR51 & Bit0) rightValue += ch1Value;
 			}
-			
-			m_updateTimeLeft -= timeStep;
+
+			Sint32 leftVolume = (NR50 >> 4) & 0x7;
+			leftValue = (leftValue * leftVolume) / 0xF;
+			Sint32 rightVolume = (NR50 >> 0) & 0x7;
+			rightValue = (rightValue * rightVolume) / 0xF;
 		}
 
-		if (false && (m_deviceId != 0) && (m_tracelogDumpTimer > 0.0f))
+		// Records any change in the mixed output at the current time
+		void UpdateOutputLevels()
 		{
-			FILE* pFile = nullptr;
-			fopen_s(&pFile, "soundlog.txt", "a");
-
-			SDL_LockAudioDevice(m_deviceId);
-			fwrite(m_traceLog.data(), m_traceLog.size(), 1, pFile);
-			SDL_UnlockAudioDevice(m_deviceId);
+			if (!m_synthesisEnabled)
+			{
+				return;
+			}
 
-			fclose(pFile);
+			Sint32 levels[kDeviceNumChannels];
+			ComputeOutputLevels(levels[0], levels[1]);
 
-			m_tracelogDumpTimer -= 2.0f;
+			for (int channel = 0; channel < kDeviceNumChannels; ++channel)
+			{
+				m_blipBuffers[channel].AddDelta(m_blipFrameCycle, levels[channel] - m_outputLevels[channel]);
+				m_outputLevels[channel] = levels[channel];
+			}
 		}
-	}
 
-	void FillStreamBuffer(Sint16* pBuffer, int numBytes)
-	{
-		SDL_assert(numBytes == kDeviceBufferByteSize);
-
-		m_audioDeviceActive = true;
-
-		if (m_numMonoSamplesAvailable >= kDeviceBufferNumMonoSamples)
-		{
-			//auto samplesInBuffer = m_numMonoSamplesAvailable - kDeviceBufferNumMonoSamples;
-			
-			//// If more than 75% full, drop frequency a bit; if less than 25% full, increase a bit.  This accounts for timekeeping drift between the sound card and this program.
-			//const float timeStepScale = 1.001f;
-			//const int max min
-			//if (samplesInBuffer >= (kDeviceBufferNumMonoSamples * 3 / 4))
-			//{
-			//	m_sampleTimeStep *= timeStepScale;
-			//}
-			//else if (samplesInBuffer >= (kDeviceBufferNumMonoSamples * 1 / 4))
-			//{
-			//	m_sampleTimeStep /= timeStepScale;
-			//}
-
-			//printf("Consumer: %d mono samples available; taking %d. ", m_numMonoSamplesAvailable, kDeviceBufferNumMonoSamples);
-			memcpy(pBuffer, m_backBuffers[m_nextBackBufferToTransfer], kDeviceBufferByteSize);
-			m_nextBackBufferToTransfer = (m_nextBackBufferToTransfer + 1) % 2;
-			m_numMonoSamplesAvailable -= kDeviceBufferNumMonoSamples;
+		bool IsBlipFrameFull() const
+		{
+			return m_blipFrameCycle == kMaxBlipFrameCycles;
 		}
-		else
+
+		// Makes everything synthesized so far available for reading
+		void EndBlipFrame()
 		{
-			//printf("Sound device starvation!\n");
-			memset(pBuffer, 0, kDeviceBufferByteSize);
+			for (int channel = 0; channel < kDeviceNumChannels; ++channel)
+			{
+				m_blipBuffers[channel].EndFrame(m_blipFrameCycle);
+			}
+			m_blipFrameCycle = 0;
 		}
 
-		//	static int logSkip = 0;
-		//	++logSkip;
-		//	if (logSkip % 32 == 0)
-		//	{
-		//		m_traceLog += Format("%4X %4X %4X %4X\n", 0, ch2Value & 0xFFFF, 0, 0);
-		//	}
+		int GetNumFramesAvailable() const
+		{
+			return m_blipBuffers[0].GetNumSamplesAvailable();
+		}
 
-		//	static float lpf = 0.0f;
-		//	static float lpAlpha = 0.9f;
-		//	lpf = ((1.0f - lpAlpha) * ch2Value) + (lpAlpha * lpf);
+		// Reads up to maxFrames interleaved stereo frames; returns the number read
+		int ReadFrames(Sint16* pFrames, int maxFrames)
+		{
+			int numFrames = 0;
+			for (int channel = 0; channel < kDeviceNumChannels; ++channel)
+			{
+				numFrames = m_blipBuffers[channel].ReadSamples(pFrames + channel, maxFrames, kDeviceNumChannels);
+			}
+			return numFrames;
+		}
 
-		//	static float hpAlpha = 0.7f;
-		//	static float lastLpf = 0.0f;
-		//	static float hpf = 0.0f;
-		//	hpf = (hpf + (lpf - lastLpf)) * hpAlpha;
-		//	lastLpf = lpf;
-	}
+		void DiscardFrames()
+		{
+			for (int channel = 0; channel < kDeviceNumChannels; ++channel)
+			{
+				m_blipBuffers[channel].DiscardSamples();
+			}
+		}
 
-	virtual bool HandleRequest(MemoryRequestType requestType, Uint16 address, Uint8& value)
-	{
-		if (ServiceMemoryRangeRequest(requestType, address, value, kWaveRamBase, kWaveRamSize, m_waveRam))
+		// Fine adjustment around the nominal rate, keeping what's buffered
+		void SetOutputSampleRate(double sampleRate)
 		{
-			return true;
+			for (int channel = 0; channel < kDeviceNumChannels; ++channel)
+			{
+				m_blipBuffers[channel].SetSampleRate(MemoryBus::kCyclesPerSecond, sampleRate);
+			}
 		}
-		else
+
+		// Register access only; the caller is responsible for running the APU up to the current time first
+		virtual bool HandleRequest(MemoryRequestType requestType, Uint16 address, Uint8& value)
 		{
+			bool handled = HandleRegisterRequest(requestType, address, value);
+			if (handled && (requestType == MemoryRequestType::Write))
+			{
+				UpdateOutputLevels();
+			}
+			return handled;
+		}
+
+		// Everything but the synthesized output; after loading, UpdateOutputLevels picks the output up from the new state
+		void SerializeState(StateSerializer& state)
+		{
+			state.Value(m_masterCounter);
+			state.Value(m_sequencerCounter);
+
+			m_ch1Sweep.SerializeState(state);
+			m_ch1Generator.SerializeState(state);
+			m_ch1LengthCounter.SerializeState(state);
+			m_ch1VolumeEnvelope.SerializeState(state);
+
+			m_ch2Generator.SerializeState(state);
+			m_ch2LengthCounter.SerializeState(state);
+			m_ch2VolumeEnvelope.SerializeState(state);
+
+			m_ch3Generator.SerializeState(state);
+			m_ch3LengthCounter.SerializeState(state);
+
+			m_ch4Generator.SerializeState(state);
+			m_ch4LengthCounter.SerializeState(state);
+			m_ch4VolumeEnvelope.SerializeState(state);
+
+			state.Value(NR10);
+			state.Value(NR11);
+			state.Value(NR12);
+			state.Value(NR13);
+			state.Value(NR14);
+			state.Value(NR21);
+			state.Value(NR22);
+			state.Value(NR23);
+			state.Value(NR24);
+			state.Value(NR30);
+			state.Value(NR31);
+			state.Value(NR32);
+			state.Value(NR33);
+			state.Value(NR34);
+			state.Value(NR41);
+			state.Value(NR42);
+			state.Value(NR43);
+			state.Value(NR44);
+			state.Value(NR50);
+			state.Value(NR51);
+			state.Value(NR52);
+			state.Value(m_waveRam);
+		}
+
+		// For bringing a freshly reset APU in step with another one
+		void CopyFrameSequencerPhase(const Apu& other)
+		{
+			m_masterCounter = other.m_masterCounter;
+			m_sequencerCounter = other.m_sequencerCounter;
+		}
+
+		// The value last written to a register, including the write-only bits a read leaves out
+		Uint8 GetWrittenValue(Uint16 address) const
+		{
+			if (IsAddressInRange(address, kWaveRamBase, kWaveRamSize))
+			{
+				return m_waveRam[address - kWaveRamBase];
+			}
+
 			switch (address)
 			{
-			case Registers::NR10:
-				{
-					if (requestType == MemoryRequestType::Read)
-					{
-						value = NR10 | 0x80;
-					}
-					else
-					{
-						NR10 = value;
-					}
-					return true;
-				}
-				break;
-			case Registers::NR11:
+			case Registers::NR10: return NR10;
+			case Registers::NR11: return NR11;
+			case Registers::NR12: return NR12;
+			case Registers::NR13: return NR13;
+			case Registers::NR14: return NR14;
+			case Registers::NR21: return NR21;
+			case Registers::NR22: return NR22;
+			case Registers::NR23: return NR23;
+			case Registers::NR24: return NR24;
+			case Registers::NR30: return NR30;
+			case Registers::NR31: return NR31;
+			case Registers::NR32: return NR32;
+			case Registers::NR33: return NR33;
+			case Registers::NR34: return NR34;
+			case Registers::NR41: return NR41;
+			case Registers::NR42: return NR42;
+			case Registers::NR43: return NR43;
+			case Registers::NR44: return NR44;
+			case Registers::NR50: return NR50;
+			case Registers::NR51: return NR51;
+			case Registers::NR52: return NR52;
+			}
+			return 0;
+		}
+
+	private:
+		bool HandleRegisterRequest(MemoryRequestType requestType, Uint16 address, Uint8& value)
+		{
+			if (ServiceMemoryRangeRequest(requestType, address, value, kWaveRamBase, kWaveRamSize, m_waveRam))
+			{
+				return true;
+			}
+			else
+			{
+				switch (address)
 				{
-					if (requestType == MemoryRequestType::Read)
+				case Registers::NR10:
 					{
-						value = NR11 | 0x3F;
+						if (requestType == MemoryRequestType::Read)
+						{
+							value = NR10 | 0x80;
+						}
+						else
+						{
+							NR10 = value;
+						}
+						return true;
 					}
-					else
+					break;
+				case Registers::NR11:
 					{
-						NR11 = value;
+						if (requestType == MemoryRequestType::Read)
+						{
+							value = NR11 | 0x3F;
+						}
+						else
+						{
+							NR11 = value;
 
-						m_ch1LengthCounter.ResetLength();
+							m_ch1LengthCounter.ResetLength();
+						}
+						return true;
 					}
-					return true;
-				}
-				break;
-			case Registers::NR12:
-				{
-					if (requestType == MemoryRequestType::Read)
+					break;
+				case Registers::NR12:
 					{
-						value = NR12 | 0x00;
+						if (requestType == MemoryRequestType::Read)
+						{
+							value = NR12 | 0x00;
+						}
+						else
+						{
+							NR12 = value;
+						}
+						return true;
 					}
-					else
+					break;
+				case Registers::NR13:
 					{
-						NR12 = value;
-					}
-					return true;
-				}
-				break;
-			case Registers::NR13:
-				{
-					if (requestType == MemoryRequestType::Read)
-					{
-						value = NR13 | 0xFF;
-					}
-					else
-					{
-						NR13 = value;
-					}
-					return true;
-				}
-				break;
-			case Registers::NR14:
-				{
-					if (requestType == MemoryRequestType::Read)
-					{
-						value = NR14 | 0xBF;
+						if (requestType == MemoryRequestType::Read)
+						{
+							value = NR13 | 0xFF;
+						}
+						else
+						{
+							NR13 = value;
+						}
+						return true;
 					}
-					else
+					break;
+				case Registers::NR14:
 					{
-						NR14 = value;
-
-						if (NR14 & Bit7)
+						if (requestType == MemoryRequestType::Read)
 						{
-							// Channel is now enabled
-							m_ch1Sweep.Reset();
-							m_ch1Generator.Reset();
-							m_ch1LengthCounter.Enable();
-							m_ch1VolumeEnvelope.Reset();
+							value = NR14 | 0xBF;
 						}
-					}
-					return true;
-				}
-				break;
+						else
+						{
+							NR14 = value;
 
-			case Registers::NR21:
-				{
-					if (requestType == MemoryRequestType::Read)
-					{
-						value = NR21 | 0x3F;
+							if (NR14 & Bit7)
+							{
+								// Channel is now enabled
+								m_ch1Sweep.Reset();
+								m_ch1Generator.Reset();
+								m_ch1LengthCounter.Enable();
+								m_ch1VolumeEnvelope.Reset();
+							}
+						}
+						return true;
 					}
-					else
-					{
-						NR21 = value;
+					break;
 
-						m_ch2LengthCounter.ResetLength();
-					}
-					return true;
-				}
-				break;
-			case Registers::NR22:
-				{
-					if (requestType == MemoryRequestType::Read)
+				case Registers::NR21:
 					{
-						value = NR22 | 0x00;
+						if (requestType == MemoryRequestType::Read)
+						{
+							value = NR21 | 0x3F;
+						}
+						else
+						{
+							NR21 = value;
+
+							m_ch2LengthCounter.ResetLength();
+						}
+						return true;
 					}
-					else
+					break;
+				case Registers::NR22:
 					{
-						NR22 = value;
+						if (requestType == MemoryRequestType::Read)
+						{
+							value = NR22 | 0x00;
+						}
+						else
+						{
+							NR22 = value;
+						}
+						return true;
 					}
-					return true;
-				}
-				break;
-			case Registers::NR23:
-				{
-					if (requestType == MemoryRequestType::Read)
+					break;
+				case Registers::NR23:
 					{
-						value = NR23 | 0xFF;
+						if (requestType == MemoryRequestType::Read)
+						{
+							value = NR23 | 0xFF;
+						}
+						else
+						{
+							NR23 = value;
+						}
+						return true;
 					}
-					else
+					break;
+				case Registers::NR24:
 					{
-						NR23 = value;
+						if (requestType == MemoryRequestType::Read)
+						{
+							value = NR24 | 0xBF;
+						}
+						else
+						{
+							NR24 = value;
+
+							if (NR24 & Bit7)
+							{
+								// Channel is now enabled
+								m_ch2Generator.Reset();
+								m_ch2LengthCounter.Enable();
+								m_ch2VolumeEnvelope.Reset();
+							}
+						}
+						return true;
 					}
-					return true;
-				}
-				break;
-			case Registers::NR24:
-				{
-					if (requestType == MemoryRequestType::Read)
+					break;
+
+				case Registers::NR30:
 					{
-						value = NR24 | 0xBF;
+						if (requestType == MemoryRequestType::Read)
+						{
+							value = NR30 | 0x7F;
+						}
+						else
+						{
+							NR30 = value;
+						}
+						return true;
 					}
-					else
+					break;
+				case Registers::NR31:
 					{
-						NR24 = value;
-
-						if (NR24 & Bit7)
+						if (requestType == MemoryRequestType::Read)
 						{
-							// Channel is now enabled
-							m_ch2Generator.Reset();
-							m_ch2LengthCounter.Enable();
-							m_ch2VolumeEnvelope.Reset();
+							value = NR31 | 0xFF;
 						}
-					}
-					return true;
-				}
-				break;
+						else
+						{
+							NR31 = value;
 
-			case Registers::NR30:
-				{
-					if (requestType == MemoryRequestType::Read)
-					{
-						value = NR30 | 0x7F;
+							m_ch3LengthCounter.ResetLength();
+						}
+						return true;
 					}
-					else
+					break;
+				case Registers::NR32:
 					{
-						NR30 = value;
+						if (requestType == MemoryRequestType::Read)
+						{
+							value = NR32 | 0x9F;
+						}
+						else
+						{
+							NR32 = value;
+						}
+						return true;
 					}
-					return true;
-				}
-				break;
-			case Registers::NR31:
-				{
-					if (requestType == MemoryRequestType::Read)
+					break;
+				case Registers::NR33:
 					{
-						value = NR31 | 0xFF;
+						if (requestType == MemoryRequestType::Read)
+						{
+							value = NR33 | 0xFF;
+						}
+						else
+						{
+							NR33 = value;
+						}
+						return true;
 					}
-					else
+					break;
+				case Registers::NR34:
 					{
-						NR31 = value;
+						if (requestType == MemoryRequestType::Read)
+						{
+							value = NR34 | 0xBF;
+						}
+						else
+						{
+							NR34 = value;
 
-						m_ch3LengthCounter.ResetLength();
-					}
-					return true;
-				}
-				break;
-			case Registers::NR32:
-				{
-					if (requestType == MemoryRequestType::Read)
-					{
-						value = NR32 | 0x9F;
+							if (NR34 & Bit7)
+							{
+								// Channel is now enabled
+								m_ch3Generator.Reset();
+								m_ch3LengthCounter.Enable();
+							}
+						}
+						return true;
 					}
-					else
+					break;
+
+				case Registers::NR41:
 					{
-						NR32 = value;
+						if (requestType == MemoryRequestType::Read)
+						{
+							value = NR41 | 0xFF;
+						}
+						else
+						{
+							NR41 = value;
+
+							m_ch4LengthCounter.ResetLength();
+						}
+						return true;
 					}
-					return true;
-				}
-				break;
-			case Registers::NR33:
-				{
-					if (requestType == MemoryRequestType::Read)
+					break;
+				case Registers::NR42:
 					{
-						value = NR33 | 0xFF;
+						if (requestType == MemoryRequestType::Read)
+						{
+							value = NR42 | 0x00;
+						}
+						else
+						{
+							NR42 = value;
+						}
+						return true;
 					}
-					else
+					break;
+				case Registers::NR43:
 					{
-						NR33 = value;
+						if (requestType == MemoryRequestType::Read)
+						{
+							value = NR43 | 0x00;
+						}
+						else
+						{
+							NR43 = value;
+						}
+						return true;
 					}
-					return true;
-				}
-				break;
-			case Registers::NR34:
-				{
-					if (requestType == MemoryRequestType::Read)
+					break;
+				case Registers::NR44:
 					{
-						value = NR34 | 0xBF;
+						if (requestType == MemoryRequestType::Read)
+						{
+							value = NR44 | 0xBF;
+						}
+						else
+						{
+							NR44 = value;
+
+							if (NR44 & Bit7)
+							{
+								// Channel is now enabled
+								m_ch4Generator.Reset();
+								m_ch4LengthCounter.Enable();
+								m_ch4VolumeEnvelope.Reset();
+							}
+						}
+						return true;
 					}
-					else
+					break;
+				SERVICE_MMR_RW(NR50)
+				SERVICE_MMR_RW(NR51)
+				case Registers::NR52:
 					{
-						NR34 = value;
-
-						if (NR34 & Bit7)
+						if (requestType == MemoryRequestType::Read)
 						{
-							// Channel is now enabled
-							m_ch3Generator.Reset();
-							m_ch3LengthCounter.Enable();
+							value = NR52
+								| (m_ch1LengthCounter.IsChannelEnabled() ? Bit0 : 0)
+								| (m_ch2LengthCounter.IsChannelEnabled() ? Bit1 : 0)
+								| (m_ch3LengthCounter.IsChannelEnabled() ? Bit2 : 0)
+								| (m_ch4LengthCounter.IsChannelEnabled() ? Bit3 : 0);
 						}
+						else
+						{
+							NR52 = value & Bit7;
+						}
+						return true;
 					}
-					return true;
+					break;
 				}
-				break;
+			}
+	
+			return false;
+		}
+
+		bool m_synthesisEnabled;
+		Uint16 m_masterCounter;
+		Uint16 m_sequencerCounter;
+
+		Uint32 m_blipFrameCycle;
+		BlipBuffer m_blipBuffers[kDeviceNumChannels];
+		Sint32 m_outputLevels[kDeviceNumChannels];
+
+		FrequencySweep m_ch1Sweep;
+		SquareWaveGenerator m_ch1Generator;
+		LengthCounter m_ch1LengthCounter;
+		VolumeEnvelope m_ch1VolumeEnvelope;
+
+		SquareWaveGenerator m_ch2Generator;
+		LengthCounter m_ch2LengthCounter;
+		VolumeEnvelope m_ch2VolumeEnvelope;
+	
+		WavetableGenerator m_ch3Generator;
+		LengthCounter m_ch3LengthCounter;
+	
+		NoiseGenerator m_ch4Generator;
+		LengthCounter m_ch4LengthCounter;
+		VolumeEnvelope m_ch4VolumeEnvelope;
+
+		Uint8 NR10;
+		Uint8 NR11;
+		Uint8 NR12;
+		Uint8 NR13;
+		Uint8 NR14;
+
+		Uint8 NR21;
+		Uint8 NR22;
+		Uint8 NR23;
+		Uint8 NR24;
+
+		Uint8 NR30;
+		Uint8 NR31;
+		Uint8 NR32;
+		Uint8 NR33;
+		Uint8 NR34;
+
+		Uint8 NR41;
+		Uint8 NR42;
+		Uint8 NR43;
+		Uint8 NR44;
+
+		Uint8 NR50;
+		Uint8 NR51;
+		Uint8 NR52;
+
+		Uint8 m_waveRam[kWaveRamSize];
+	};
+
+	// One logged APU register write, or the end of an emulation slice, for the synthesis thread to replay
+	struct LoggedWrite
+	{
+		Uint32 cycles; // since the previous record
+		Uint16 address;
+		Uint8 value;
+	};
+
+	// Not an APU register
+	static const Uint16 kEndOfSliceAddress = 0;
+
+	Sound()
+		: m_apu(true)
+		, m_shadowApu(false)
+		, m_outputSampleRate(kDefaultOutputSampleRate)
+		, m_resamplerQuality(ResamplerQuality::Fast)
+		, m_synthesisEnabled(true)
+		, m_outputRateRatio(1.0)
+		, m_sliceFrames(0)
+		, m_synthesisThreadQuit(false)
+		, m_synthesisThreadBusy(false)
+		, m_recordedCycles(0)
+		, m_speculating(false)
+	{
+		Reset();
+	}
+
+	~Sound()
+	{
+		SetSynthesisThreadEnabled(false);
+	}
+
+	// Where synthesized audio goes; with no sink it's discarded, but the APU still runs, so register reads stay accurate
+	void SetAudioSink(std::shared_ptr<IAudioSink> pSink)
+	{
+		// The sink is fed from the synthesis thread, so the thread has to be out of the way while it's swapped
+		bool synthesisThreadEnabled = IsSynthesisThreadEnabled();
+		SetSynthesisThreadEnabled(false);
+
+		m_pSink = pSink;
+		if (m_pSink)
+		{
+			m_pSink->SetSampleRate(m_outputSampleRate);
+		}
+		m_sliceFrames = 0;
+		SetOutputRateRatio(1.0);
+
+		SetSynthesisThreadEnabled(synthesisThreadEnabled);
+	}
+
+	const std::shared_ptr<IAudioSink>& GetAudioSink() const
+	{
+		return m_pSink;
+	}
+
+	// In Hz, e.g. 22050, 44100, 48000 or 96000.  The sink is reconfigured for it.
+	void SetOutputSampleRate(int sampleRate)
+	{
+		if (sampleRate != m_outputSampleRate)
+		{
+			m_outputSampleRate = sampleRate;
+			ConfigureOutput();
+		}
+	}
+
+	int GetOutputSampleRate() const
+	{
+		return m_outputSampleRate;
+	}
+
+	// Trades output quality for synthesis cost; batch runs that only need something recognizable can use Fast
+	void SetResamplerQuality(ResamplerQuality quality)
+	{
+		if (quality != m_resamplerQuality)
+		{
+			m_resamplerQuality = quality;
+			ConfigureOutput();
+		}
+	}
+
+	ResamplerQuality GetResamplerQuality() const
+	{
+		return m_resamplerQuality;
+	}
+
+	void Reset()
+	{
+		bool synthesisThreadEnabled = IsSynthesisThreadEnabled();
+		SetSynthesisThreadEnabled(false);
+
+		if (m_pRegisterLog)
+		{
+			m_pRegisterLog->Reset(m_recordedCycles);
+		}
+		m_recordedCycles = 0;
+
+		m_pendingCycles = 0;
+		m_pendingTimeLeft = 0.0f;
+		m_loggedCycles = 0;
+		m_writeLog.clear();
 
-			case Registers::NR41:
+		m_apu.Reset();
+		m_shadowApu.Reset();
+		m_resampler.Reset();
+
+		if (m_pSink)
+		{
+			m_pSink->Reset();
+		}
+		m_sliceFrames = 0;
+		SetOutputRateRatio(1.0);
+
+		m_tracelogDumpTimer = 0.0f;
+		m_traceLog.clear();
+
+		SetSynthesisThreadEnabled(synthesisThreadEnabled);
+	}
+
+	// Only accounts for the time; the channels are synthesized lazily, when a register is accessed or in EndTimeSlice
+	void Update(float seconds)
+	{
+		m_pendingTimeLeft += seconds * MemoryBus::kCyclesPerSecond;
+		Uint32 cycles = static_cast<Uint32>(m_pendingTimeLeft);
+		m_pendingCycles += cycles;
+		m_pendingTimeLeft -= cycles;
+
+		m_tracelogDumpTimer += seconds;
+
+		if (false && (m_tracelogDumpTimer > 0.0f))
+		{
+			FILE* pFile = nullptr;
+			fopen_s(&pFile, "soundlog.txt", "a");
+
+			fwrite(m_traceLog.data(), m_traceLog.size(), 1, pFile);
+
+			fclose(pFile);
+
+			m_tracelogDumpTimer -= 2.0f;
+		}
+	}
+
+	// Synthesizes everything up to the current time and sends it to the audio sink; called once per emulation slice.
+	// With the synthesis thread enabled, this only hands the slice's register writes over to it.
+	void EndTimeSlice()
+	{
+		CatchUp();
+
+		if (m_pRegisterLog)
+		{
+			m_pRegisterLog->EndSlice(m_recordedCycles);
+			m_recordedCycles = 0;
+		}
+
+		if (!m_synthesisEnabled)
+		{
+			return;
+		}
+		else if (IsSynthesisThreadEnabled())
+		{
+			LoggedWrite endOfSlice = { m_loggedCycles, kEndOfSliceAddress, 0 };
+			m_writeLog.push_back(endOfSlice);
+			m_loggedCycles = 0;
+			SubmitWriteLog();
+		}
+		else
+		{
+			OutputSamples();
+			EndOutputSlice();
+		}
+	}
+
+	// Output samples produced per nominal output sample, as last requested by the sink
+	double GetOutputRateRatio() const
+	{
+		return m_outputRateRatio;
+	}
+
+	// With synthesis disabled, only the register side of the APU runs: the frame sequencer keeps length counters, envelopes and the
+	// sweep going on their 512 Hz schedule, so NR52's status bits and everything else a game can poll behave exactly as before, but
+	// no waveforms are generated and nothing reaches the sink.  This costs next to nothing, for headless runs that don't need audio.
+	// The synthesis thread is stopped meanwhile.  On re-enabling, the registers are restored as last written without retriggering
+	// any channel, so notes already playing stay silent until they're next triggered.
+	void SetSynthesisEnabled(bool enabled)
+	{
+		if (enabled == m_synthesisEnabled)
+		{
+			return;
+		}
+
+		SetSynthesisThreadEnabled(false);
+		CatchUp();
+		m_synthesisEnabled = enabled;
+
+		if (enabled)
+		{
+			m_apu.Reset();
+			m_apu.CopyFrameSequencerPhase(m_shadowApu);
+
+			std::vector<LoggedWrite> writes;
+			GetRegisterState(writes);
+			for (size_t i = 0; i < writes.size(); ++i)
+			{
+				m_apu.HandleRequest(MemoryRequestType::Write, writes[i].address, writes[i].value);
+			}
+
+			m_resampler.Reset();
+			if (m_pSink)
+			{
+				m_pSink->Reset();
+			}
+			m_sliceFrames = 0;
+		}
+	}
+
+	bool IsSynthesisEnabled() const
+	{
+		return m_synthesisEnabled;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Save states
+	///////////////////////////////////////////////////////////////////////////
+
+	// The APU's state as emulation sees it, plus the waveform generators' positions when synthesizing inline.  With the synthesis
+	// thread running, the synthesizing APU lags behind, so the shadow APU is saved instead: the registers and everything derived
+	// from them are exact, but the waveforms restart from wherever the shadow left them.  Loading stops and restarts the thread,
+	// so for the fastest loads, synthesize inline or not at all.
+	void SerializeState(StateSerializer& state)
+	{
+		if (!state.IsLoading())
+		{
+			CatchUp();
+			state.Value(m_pendingTimeLeft);
+			bool synthesizingInline = m_synthesisEnabled && !IsSynthesisThreadEnabled();
+			(synthesizingInline ? m_apu : m_shadowApu).SerializeState(state);
+			return;
+		}
+
+		if (m_speculating)
+		{
+			// Back to where speculation started: the synthesizing side never left, so only the shadow needs loading
+			CatchUp();
+			state.Value(m_pendingTimeLeft);
+			m_shadowApu.SerializeState(state);
+			return;
+		}
+
+		bool synthesisThreadEnabled = IsSynthesisThreadEnabled();
+		SetSynthesisThreadEnabled(false);
+		CatchUp();
+
+		state.Value(m_pendingTimeLeft);
+		size_t apuStatePosition = state.GetPosition();
+		m_shadowApu.SerializeState(state);
+		state.SetPosition(apuStatePosition);
+		m_apu.SerializeState(state);
+
+		// The blip buffers keep what was synthesized before the load, and the output steps from there to the loaded level
+		m_apu.UpdateOutputLevels();
+
+		// A register log carries on from the loaded registers, as when it's attached mid-run
+		if (m_pRegisterLog)
+		{
+			SetRegisterLog(m_pRegisterLog);
+		}
+
+		SetSynthesisThreadEnabled(synthesisThreadEnabled);
+	}
+
+	// For emulation that's going to be thrown away, as in run-ahead: only the shadow APU follows along, so reads stay exact, while the
+	// synthesizing APU, the synthesis thread and the register log stay where they were.  End it by loading the state saved when it
+	// started, then turning it off.
+	void SetSpeculating(bool speculating)
+	{
+		if (speculating)
+		{
+			CatchUp();
+		}
+		m_speculating = speculating;
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Synthesis thread
+	///////////////////////////////////////////////////////////////////////////
+
+	// When enabled, register writes are logged with their cycle timestamps and the channels are synthesized on a worker thread,
+	// one emulation slice behind.  Reads (NR52's channel status bits in particular) are answered right away by a shadow APU that
+	// only runs the frame sequencer.  The output is identical to inline synthesis.
+	void SetSynthesisThreadEnabled(bool enabled)
+	{
+		if ((enabled == m_synthesisThread.joinable()) || (enabled && !m_synthesisEnabled))
+		{
+			return;
+		}
+
+		if (enabled)
+		{
+			// Synthesize inline up to now, so the log starts where the thread picks up
+			CatchUp();
+
+			m_synthesisThreadQuit = false;
+			m_synthesisThreadBusy = false;
+			m_loggedCycles = 0;
+			m_synthesisThread = std::thread(&Sound::SynthesisThreadMain, this);
+		}
+		else
+		{
+			// Let the thread replay what's been logged, then carry on inline from there
+			CatchUp();
+			SubmitWriteLog();
+
+			{
+				std::lock_guard<std::mutex> lock(m_synthesisMutex);
+				m_synthesisThreadQuit = true;
+			}
+			m_writesAvailable.notify_one();
+			m_synthesisThread.join();
+
+			RunSynthesis(m_loggedCycles);
+			m_loggedCycles = 0;
+		}
+	}
+
+	bool IsSynthesisThreadEnabled() const
+	{
+		return m_synthesisThread.joinable();
+	}
+
+	// Blocks until everything submitted so far has been synthesized; for consumers that can't tolerate the extra slice of latency
+	void WaitForSynthesisThread()
+	{
+		if (!m_synthesisThread.joinable())
+		{
+			return;
+		}
+
+		std::unique_lock<std::mutex> lock(m_synthesisMutex);
+		while (!m_submittedWrites.empty() || m_synthesisThreadBusy)
+		{
+			m_writesReplayed.wait(lock);
+		}
+	}
+
+	void SubmitWriteLog()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_synthesisMutex);
+			m_submittedWrites.insert(m_submittedWrites.end(), m_writeLog.begin(), m_writeLog.end());
+		}
+		m_writeLog.clear();
+		m_writesAvailable.notify_one();
+	}
+
+	void SynthesisThreadMain()
+	{
+		std::vector<LoggedWrite> writes;
+		for (;;)
+		{
+			{
+				std::unique_lock<std::mutex> lock(m_synthesisMutex);
+				while (m_submittedWrites.empty() && !m_synthesisThreadQuit)
 				{
-					if (requestType == MemoryRequestType::Read)
-					{
-						value = NR41 | 0xFF;
-					}
-					else
-					{
-						NR41 = value;
+					m_writesAvailable.wait(lock);
+				}
 
-						m_ch4LengthCounter.ResetLength();
-					}
-					return true;
+				// Everything submitted before the quit request still gets replayed
+				if (m_submittedWrites.empty())
+				{
+					return;
 				}
-				break;
-			case Registers::NR42:
+
+				writes.swap(m_submittedWrites);
+				m_synthesisThreadBusy = true;
+			}
+
+			for (size_t i = 0; i < writes.size(); ++i)
+			{
+				const LoggedWrite& write = writes[i];
+				RunSynthesis(write.cycles);
+
+				if (write.address == kEndOfSliceAddress)
 				{
-					if (requestType == MemoryRequestType::Read)
-					{
-						value = NR42 | 0x00;
-					}
-					else
-					{
-						NR42 = value;
-					}
-					return true;
+					OutputSamples();
+					EndOutputSlice();
 				}
-				break;
-			case Registers::NR43:
+				else
 				{
-					if (requestType == MemoryRequestType::Read)
-					{
-						value = NR43 | 0x00;
-					}
-					else
-					{
-						NR43 = value;
-					}
-					return true;
+					Uint8 value = write.value;
+					m_apu.HandleRequest(MemoryRequestType::Write, write.address, value);
 				}
+			}
+			writes.clear();
+
+			{
+				std::lock_guard<std::mutex> lock(m_synthesisMutex);
+				m_synthesisThreadBusy = false;
+			}
+			m_writesReplayed.notify_all();
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Register log
+	///////////////////////////////////////////////////////////////////////////
+
+	// Records every register and wave RAM write from now on into the log, with its cycle timestamp, along with resets and slice
+	// ends.  Attached mid-run, the log opens with the current register values; channels that are already playing then stay silent
+	// until they're next triggered, so attach before a reset for a log that replays exactly.  nullptr stops recording.
+	void SetRegisterLog(std::shared_ptr<ApuLogWriter> pLog)
+	{
+		CatchUp();
+		m_pRegisterLog = pLog;
+		m_recordedCycles = 0;
+
+		if (m_pRegisterLog)
+		{
+			std::vector<LoggedWrite> writes;
+			GetRegisterState(writes);
+			for (size_t i = 0; i < writes.size(); ++i)
+			{
+				m_pRegisterLog->Write(0, writes[i].address, writes[i].value);
+			}
+		}
+	}
+
+	const std::shared_ptr<ApuLogWriter>& GetRegisterLog() const
+	{
+		return m_pRegisterLog;
+	}
+
+	// Replays a recorded log up to its next slice end, which is output to the sink just as the recording run's was; with the same
+	// output settings, the samples are identical.  Returns false at the end of the log.
+	bool ReplayRegisterLogSlice(ApuLogReader& log)
+	{
+		ApuLogReader::Event event;
+		while (log.ReadEvent(event))
+		{
+			m_pendingCycles += event.cycles;
+			switch (event.type)
+			{
+			case ApuLogReader::EventType::Write:
+				HandleRequest(MemoryRequestType::Write, event.address, event.value);
 				break;
-			case Registers::NR44:
-				{
-					if (requestType == MemoryRequestType::Read)
-					{
-						value = NR44 | 0xBF;
-					}
-					else
-					{
-						NR44 = value;
+			case ApuLogReader::EventType::Reset:
+				// The recording run had synthesized up to the reset, which matters if a blip frame filled up in the meantime
+				CatchUp();
+				Reset();
+				break;
+			case ApuLogReader::EventType::EndOfSlice:
+				EndTimeSlice();
+				return true;
+			}
+		}
+		return false;
+	}
 
-						if (NR44 & Bit7)
-						{
-							// Channel is now enabled
-							m_ch4Generator.Reset();
-							m_ch4LengthCounter.Enable();
-							m_ch4VolumeEnvelope.Reset();
-						}
-					}
-					return true;
-				}
+	// The registers as they were last written, as writes that bring a reset APU back to them: power and wave RAM first, and channel
+	// registers without their trigger bits
+	void GetRegisterState(std::vector<LoggedWrite>& writes) const
+	{
+		static const Registers::Type kRegisters[] =
+		{
+			Registers::NR52, Registers::NR50, Registers::NR51,
+			Registers::NR10, Registers::NR11, Registers::NR12, Registers::NR13, Registers::NR14,
+			Registers::NR21, Registers::NR22, Registers::NR23, Registers::NR24,
+			Registers::NR30, Registers::NR31, Registers::NR32, Registers::NR33, Registers::NR34,
+			Registers::NR41, Registers::NR42, Registers::NR43, Registers::NR44,
+		};
+
+		writes.clear();
+		for (size_t i = 0; i < ARRAY_SIZE(kRegisters); ++i)
+		{
+			LoggedWrite write = { 0, static_cast<Uint16>(kRegisters[i]), m_shadowApu.GetWrittenValue(static_cast<Uint16>(kRegisters[i])) };
+			switch (write.address)
+			{
+			case Registers::NR14:
+			case Registers::NR24:
+			case Registers::NR34:
+			case Registers::NR44:
+				write.value &= ~Bit7;
 				break;
-			SERVICE_MMR_RW(NR50)
-			SERVICE_MMR_RW(NR51)
-			case Registers::NR52:
+			}
+			writes.push_back(write);
+
+			if (kRegisters[i] == Registers::NR51)
+			{
+				for (Uint16 waveAddress = kWaveRamBase; waveAddress < kWaveRamBase + kWaveRamSize; ++waveAddress)
 				{
-					if (requestType == MemoryRequestType::Read)
-					{
-						value = NR52
-							| (m_ch1LengthCounter.IsChannelEnabled() ? Bit0 : 0)
-							| (m_ch2LengthCounter.IsChannelEnabled() ? Bit1 : 0)
-							| (m_ch3LengthCounter.IsChannelEnabled() ? Bit2 : 0)
-							| (m_ch4LengthCounter.IsChannelEnabled() ? Bit3 : 0);
-					}
-					else
-					{
-						NR52 = value & Bit7;
-					}
-					return true;
+					LoggedWrite waveWrite = { 0, waveAddress, m_shadowApu.GetWrittenValue(waveAddress) };
+					writes.push_back(waveWrite);
 				}
-				break;
 			}
 		}
-	
-		return false;
 	}
 
-#ifdef NDEBUG
-#pragma optimize("", on)
-#endif
+	///////////////////////////////////////////////////////////////////////////
+	// Synthesis; runs on the emulation thread, or on the synthesis thread when enabled
+	///////////////////////////////////////////////////////////////////////////
 
-private:
-	float m_updateTimeLeft;
-	float m_sampleTimeLeft;
+	// Runs the synthesizing APU, collecting its output whenever the blip frame fills up
+	void RunSynthesis(Uint32 cycles)
+	{
+		while (cycles > 0)
+		{
+			cycles -= m_apu.RunCycles(cycles);
+			if (m_apu.IsBlipFrameFull())
+			{
+				OutputSamples();
+			}
+		}
+	}
+
+	// Hands the finished samples over to the sink
+	void OutputSamples()
+	{
+		m_apu.EndBlipFrame();
+
+		if (!m_pSink || !m_pSink->IsReady())
+		{
+			m_apu.DiscardFrames();
+			return;
+		}
 
-	SDL_AudioDeviceID m_deviceId;
+		bool resampling = IsResampling();
+		while (m_apu.GetNumFramesAvailable() > 0)
+		{
+			int numFrames = m_apu.ReadFrames(m_sampleBatch, kSampleBatchFrames);
+			if (!resampling)
+			{
+				m_pSink->WriteFrames(m_sampleBatch, numFrames);
+				m_sliceFrames += numFrames;
+				continue;
+			}
 
-	bool m_audioDeviceActive;
-	Uint16 m_masterCounter;
-	Uint16 m_sequencerCounter;
-	float m_sampleTimeStep;
+			m_resampler.Write(m_sampleBatch, numFrames);
+			while ((numFrames = m_resampler.Read(m_sampleBatch, kSampleBatchFrames)) > 0)
+			{
+				m_pSink->WriteFrames(m_sampleBatch, numFrames);
+				m_sliceFrames += numFrames;
+			}
+		}
+	}
 
-	FrequencySweep m_ch1Sweep;
-	SquareWaveGenerator m_ch1Generator;
-	LengthCounter m_ch1LengthCounter;
-	VolumeEnvelope m_ch1VolumeEnvelope;
+	// Lets the sink steer the output rate, once per slice
+	void EndOutputSlice()
+	{
+		double ratio = m_pSink ? m_pSink->EndSlice(m_sliceFrames) : 1.0;
+		m_sliceFrames = 0;
 
-	SquareWaveGenerator m_ch2Generator;
-	LengthCounter m_ch2LengthCounter;
-	VolumeEnvelope m_ch2VolumeEnvelope;
-	
-	WavetableGenerator m_ch3Generator;
-	LengthCounter m_ch3LengthCounter;
-	
-	NoiseGenerator m_ch4Generator;
-	LengthCounter m_ch4LengthCounter;
-	VolumeEnvelope m_ch4VolumeEnvelope;
-	
-	Uint8 NR10;
-	Uint8 NR11;
-	Uint8 NR12;
-	Uint8 NR13;
-	Uint8 NR14;
-
-	Uint8 NR21;
-	Uint8 NR22;
-	Uint8 NR23;
-	Uint8 NR24;
-
-	Uint8 NR30;
-	Uint8 NR31;
-	Uint8 NR32;
-	Uint8 NR33;
-	Uint8 NR34;
-
-	Uint8 NR41;
-	Uint8 NR42;
-	Uint8 NR43;
-	Uint8 NR44;
-
-	Uint8 NR50;
-	Uint8 NR51;
-	Uint8 NR52;
-
-	Uint8 m_waveRam[kWaveRamSize];
-
-	Uint32 m_numMonoSamplesAvailable;
-	Uint8 m_nextBackBufferToTransfer;
-	Uint16 m_backBuffers[2][kDeviceBufferNumMonoSamples];
+		if (ratio != m_outputRateRatio)
+		{
+			SetOutputRateRatio(ratio);
+		}
+	}
+
+	void SetOutputRateRatio(double ratio)
+	{
+		m_outputRateRatio = ratio;
+		if (IsResampling())
+		{
+			m_resampler.SetOutputRate(m_outputSampleRate * ratio);
+		}
+		else
+		{
+			m_apu.SetOutputSampleRate(m_outputSampleRate * ratio);
+		}
+	}
+
+	bool IsResampling() const
+	{
+		return m_resamplerQuality != ResamplerQuality::Fast;
+	}
+
+	// Applies the output rate and resampler quality.  Whatever was synthesized but not output yet is dropped.
+	void ConfigureOutput()
+	{
+		bool synthesisThreadEnabled = IsSynthesisThreadEnabled();
+		SetSynthesisThreadEnabled(false);
+
+		switch (m_resamplerQuality)
+		{
+		case ResamplerQuality::Balanced:
+			m_apu.SetRates(kNativeSampleRate);
+			m_resampler.Configure(kNativeSampleRate, m_outputSampleRate, 32, 6);
+			break;
+		case ResamplerQuality::High:
+			m_apu.SetRates(kNativeSampleRate);
+			m_resampler.Configure(kNativeSampleRate, m_outputSampleRate, 64, 8);
+			break;
+		default:
+			m_apu.SetRates(m_outputSampleRate);
+			break;
+		}
+
+		if (m_pSink)
+		{
+			m_pSink->SetSampleRate(m_outputSampleRate);
+		}
+		m_sliceFrames = 0;
+		SetOutputRateRatio(1.0);
+
+		SetSynthesisThreadEnabled(synthesisThreadEnabled);
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Emulation side
+	///////////////////////////////////////////////////////////////////////////
+
+	// Brings the APUs up to the current time.  The shadow APU always runs, so the synthesis thread can be switched on at any point.
+	void CatchUp()
+	{
+		m_shadowApu.RunCycles(m_pendingCycles);
+		if (m_speculating)
+		{
+			// Nothing to synthesize or record
+			m_pendingCycles = 0;
+			return;
+		}
+
+		m_recordedCycles += m_pendingCycles;
+		if (!m_synthesisEnabled)
+		{
+			// Nothing to synthesize
+		}
+		else if (IsSynthesisThreadEnabled())
+		{
+			m_loggedCycles += m_pendingCycles;
+		}
+		else
+		{
+			RunSynthesis(m_pendingCycles);
+		}
+		m_pendingCycles = 0;
+	}
+
+	virtual bool HandleRequest(MemoryRequestType requestType, Uint16 address, Uint8& value)
+	{
+		// Bring the channels up to the current time first, so the access lands at the right point in the waveform
+		CatchUp();
+
+		if (m_speculating)
+		{
+			return m_shadowApu.HandleRequest(requestType, address, value);
+		}
+
+		bool handled = false;
+		if (m_synthesisEnabled && !IsSynthesisThreadEnabled())
+		{
+			handled = m_apu.HandleRequest(requestType, address, value);
+			if (handled && (requestType == MemoryRequestType::Write))
+			{
+				Uint8 shadowValue = value;
+				m_shadowApu.HandleRequest(requestType, address, shadowValue);
+			}
+		}
+		else
+		{
+			// The synthesizing APU is on the synthesis thread, or idle
+			handled = m_shadowApu.HandleRequest(requestType, address, value);
+			if (handled && (requestType == MemoryRequestType::Write) && IsSynthesisThreadEnabled())
+			{
+				LoggedWrite write = { m_loggedCycles, address, value };
+				m_writeLog.push_back(write);
+				m_loggedCycles = 0;
+			}
+		}
+
+		if (handled && (requestType == MemoryRequestType::Write) && m_pRegisterLog)
+		{
+			m_pRegisterLog->Write(m_recordedCycles, address, value);
+			m_recordedCycles = 0;
+		}
+		return handled;
+	}
+
+#if defined(NDEBUG) && defined(_MSC_VER)
+#pragma optimize("", on)
+#endif
+
+private:
+	Uint32 m_pendingCycles; // emulated, but not synthesized yet
+	float m_pendingTimeLeft; // fraction of a cycle left over from Update
+
+	Apu m_apu; // synthesizes; owned by the synthesis thread while it runs
+	Apu m_shadowApu; // registers and frame sequencer only, always in step with emulation
+
+	std::shared_ptr<IAudioSink> m_pSink;
+	int m_outputSampleRate;
+	ResamplerQuality m_resamplerQuality;
+	bool m_synthesisEnabled;
+	AudioResampler m_resampler; // only used when the quality isn't Fast
+	Sint16 m_sampleBatch[kSampleBatchFrames * kDeviceNumChannels];
+	std::atomic<double> m_outputRateRatio;
+	Uint32 m_sliceFrames; // written to the sink since the last EndSlice
+
+	std::thread m_synthesisThread;
+	std::mutex m_synthesisMutex;
+	std::condition_variable m_writesAvailable;
+	std::condition_variable m_writesReplayed;
+	bool m_synthesisThreadQuit;
+	bool m_synthesisThreadBusy;
+	std::vector<LoggedWrite> m_writeLog; // emulation side, not submitted yet
+	std::vector<LoggedWrite> m_submittedWrites;
+	Uint32 m_loggedCycles; // since the last logged write
+
+	std::shared_ptr<ApuLogWriter> m_pRegisterLog;
+	Uint32 m_recordedCycles; // since the last event in the register log
+
+	bool m_speculating;
 
 	std::string m_traceLog;
 	float m_tracelogDumpTimer;
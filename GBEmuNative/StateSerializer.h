@@ -0,0 +1,102 @@
+#pragma once
+
+#include "Utils.h"
+
+#include "SDL.h"
+
+#include <string.h>
+#include <vector>
+
+// Save states are written and read by the same code: each component has a SerializeState(StateSerializer&) that hands its fields
+// to the serializer, which copies them out to a byte buffer when saving, and back in from it when loading.  Fields are raw copies,
+// with no per-field tags, so a state is only meant to be loaded by the build that saved it; GameBoy::kSaveStateVersion changes
+// whenever any component's fields do.
+class StateSerializer
+{
+public:
+	// Saving: appends to the buffer, which grows as needed
+	StateSerializer(std::vector<Uint8>& buffer)
+		: m_pBuffer(&buffer)
+		, m_pData(nullptr)
+		, m_size(0)
+		, m_position(buffer.size())
+	{
+	}
+
+	// Loading
+	StateSerializer(const Uint8* pData, size_t size)
+		: m_pBuffer(nullptr)
+		, m_pData(pData)
+		, m_size(size)
+		, m_position(0)
+	{
+	}
+
+	bool IsLoading() const
+	{
+		return m_pBuffer == nullptr;
+	}
+
+	// Plain data only: integers, floats, enums, and arrays and structs of those
+	template <typename T>
+	void Value(T& value)
+	{
+		Bytes(&value, sizeof(value));
+	}
+
+	void Bytes(void* pBytes, size_t size)
+	{
+		if (IsLoading())
+		{
+			if (size > m_size - m_position)
+			{
+				throw Exception("Save state is truncated");
+			}
+			memcpy(pBytes, m_pData + m_position, size);
+		}
+		else
+		{
+			const Uint8* pSource = static_cast<const Uint8*>(pBytes);
+			m_pBuffer->insert(m_pBuffer->end(), pSource, pSource + size);
+		}
+		m_position += size;
+	}
+
+	// The element count, then the elements; T is plain data
+	template <typename T>
+	void Vector(std::vector<T>& values)
+	{
+		Uint32 count = static_cast<Uint32>(values.size());
+		Value(count);
+		if (IsLoading())
+		{
+			if (count > (m_size - m_position) / sizeof(T))
+			{
+				throw Exception("Save state is truncated");
+			}
+			values.resize(count);
+		}
+		if (count > 0)
+		{
+			Bytes(values.data(), count * sizeof(T));
+		}
+	}
+
+	// Lets a loader read the same fields into more than one object
+	size_t GetPosition() const
+	{
+		return m_position;
+	}
+
+	void SetPosition(size_t position)
+	{
+		SDL_assert(IsLoading() && (position <= m_size));
+		m_position = position;
+	}
+
+private:
+	std::vector<Uint8>* m_pBuffer;
+	const Uint8* m_pData;
+	size_t m_size;
+	size_t m_position;
+};
@@ -6,12 +6,15 @@
 class Timer : public IMemoryBusDevice
 {
 public:
-	enum class Registers
+	struct Registers
 	{
-		DIV = 0xFF04,	// Divider register
-		TIMA = 0xFF05,	// Timer counter
-		TMA = 0xFF06,	// Timer modulo
-		TAC = 0xFF07,	// Timer control
+		enum Type
+		{
+			DIV = 0xFF04,	// Divider register
+			TIMA = 0xFF05,	// Timer counter
+			TMA = 0xFF06,	// Timer modulo
+			TAC = 0xFF07,	// Timer control
+		};
 	};
 
 	static int const kDivFrequency = 16384;
@@ -34,6 +37,16 @@ public:
 		TAC = 0;
 	}
 
+	void SerializeState(StateSerializer& state)
+	{
+		state.Value(m_DivTicksRemaining);
+		state.Value(m_TimaTicksRemaining);
+		state.Value(DIV);
+		state.Value(TIMA);
+		state.Value(TMA);
+		state.Value(TAC);
+	}
+
 	void Update(float seconds)
 	{
 		m_DivTicksRemaining += seconds * kDivFrequency;
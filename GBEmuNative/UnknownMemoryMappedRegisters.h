@@ -1,3 +1,5 @@
+#pragma once
+
 #include "IMemoryBusDevice.h"
 
 #include "Utils.h"
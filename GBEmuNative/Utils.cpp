@@ -1,51 +1,28 @@
 #include "Utils.h"
 
-SDL_Keycode DebugWaitForKeypress()
-{
-	SDL_Event event;
-	for (;;)
-	{
-		while (SDL_PollEvent(&event))
-		{
-			switch (event.type)
-			{
-			case SDL_KEYDOWN: return event.key.keysym.sym;
-			}
-		}
-		SDL_Delay(10);
-	}
-	return SDLK_UNKNOWN;
-}
-
-SDL_Keycode DebugCheckForKeypress()
-{
-	SDL_Event event;
-	while (SDL_PollEvent(&event))
-	{
-		switch (event.type)
-		{
-		case SDL_KEYDOWN: return event.key.keysym.sym;
-		}
-	}
-	return SDLK_UNKNOWN;
-}
+#include <chrono>
 
 void LoadFileAsByteArray(std::vector<Uint8>& output, const char* pFileName)
 {
-    SDL_RWops* pHandle = SDL_RWFromFile(pFileName, "rb");
-    
-	if (!pHandle)
+	FILE* pFile = nullptr;
+	fopen_s(&pFile, pFileName, "rb");
+	if (!pFile)
 	{
-        throw Exception("Failed to load file %s.", pFileName);
-    }
+		throw Exception("Failed to load file %s.", pFileName);
+	}
 
-	SDL_RWseek(pHandle, 0,  RW_SEEK_END);
-	int fileSize = static_cast<int>(SDL_RWtell(pHandle));
-	SDL_RWseek(pHandle, 0,  RW_SEEK_SET);
+	fseek(pFile, 0, SEEK_END);
+	long fileSize = ftell(pFile);
+	fseek(pFile, 0, SEEK_SET);
 
 	output.resize(fileSize);
-	SDL_RWread(pHandle, output.data(), fileSize, 1);
-    SDL_RWclose(pHandle);
+	size_t numBytesRead = fread(output.data(), 1, output.size(), pFile);
+	fclose(pFile);
+
+	if (numBytesRead != output.size())
+	{
+		throw Exception("Failed to read file %s.", pFileName);
+	}
 }
 
 std::shared_ptr<std::vector<Uint8>> LoadFileAsByteArray(const char* pFileName)
@@ -55,3 +32,16 @@ std::shared_ptr<std::vector<Uint8>> LoadFileAsByteArray(const char* pFileName)
 
 	return pData;
 }
+
+double GetHostSeconds()
+{
+#ifdef _WIN32
+	LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return static_cast<double>(counter.QuadPart) / frequency.QuadPart;
+#else
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
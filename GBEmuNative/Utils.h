@@ -3,12 +3,34 @@
 #include <functional>
 #include <vector>
 #include <memory>
+#include <string>
+#include <stdarg.h>
+#include <stdio.h>
+#include <errno.h>
 
 #include "SDL.h"
+
+#ifdef _WIN32
 #include <Windows.h>
+#else
+// Stand-ins for the MSVC "secure" CRT functions, so the core builds with other compilers
+inline int vsnprintf_s(char* pBuffer, size_t bufferSize, const char* pFormatter, va_list args)
+{
+	return vsnprintf(pBuffer, bufferSize, pFormatter, args);
+}
+
+inline int fopen_s(FILE** ppFile, const char* pFileName, const char* pMode)
+{
+	*ppFile = fopen(pFileName, pMode);
+	return *ppFile ? 0 : errno;
+}
+#endif
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
 
+// Turns an integer into a distinct type, to overload on it
+template <int N> struct Int2Type {};
+
 //@TODO: bit manipulation utils
 enum
 {
@@ -47,9 +69,23 @@ inline bool IsAddressInRange(Uint16 address, Uint16 base, Uint16 rangeSize)
 	return (address >= base) && (address < base + rangeSize);
 }
 
+// FNV-1a, continuing from 'hash'; for telling runs apart, not for security
+inline Uint32 HashBytes(const void* pBytes, size_t size, Uint32 hash = 2166136261u)
+{
+	const Uint8* p = static_cast<const Uint8*>(pBytes);
+	for (size_t i = 0; i < size; ++i)
+	{
+		hash = (hash ^ p[i]) * 16777619u;
+	}
+	return hash;
+}
+
 void LoadFileAsByteArray(std::vector<Uint8>& output, const char* pFileName);
 std::shared_ptr<std::vector<Uint8>> LoadFileAsByteArray(const char* pFileName);
 
+// Seconds from an arbitrary starting point, from the best clock the host has; only differences are meaningful
+double GetHostSeconds();
+
 inline std::string Format(const char* pFormatter, ...)
 {
 	va_list args;
@@ -132,15 +168,20 @@ inline void SetForegroundConsoleColor()
 class ProcessConsole
 {
 public:
+	// Only Windows GUI applications start without a console
 	ProcessConsole()
 	{
+#ifdef _WIN32
 		AllocConsole();
 		FILE* pFile;
 		freopen_s(&pFile, "CON", "w", stdout);
+#endif
 	}
 
 	~ProcessConsole()
 	{
+#ifdef _WIN32
 		FreeConsole();
+#endif
 	}
 };
@@ -0,0 +1,343 @@
+#pragma once
+
+#include "GameBoy.h"
+#include "WorkStealingPool.h"
+#include "Utils.h"
+
+#include "SDL.h"
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Runs many copies of one game side by side, for reinforcement learning.  Each Step hands every instance its buttons, runs them all
+// forward on a thread pool, and leaves the results in flat arrays with one entry per instance: the observations (the frame as
+// Gray8 and/or chosen bytes of memory), the rewards and the episode-over flags.  A trainer makes one call per step for the whole
+// batch, and reads the arrays in place.
+//
+// An instance whose episode ends is put back to the reset point (a save state plus the frame that went with it) within the same
+// Step, so its observation is already the first one of its next episode, and its flag says the reward was the last of the old one.
+//
+// Identical instances are emulated once.  After Reset they're all in the same state.  Instances in the same state that are given
+// the same buttons stay in the same state, so only the first of them is emulated, and the rest load the state it ends up in.  Once
+// they're given different buttons they diverge, and each is emulated in full, until episodes end at the same time and they meet
+// again at the reset point.  This only saves work while instances are given the same buttons (early in training, or with few
+// distinct actions); it doesn't make divergent rollouts any faster.  The results are exactly those of running every instance: the
+// emulator is deterministic.  Only the host's frame counter (GameBoy::GetFrameOutputCount) goes up differently, so reward
+// functions shouldn't go by it.
+//
+//@TODO: divergent instances (a structure-of-arrays CPU running 8/16 instances per core, bit-exact with Cpu); not done yet
+class VectorEnvironment
+{
+public:
+	// Scores an instance after its step, and sets episodeOver to end the episode.  Called from the pool's threads, for different
+	// instances at once.  PeekMemory reads the game's variables.
+	typedef std::function<float (int instanceIndex, const GameBoy& gb, bool& episodeOver)> RewardFunction;
+
+	// 0 threads means one per hardware thread.  The instances start at power-on, which is also the reset point until SetResetPoint.
+	VectorEnvironment(const std::shared_ptr<Rom>& pRom, int numInstances, int numThreads = 0)
+		: m_pPool(std::make_shared<WorkStealingPool>(numThreads))
+		, m_framesPerStep(1)
+		, m_observeFrame(true)
+		, m_observationSize(0)
+		, m_rewards(numInstances, 0.0f)
+		, m_episodeOver(numInstances, 0)
+		, m_sameStateLeaders(numInstances)
+		, m_stepLeaders(numInstances)
+		, m_hasFollowers(numInstances, 0)
+		, m_leaderStates(numInstances)
+		, m_leaderFrames(numInstances)
+	{
+		SDL_assert(numInstances > 0);
+		auto pFirst = std::make_shared<GameBoy>(pRom);
+		pFirst->SetAudioSynthesisEnabled(false);
+		m_instances.push_back(pFirst);
+		for (int i = 1; i < numInstances; ++i)
+		{
+			m_instances.push_back(pFirst->Fork());
+		}
+
+		SetObservation(true, std::vector<Uint16>());
+		SetResetPoint(0);
+		ForgetSharedStates();
+	}
+
+	int GetNumInstances() const
+	{
+		return static_cast<int>(m_instances.size());
+	}
+
+	// For getting an instance to where episodes should start, before SetResetPoint.  Every instance is emulated from then until Reset.
+	GameBoy& GetInstance(int instanceIndex)
+	{
+		ForgetSharedStates();
+		return *m_instances[instanceIndex];
+	}
+
+	// How many frames each Step runs with the same buttons held
+	void SetFramesPerStep(int frames)
+	{
+		SDL_assert(frames > 0);
+		m_framesPerStep = frames;
+	}
+
+	int GetFramesPerStep() const
+	{
+		return m_framesPerStep;
+	}
+
+	// Each instance's observation is the frame, Lcd::kScreenWidth x Lcd::kScreenHeight bytes of Gray8, if observeFrame is set,
+	// followed by a byte from each of these addresses.  Set this up before SetResetPoint, which saves the frame in this format.
+	void SetObservation(bool observeFrame, const std::vector<Uint16>& ramAddresses)
+	{
+		m_observeFrame = observeFrame;
+		m_observedAddresses = ramAddresses;
+
+		for (size_t i = 0; i < m_instances.size(); ++i)
+		{
+			// Without the frame, nothing needs converting
+			m_instances[i]->SetFrameOutputFormat(observeFrame ? FrameOutputFormat::Gray8 : FrameOutputFormat::None);
+		}
+
+		m_observationSize = (observeFrame ? kFrameObservationSize : 0) + m_observedAddresses.size();
+		m_observations.assign(m_observationSize * m_instances.size(), 0);
+	}
+
+	size_t GetObservationSize() const
+	{
+		return m_observationSize;
+	}
+
+	void SetRewardFunction(const RewardFunction& rewardFunction)
+	{
+		m_rewardFunction = rewardFunction;
+	}
+
+	// Episodes start from wherever this instance is now
+	void SetResetPoint(int instanceIndex)
+	{
+		GameBoy& gb = *m_instances[instanceIndex];
+		gb.SaveState(m_resetState);
+		m_resetFrame.assign(gb.GetFrameOutput(), gb.GetFrameOutput() + gb.GetFrameOutputSize());
+	}
+
+	// Puts every instance back to the reset point, with its observation filled in and no reward
+	void Reset()
+	{
+		RunOnPool([this] (int instanceIndex)
+		{
+			ResetInstance(instanceIndex);
+			m_rewards[instanceIndex] = 0.0f;
+			m_episodeOver[instanceIndex] = 0;
+			WriteObservation(instanceIndex);
+		});
+
+		for (size_t i = 0; i < m_sameStateLeaders.size(); ++i)
+		{
+			m_sameStateLeaders[i] = 0;
+		}
+	}
+
+	// One combination of JoypadButton values per instance.  Throws if any instance does; the others still finish their step.
+	void Step(const Uint8* pButtons)
+	{
+		// Exactly one frame's worth of cycles per Update; the float is exact
+		const float kSecondsPerFrame = static_cast<float>(Lcd::kCyclesPerFrame) / MemoryBus::kCyclesPerSecond;
+
+		// Instances in the same state given the same buttons form a group, led by the first of them
+		std::map<std::pair<int, Uint8>, int> groupLeaders;
+		for (int i = 0; i < GetNumInstances(); ++i)
+		{
+			std::pair<int, Uint8> key(m_sameStateLeaders[i], pButtons[i]);
+			auto it = groupLeaders.find(key);
+			if (it == groupLeaders.end())
+			{
+				it = groupLeaders.insert(std::make_pair(key, i)).first;
+			}
+			m_stepLeaders[i] = it->second;
+			m_hasFollowers[i] = 0;
+			m_hasFollowers[it->second] |= (it->second != i) ? 1 : 0;
+		}
+
+		// The leaders run, and save where they got to for the rest of their groups
+		RunOnPool([this, pButtons, kSecondsPerFrame] (int instanceIndex)
+		{
+			if (m_stepLeaders[instanceIndex] != instanceIndex)
+			{
+				return;
+			}
+
+			GameBoy& gb = *m_instances[instanceIndex];
+			gb.SetJoypadButtons(pButtons[instanceIndex]);
+			for (int frame = 0; frame < m_framesPerStep; ++frame)
+			{
+				gb.Update(kSecondsPerFrame);
+			}
+
+			if (m_hasFollowers[instanceIndex])
+			{
+				gb.SaveState(m_leaderStates[instanceIndex]);
+				m_leaderFrames[instanceIndex].assign(gb.GetFrameOutput(), gb.GetFrameOutput() + gb.GetFrameOutputSize());
+			}
+		});
+
+		// Then everyone catches up to their leader, and is scored
+		RunOnPool([this, pButtons] (int instanceIndex)
+		{
+			GameBoy& gb = *m_instances[instanceIndex];
+			int leader = m_stepLeaders[instanceIndex];
+			if (leader != instanceIndex)
+			{
+				gb.SetJoypadButtons(pButtons[instanceIndex]);
+				gb.LoadState(m_leaderStates[leader]);
+				gb.RestoreFrameOutput(m_leaderFrames[leader].data(), m_leaderFrames[leader].size());
+			}
+
+			bool episodeOver = false;
+			m_rewards[instanceIndex] = m_rewardFunction ? m_rewardFunction(instanceIndex, gb, episodeOver) : 0.0f;
+			m_episodeOver[instanceIndex] = episodeOver ? 1 : 0;
+			if (episodeOver)
+			{
+				ResetInstance(instanceIndex);
+			}
+
+			WriteObservation(instanceIndex);
+		});
+
+		// Group members still together lead on from the first of them; the ones that were reset are together at the reset point
+		std::vector<int> newLeaders(m_stepLeaders.size(), -1);
+		int firstReset = -1;
+		for (size_t i = 0; i < m_sameStateLeaders.size(); ++i)
+		{
+			int& newLeader = m_episodeOver[i] ? firstReset : newLeaders[m_stepLeaders[i]];
+			if (newLeader < 0)
+			{
+				newLeader = static_cast<int>(i);
+			}
+			m_sameStateLeaders[i] = newLeader;
+		}
+	}
+
+	// GetNumInstances() rows of GetObservationSize() bytes
+	const Uint8* GetObservations() const
+	{
+		return m_observations.data();
+	}
+
+	const float* GetRewards() const
+	{
+		return m_rewards.data();
+	}
+
+	// 1 where the last step ended an episode, and the instance was reset
+	const Uint8* GetEpisodeOver() const
+	{
+		return m_episodeOver.data();
+	}
+
+private:
+	static const int kFrameObservationSize = Lcd::kScreenWidth * Lcd::kScreenHeight;
+
+	// Each pool task takes a run of instances, a few runs per thread, so one slow instance doesn't leave the rest idle
+	void RunOnPool(const std::function<void (int instanceIndex)>& function)
+	{
+		int numInstances = GetNumInstances();
+		int numTasks = SDL_min(numInstances, m_pPool->GetNumThreads() * 4);
+
+		std::string error;
+		std::mutex errorMutex;
+		for (int task = 0; task < numTasks; ++task)
+		{
+			int begin = numInstances * task / numTasks;
+			int end = numInstances * (task + 1) / numTasks;
+			const std::function<void (int)>* pFunction = &function;
+			std::string* pError = &error;
+			std::mutex* pErrorMutex = &errorMutex;
+			m_pPool->Submit([=]
+			{
+				for (int i = begin; i < end; ++i)
+				{
+					try
+					{
+						(*pFunction)(i);
+					}
+					catch (const Exception& e)
+					{
+						std::lock_guard<std::mutex> lock(*pErrorMutex);
+						if (pError->empty())
+						{
+							*pError = Format("Instance %d: %s", i, e.GetMessage());
+						}
+					}
+				}
+			});
+		}
+		m_pPool->Wait();
+
+		if (!error.empty())
+		{
+			throw Exception("%s", error.c_str());
+		}
+	}
+
+	// Every instance on its own, as far as anyone knows
+	void ForgetSharedStates()
+	{
+		for (size_t i = 0; i < m_sameStateLeaders.size(); ++i)
+		{
+			m_sameStateLeaders[i] = static_cast<int>(i);
+		}
+	}
+
+	void ResetInstance(int instanceIndex)
+	{
+		GameBoy& gb = *m_instances[instanceIndex];
+		gb.LoadState(m_resetState);
+		gb.RestoreFrameOutput(m_resetFrame.data(), m_resetFrame.size());
+	}
+
+	void WriteObservation(int instanceIndex)
+	{
+		const GameBoy& gb = *m_instances[instanceIndex];
+		Uint8* pObservation = m_observations.data() + instanceIndex * m_observationSize;
+
+		if (m_observeFrame)
+		{
+			for (int y = 0; y < Lcd::kScreenHeight; ++y)
+			{
+				memcpy(pObservation, gb.GetFrameOutput() + y * gb.GetFrameOutputPitch(), Lcd::kScreenWidth);
+				pObservation += Lcd::kScreenWidth;
+			}
+		}
+
+		for (size_t i = 0; i < m_observedAddresses.size(); ++i)
+		{
+			pObservation[i] = gb.PeekMemory(m_observedAddresses[i]);
+		}
+	}
+
+	std::vector<std::shared_ptr<GameBoy>> m_instances;
+	std::shared_ptr<WorkStealingPool> m_pPool;
+	int m_framesPerStep;
+
+	bool m_observeFrame;
+	std::vector<Uint16> m_observedAddresses;
+	size_t m_observationSize;
+	RewardFunction m_rewardFunction;
+
+	std::vector<Uint8> m_resetState;
+	std::vector<Uint8> m_resetFrame;
+
+	std::vector<Uint8> m_observations;
+	std::vector<float> m_rewards;
+	std::vector<Uint8> m_episodeOver;
+
+	std::vector<int> m_sameStateLeaders; // the first instance known to be in the same state, going into the next step
+	std::vector<int> m_stepLeaders; // the instance emulated on behalf of this one, this step
+	std::vector<Uint8> m_hasFollowers;
+	std::vector<std::vector<Uint8>> m_leaderStates;
+	std::vector<std::vector<Uint8>> m_leaderFrames;
+};
@@ -0,0 +1,161 @@
+#pragma once
+
+#include "AudioSink.h"
+
+#include "Utils.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+// Writes 16-bit stereo PCM to a .wav file.  The producer only appends to a memory buffer and hands it over in large chunks; a writer
+// thread does the file I/O, so a slow disk never stalls emulation.  The header's sizes are filled in when the sink is destroyed.
+class WavFileAudioSink : public IAudioSink
+{
+public:
+	WavFileAudioSink(const char* pFileName)
+		: m_pFile(nullptr)
+		, m_sampleRate(0)
+		, m_numDataBytes(0)
+		, m_writerThreadQuit(false)
+	{
+		fopen_s(&m_pFile, pFileName, "wb");
+		if (!m_pFile)
+		{
+			throw Exception("Couldn't open %s for writing", pFileName);
+		}
+
+		// Placeholder until the sizes are known
+		WriteHeader();
+
+		m_writerThread = std::thread(&WavFileAudioSink::WriterThreadMain, this);
+	}
+
+	~WavFileAudioSink()
+	{
+		SubmitBuffer();
+
+		{
+			std::lock_guard<std::mutex> lock(m_writerMutex);
+			m_writerThreadQuit = true;
+		}
+		m_samplesAvailable.notify_one();
+		m_writerThread.join();
+
+		fseek(m_pFile, 0, SEEK_SET);
+		WriteHeader();
+		fclose(m_pFile);
+	}
+
+	// Only the last rate set ends up in the header
+	virtual void SetSampleRate(int sampleRate)
+	{
+		m_sampleRate = sampleRate;
+	}
+
+	virtual void WriteFrames(const Sint16* pFrames, int numFrames)
+	{
+		m_buffer.insert(m_buffer.end(), pFrames, pFrames + numFrames * kNumChannels);
+		if (m_buffer.size() >= kWriteChunkSamples)
+		{
+			SubmitBuffer();
+		}
+	}
+
+private:
+	static const size_t kWriteChunkSamples = 64 * 1024;
+	static const int kHeaderSize = 44;
+
+	void SubmitBuffer()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_writerMutex);
+			m_queuedSamples.insert(m_queuedSamples.end(), m_buffer.begin(), m_buffer.end());
+		}
+		m_buffer.clear();
+		m_samplesAvailable.notify_one();
+	}
+
+	void WriterThreadMain()
+	{
+		std::vector<Sint16> samples;
+		for (;;)
+		{
+			{
+				std::unique_lock<std::mutex> lock(m_writerMutex);
+				while (m_queuedSamples.empty() && !m_writerThreadQuit)
+				{
+					m_samplesAvailable.wait(lock);
+				}
+
+				// Everything submitted before the quit request still gets written
+				if (m_queuedSamples.empty())
+				{
+					return;
+				}
+
+				samples.swap(m_queuedSamples);
+			}
+
+			// WAV data is little-endian
+			for (size_t i = 0; i < samples.size(); ++i)
+			{
+				samples[i] = SDL_SwapLE16(samples[i]);
+			}
+
+			fwrite(samples.data(), sizeof(Sint16), samples.size(), m_pFile);
+			m_numDataBytes += static_cast<Uint32>(samples.size() * sizeof(Sint16));
+			samples.clear();
+		}
+	}
+
+	static void PutLE16(Uint8* pDestination, Uint16 value)
+	{
+		pDestination[0] = static_cast<Uint8>(value);
+		pDestination[1] = static_cast<Uint8>(value >> 8);
+	}
+
+	static void PutLE32(Uint8* pDestination, Uint32 value)
+	{
+		PutLE16(pDestination, static_cast<Uint16>(value));
+		PutLE16(pDestination + 2, static_cast<Uint16>(value >> 16));
+	}
+
+	void WriteHeader()
+	{
+		const Uint16 bytesPerFrame = kNumChannels * sizeof(Sint16);
+
+		Uint8 header[kHeaderSize];
+		memcpy(header + 0, "RIFF", 4);
+		PutLE32(header + 4, kHeaderSize - 8 + m_numDataBytes);
+		memcpy(header + 8, "WAVE", 4);
+
+		memcpy(header + 12, "fmt ", 4);
+		PutLE32(header + 16, 16);
+		PutLE16(header + 20, 1); // PCM
+		PutLE16(header + 22, kNumChannels);
+		PutLE32(header + 24, m_sampleRate);
+		PutLE32(header + 28, m_sampleRate * bytesPerFrame);
+		PutLE16(header + 32, bytesPerFrame);
+		PutLE16(header + 34, 16);
+
+		memcpy(header + 36, "data", 4);
+		PutLE32(header + 40, m_numDataBytes);
+
+		fwrite(header, sizeof(header), 1, m_pFile);
+	}
+
+	FILE* m_pFile;
+	int m_sampleRate;
+	Uint32 m_numDataBytes; // only touched by the writer thread until it's joined
+
+	std::vector<Sint16> m_buffer; // producer side, not submitted yet
+
+	std::thread m_writerThread;
+	std::mutex m_writerMutex;
+	std::condition_variable m_samplesAvailable;
+	bool m_writerThreadQuit;
+	std::vector<Sint16> m_queuedSamples;
+};
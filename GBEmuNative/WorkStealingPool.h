@@ -0,0 +1,166 @@
+#pragma once
+
+#include "SDL.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads, each with its own queue of tasks.  Workers take from the back of their own queue and, once it's
+// empty, steal from the front of the others', so a worker stuck with a few long tasks doesn't hold up the rest.  Meant for coarse
+// tasks (a whole emulation run each), so the queues are plain mutex-guarded deques.  Tasks must not throw.
+class WorkStealingPool
+{
+public:
+	// 0 threads means one per hardware thread
+	WorkStealingPool(int numThreads = 0)
+		: m_numUnfinished(0)
+		, m_quit(false)
+		, m_nextQueue(0)
+	{
+		m_numQueued = 0;
+
+		if (numThreads <= 0)
+		{
+			numThreads = SDL_max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+		}
+
+		for (int i = 0; i < numThreads; ++i)
+		{
+			m_queues.push_back(std::make_shared<WorkerQueue>());
+		}
+		for (int i = 0; i < numThreads; ++i)
+		{
+			m_threads.push_back(std::thread(&WorkStealingPool::WorkerMain, this, i));
+		}
+	}
+
+	// Finishes everything submitted first
+	~WorkStealingPool()
+	{
+		Wait();
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_quit = true;
+		}
+		m_taskAvailable.notify_all();
+
+		for (size_t i = 0; i < m_threads.size(); ++i)
+		{
+			m_threads[i].join();
+		}
+	}
+
+	int GetNumThreads() const
+	{
+		return static_cast<int>(m_threads.size());
+	}
+
+	// Tasks are dealt out to the workers' queues in turn
+	void Submit(std::function<void()> task)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			WorkerQueue& queue = *m_queues[m_nextQueue];
+			m_nextQueue = (m_nextQueue + 1) % m_queues.size();
+			{
+				std::lock_guard<std::mutex> queueLock(queue.mutex);
+				queue.tasks.push_back(task);
+			}
+			++m_numQueued;
+			++m_numUnfinished;
+		}
+		m_taskAvailable.notify_one();
+	}
+
+	// Blocks until every task submitted so far has finished
+	void Wait()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (m_numUnfinished > 0)
+		{
+			m_allDone.wait(lock);
+		}
+	}
+
+private:
+	struct WorkerQueue
+	{
+		std::mutex mutex;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	// Own queue first, newest task first; then the other queues, oldest task first
+	bool TakeTask(int workerIndex, std::function<void()>& task)
+	{
+		int numQueues = static_cast<int>(m_queues.size());
+		for (int i = 0; i < numQueues; ++i)
+		{
+			WorkerQueue& queue = *m_queues[(workerIndex + i) % numQueues];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			if (!queue.tasks.empty())
+			{
+				if (i == 0)
+				{
+					task.swap(queue.tasks.back());
+					queue.tasks.pop_back();
+				}
+				else
+				{
+					task.swap(queue.tasks.front());
+					queue.tasks.pop_front();
+				}
+				--m_numQueued;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void WorkerMain(int workerIndex)
+	{
+		for (;;)
+		{
+			std::function<void()> task;
+			if (TakeTask(workerIndex, task))
+			{
+				task();
+
+				std::lock_guard<std::mutex> lock(m_mutex);
+				if (--m_numUnfinished == 0)
+				{
+					m_allDone.notify_all();
+				}
+				continue;
+			}
+
+			// Submit bumps the count under this lock before notifying, so a task can't slip in between the check and the wait
+			std::unique_lock<std::mutex> lock(m_mutex);
+			while ((m_numQueued == 0) && !m_quit)
+			{
+				m_taskAvailable.wait(lock);
+			}
+			if ((m_numQueued == 0) && m_quit)
+			{
+				return;
+			}
+		}
+	}
+
+	std::vector<std::shared_ptr<WorkerQueue>> m_queues;
+	std::vector<std::thread> m_threads;
+
+	std::mutex m_mutex; // guards everything below but m_numQueued
+	std::condition_variable m_taskAvailable;
+	std::condition_variable m_allDone;
+	std::atomic<int> m_numQueued; // incremented under m_mutex, decremented by whichever worker takes the task
+	int m_numUnfinished;
+	bool m_quit;
+	size_t m_nextQueue;
+};
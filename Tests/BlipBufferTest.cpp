@@ -0,0 +1,71 @@
+#include "BlipBuffer.h"
+#include "MemoryBus.h"
+
+#include <stdio.h>
+#include <vector>
+
+// Runs full-length blip frames with the sample rate raised and lowered the way dynamic rate control does (and past it, so the
+// buffer has to grow), stepping the level on the frame's last clock too.  Every step has to come out in the integrated output; a
+// step written outside the buffer wouldn't.  Built with AddressSanitizer where the compiler has it.
+
+static const Uint32 kFrameClocks = 65536;
+static const int kSampleRate = 44100;
+static const int kStepClocks = 1024;
+static const Sint32 kStep = 100;
+
+static bool RunFrames(double ratio)
+{
+	BlipBuffer blipBuffer;
+	blipBuffer.SetRates(MemoryBus::kCyclesPerSecond, kSampleRate, kFrameClocks);
+	blipBuffer.SetSampleRate(MemoryBus::kCyclesPerSecond, kSampleRate * ratio);
+
+	const int numSteppedFrames = 3;
+	const int numSilentFrames = 2;
+	Sint32 expectedLevel = 0;
+	Sint16 lastSample = 0;
+	std::vector<Sint16> samples(4096);
+	for (int frame = 0; frame < numSteppedFrames + numSilentFrames; ++frame)
+	{
+		if (frame < numSteppedFrames)
+		{
+			for (Uint32 clock = 0; clock < kFrameClocks; clock += kStepClocks)
+			{
+				blipBuffer.AddDelta(clock, kStep);
+				expectedLevel += kStep;
+			}
+			blipBuffer.AddDelta(kFrameClocks - 1, kStep);
+			expectedLevel += kStep;
+		}
+		blipBuffer.EndFrame(kFrameClocks);
+
+		int numSamples = blipBuffer.ReadSamples(samples.data(), static_cast<int>(samples.size()), 1);
+		int expectedSamples = static_cast<int>(static_cast<double>(kFrameClocks) * kSampleRate * ratio / MemoryBus::kCyclesPerSecond);
+		if ((numSamples < expectedSamples - 1) || (numSamples > expectedSamples + 1))
+		{
+			printf("Ratio %.3f, frame %d: read %d samples, expected about %d\n", ratio, frame, numSamples, expectedSamples);
+			return false;
+		}
+		lastSample = samples[numSamples - 1];
+	}
+
+	if (lastSample != expectedLevel)
+	{
+		printf("Ratio %.3f: ended at level %d, expected %d\n", ratio, lastSample, expectedLevel);
+		return false;
+	}
+	return true;
+}
+
+int main()
+{
+	const double ratios[] = { 1.0, 0.995, 1.003, 1.005, 1.05 };
+
+	bool succeeded = true;
+	for (size_t i = 0; i < sizeof(ratios) / sizeof(ratios[0]); ++i)
+	{
+		succeeded &= RunFrames(ratios[i]);
+	}
+
+	printf(succeeded ? "Passed\n" : "Failed\n");
+	return succeeded ? 0 : 1;
+}